@@ -18,12 +18,9 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <signal.h>
-#include <pthread.h>
 
 struct fuse *fuse;
 
-static pthread_mutex_t avfsd_mutexlock = PTHREAD_MUTEX_INITIALIZER;
-
 static int avfsd_getattr(const char *path, struct stat *stbuf)
 {
     int res;
@@ -48,28 +45,63 @@ static int avfsd_readlink(const char *path, char *buf, size_t size)
 }
 
 
-static int avfsd_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                         off_t offset, struct fuse_file_info *fi)
+static int avfsd_opendir(const char *path, struct fuse_file_info *fi)
 {
     DIR *dp;
-    struct dirent *de;
 
-    (void) offset;
-    (void) fi;
     dp = virt_opendir(path);
     if (dp == NULL)
         return -errno;
 
+    fi->fh = (unsigned long) dp;
+    return 0;
+}
+
+/* Offset mode: the handle stays open between calls and each entry is
+   passed with the position of the next one, so a listing can continue
+   where the kernel's buffer filled up without starting over */
+static int avfsd_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                         off_t offset, struct fuse_file_info *fi)
+{
+    DIR *dp = (DIR *) (unsigned long) fi->fh;
+    struct dirent *de;
+    long pos;
+
+    (void) path;
+
+    pos = virt_telldir(dp);
+    if (pos != offset) {
+        virt_seekdir(dp, offset);
+        pos = offset;
+    }
+
+    errno = 0;
     while((de = virt_readdir(dp)) != NULL) {
         struct stat st;
+        long next = virt_telldir(dp);
+
         memset(&st, 0, sizeof(st));
         st.st_ino = de->d_ino;
         st.st_mode = de->d_type << 12;
-        if (filler(buf, de->d_name, &st, 0))
-            break;
+        if (filler(buf, de->d_name, &st, next)) {
+            /* this entry did not fit, return it next time */
+            virt_seekdir(dp, pos);
+            return 0;
+        }
+        pos = next;
     }
+    if (errno != 0)
+        return -errno;
+
+    return 0;
+}
+
+static int avfsd_releasedir(const char *path, struct fuse_file_info *fi)
+{
+    (void) path;
+
+    virt_closedir((DIR *) (unsigned long) fi->fh);
 
-    virt_closedir(dp);
     return 0;
 }
 
@@ -214,15 +246,9 @@ static int avfsd_read(const char *path, char *buf, size_t size, off_t offset,
 
     (void) path;
 
-    pthread_mutex_lock( &avfsd_mutexlock );
-    if (virt_lseek(fi->fh, offset, SEEK_SET) == -1) {
-        pthread_mutex_unlock( &avfsd_mutexlock );
-        return -errno;
-    }
-
-    res = virt_read(fi->fh, buf, size);
-    pthread_mutex_unlock( &avfsd_mutexlock );
-
+    /* positional read, only the file handle itself is locked so
+       independent handles can be read in parallel */
+    res = virt_pread(fi->fh, buf, size, offset);
     if (res == -1)
         return -errno;
 
@@ -236,15 +262,7 @@ static int avfsd_write(const char *path, const char *buf, size_t size,
 
     (void) path;
 
-    pthread_mutex_lock( &avfsd_mutexlock );
-    if (virt_lseek(fi->fh, offset, SEEK_SET) == -1) {
-        pthread_mutex_unlock( &avfsd_mutexlock );
-        return -errno;
-    }
-
-    res = virt_write(fi->fh, buf, size);
-    pthread_mutex_unlock( &avfsd_mutexlock );
-
+    res = virt_pwrite(fi->fh, buf, size, offset);
     if (res == -1)
         return -errno;
 
@@ -255,9 +273,7 @@ static int avfsd_release(const char *path, struct fuse_file_info *fi)
 {
     (void) path;
 
-    pthread_mutex_lock( &avfsd_mutexlock );
     virt_close(fi->fh);
-    pthread_mutex_unlock( &avfsd_mutexlock );
 
     return 0;
 }
@@ -289,7 +305,9 @@ static int avfsd_create(const char *path, mode_t mode, struct fuse_file_info *fi
 static struct fuse_operations avfsd_oper = {
     getattr:	avfsd_getattr,
     readlink:	avfsd_readlink,
+    opendir:	avfsd_opendir,
     readdir:	avfsd_readdir,
+    releasedir:	avfsd_releasedir,
     mknod:	avfsd_mknod,
     mkdir:	avfsd_mkdir,
     symlink:	avfsd_symlink,
@@ -21,6 +21,8 @@ struct archparams {
     int (*parse) (void *data, ventry *ent, struct archive *arch);
     int (*open) (ventry *ve, struct archfile *fil);
     int (*close) (struct archfile *fil);
+    /* read is called without the archive lock held, any node state
+       changed while reading must be protected by archnode->lock */
     avssize_t (*read)  (vfile *vf, char *buf, avsize_t nbyte);
     void (*release) (struct archive *arch, struct archnode *nod);
 };
@@ -39,6 +41,7 @@ struct archnode {
     
     int numopen;
 
+    avmutex lock;      /* Protects node data modified during read */
     void *data;
 };
 
@@ -47,8 +50,6 @@ struct archfile {
     struct archive *arch;
     struct archnode *nod;
     struct entry *ent;     /* Only for readdir */
-    struct entry *curr;
-    int currn;
     void *data;
 };
 
@@ -120,6 +120,8 @@ struct avfs {
                          
     int       (*access)  (ventry *ve, int amode);
     int       (*readlink)(ventry *ve, char **bufp);
+    int       (*statent) (ventry *ve, struct avstat *buf, int attrmask,
+                          int flags);
     int       (*symlink) (const char *path, ventry *newve);
     int       (*unlink)  (ventry *ve);
     int       (*rmdir)   (ventry *ve);
@@ -166,6 +168,10 @@ typedef struct {
 
 #define AV_NEW(ptr)   ptr = av_calloc(sizeof(*(ptr)))
 
+/* For small objects allocated and freed often */
+#define AV_NEW_FIXED(ptr)  ptr = av_calloc_fixed(sizeof(*(ptr)))
+#define AV_FREE_FIXED(ptr) av_free_fixed(ptr, sizeof(*(ptr)))
+
 #define AV_NEW_OBJ(ptr, destr) \
    ptr = av_new_obj(sizeof(*(ptr)), (void (*)(void *)) destr)
 
@@ -310,6 +316,8 @@ void      *av_malloc(avsize_t nbyte);
 void      *av_calloc(avsize_t nbyte);
 void      *av_realloc(void *ptr, avsize_t nbyte);
 void       av_free(void *ptr);
+void      *av_calloc_fixed(avsize_t nbyte);
+void       av_free_fixed(void *ptr, avsize_t nbyte);
          
 void      *av_new_obj(avsize_t nbyte, void (*destr)(void *));
 void       av_ref_obj(void *obj);
@@ -320,6 +328,7 @@ void       av_obj_set_destr_locked(void *obj, void (*destr)(void *));
 char      *av_strdup(const char *s);
 char      *av_strndup(const char *s, avsize_t len);
 char      *av_stradd(char *s1, ...);
+unsigned int av_strhash(const char *s);
           
 void       av_registerfd(int fd);
 void       av_curr_time(avtimestruc_t *tim);
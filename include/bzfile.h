@@ -18,3 +18,5 @@ avssize_t av_bzfile_pread(struct bzfile *fil, struct bzcache *zc, char *buf,
 struct bzfile *av_bzfile_new(vfile *vf);
 int av_bzfile_size(struct bzfile *fil, struct bzcache *zc, avoff_t *sizep);
 struct bzcache *av_bzcache_new();
+void av_bzfile_set_threads(int numthreads);
+int av_bzfile_get_threads();
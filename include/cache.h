@@ -13,6 +13,17 @@ struct cacheobj;
 
 void av_cache_checkspace();
 void av_cache_diskfull();
+avoff_t av_cache_limit();
+
+/**
+ * Memory caches accounted in the cache usage.  The shrink function
+ * frees the least recently used part of the memory cache, and returns
+ * zero if it was empty.  It is called without any cache lock held.
+ */
+typedef int (*cache_shrink_func) (void);
+
+void av_cache_add_shrinker(cache_shrink_func shrink);
+void av_cache_add_usage(avoff_t diff);
 
 /**
  * cache V1 interface using external cache objects
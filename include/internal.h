@@ -27,9 +27,21 @@ void av_init_logstat();
 void av_init_cache();
 void av_check_malloc();
 void av_init_filecache();
+void av_init_dcache();
+void av_init_pagecache();
 void av_do_exit();
 
 void av_avfsstat_register(const char *path, struct statefile *func);
 int av_get_symlink_rewrite();
 
 int av_avfs_implements_readdir( const struct avfs *avfs );
+
+int av_dcache_generation();
+void av_dcache_invalidate();
+int av_dcache_get_prefix(const char *path, int len, ventry **vep,
+                         char **prevsegp, int *first_segp);
+void av_dcache_set_prefix(const char *path, int len, ventry *ve,
+                          const char *prevseg, int first_seg, int gen);
+int av_dcache_get_negative(const char *path, int resolvelast);
+void av_dcache_set_negative(const char *path, int resolvelast, int err,
+                            int gen);
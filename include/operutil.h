@@ -26,6 +26,9 @@ int av_fd_open(const char *path, int flags, avmode_t mode);
 int av_fd_close(int fd);
 avssize_t av_fd_read(int fd, void *buf, avsize_t nbyte);
 avssize_t av_fd_write(int fd, const char *buf, avsize_t nbyte);
+avssize_t av_fd_pread(int fd, void *buf, avsize_t nbyte, avoff_t offset);
+avssize_t av_fd_pwrite(int fd, const char *buf, avsize_t nbyte,
+                       avoff_t offset);
 avoff_t av_fd_lseek(int fd, avoff_t offset, int whence);
 int av_fd_readdir(int fd, struct avdirent *buf, avoff_t *posp);
 int av_fd_getattr(int fd, struct avstat *buf, int attrmask);
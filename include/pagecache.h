@@ -0,0 +1,22 @@
+/*
+    AVFS: A Virtual File System Library
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+#include "avfs.h"
+
+/* Decompressed data of the compressed file readers, in pages keyed by
+   the id of the stream cache and the offset.  The memory used is
+   accounted in the cache usage. */
+
+#define AV_PAGECACHE_PAGESIZE 65536
+
+typedef avssize_t (*pagecache_read_func) (void *fil, void *cache, char *buf,
+                                          avsize_t nbyte, avoff_t offset);
+
+avssize_t av_pagecache_pread(int id, pagecache_read_func readfn, void *fil,
+                             void *cache, char *buf, avsize_t nbyte,
+                             avoff_t offset);
+void av_pagecache_forget(int id);
@@ -8,9 +8,15 @@
 
 #include "avfs.h"
 
+/* The attributes which tell whether a file changed since a copy was
+   made of it.  The size is not compared, getting it may need a
+   compressed file to be read. */
+#define REALFILE_SIGMASK (AVA_INO | AVA_DEV | AVA_MTIME)
+
 struct realfile {
     char *name;
     int is_tmp;
 };
 
 int av_get_realfile(ventry *ve, struct realfile **resp);
+int av_realfile_same(struct avstat *sig, struct avstat *stbuf);
@@ -0,0 +1,27 @@
+/*
+    AVFS: A Virtual File System Library
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+#include "avfs.h"
+
+/* Table of decoder checkpoints sorted by uncompressed offset.  Every
+   entry must start with the avoff_t offset it is sorted by.  Entries
+   move when the table changes, so pointers to them are only valid
+   until the next addition or removal. */
+struct seekindex {
+    char *ents;
+    avsize_t entsize;
+    unsigned int num;
+    unsigned int alloc;
+};
+
+void av_seekindex_init(struct seekindex *si, avsize_t entsize);
+void av_seekindex_free(struct seekindex *si);
+void *av_seekindex_get(struct seekindex *si, unsigned int n);
+int av_seekindex_lookup(struct seekindex *si, avoff_t offset);
+void *av_seekindex_find(struct seekindex *si, avoff_t offset);
+void *av_seekindex_add(struct seekindex *si, avoff_t offset);
+void av_seekindex_del(struct seekindex *si, unsigned int n);
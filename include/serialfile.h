@@ -10,12 +10,19 @@
 
 #define SFILE_NOCACHE (1 << 0)
 
+/* Sources which can read any part of the file have fetch and size.
+   Size returns the size of the file or -ENOSYS if the source can only
+   be read serially after all, fetch returns the number of bytes read
+   at offset, which may be less than asked for. */
 struct sfilefuncs {
     int       (*startget) (void *data, void **resp);
     avssize_t (*read)     (void *data, char *buf, avsize_t nbyte);
     int       (*startput) (void *data, void **resp);
     avssize_t (*write)    (void *data, const char *buf, avsize_t nbyte);
     int       (*endput)   (void *data);
+    avssize_t (*fetch)    (void *data, char *buf, avsize_t nbyte,
+                           avoff_t offset);
+    avoff_t   (*size)     (void *data);
 };
 
 struct sfile;
@@ -0,0 +1,22 @@
+/*
+    AVFS: A Virtual File System Library
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+#include "avfs.h"
+
+/* Decoder states parked by the compressed file readers, so that a
+   file read again from where a closed or seeking reader left off need
+   not be decompressed from a checkpoint.  Streams are identified by
+   the id of their cache and their uncompressed offset. */
+
+typedef void (*streamcache_release_func) (void *stream);
+
+int av_streamcache_newid(void);
+void av_streamcache_put(int id, avoff_t offset, void *stream,
+                        avsize_t memsize, streamcache_release_func release);
+void *av_streamcache_get(int id, avoff_t offset, avoff_t maxdist,
+                         avoff_t *offsetp);
+void av_streamcache_forget(int id);
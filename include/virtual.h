@@ -45,12 +45,17 @@ int            virt_open      (const char *path, int flags, mode_t mode);
 int            virt_close     (int fh);
 ssize_t        virt_read      (int fh, void *buf, size_t nbyte);
 ssize_t        virt_write     (int fh, const void *buf, size_t nbyte);
+ssize_t        virt_pread     (int fh, void *buf, size_t nbyte, off_t offset);
+ssize_t        virt_pwrite    (int fh, const void *buf, size_t nbyte,
+                               off_t offset);
 off_t          virt_lseek     (int fh, off_t offset, int whence);
 
 DIR           *virt_opendir   (const char *path);
 int            virt_closedir  (DIR *dirp);
 struct dirent *virt_readdir   (DIR *dirp);
 void           virt_rewinddir (DIR *dirp);
+long           virt_telldir   (DIR *dirp);
+void           virt_seekdir   (DIR *dirp, long loc);
 
 int            virt_remove    (const char *path);
 int            virt_islocal   (const char *path);
@@ -23,4 +23,6 @@ enum av_zfile_data_type {
 
 struct zfile *av_zfile_new(vfile *vf, avoff_t dataoff, avuint crc, enum av_zfile_data_type data_type);
 struct zcache *av_zcache_new();
+struct zcache *av_zcache_new_persistent(const char *dir, const char *key,
+                                        const struct avstat *sig);
 avoff_t av_zcache_size(struct zcache *zc);
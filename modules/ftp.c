@@ -905,7 +905,7 @@ static int ftp_write_localfile(int fd, char *buf, avsize_t nbytes)
     return 0;
 }
 
-#define READBUF 4096
+#define READBUF 32768
 
 static int ftp_wait(struct remote *rem, void *data, avoff_t end)
 {
@@ -14,27 +14,51 @@
 #include "serialfile.h"
 #include "internal.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/socket.h>
 
 #define HTTP_READ_TIMEOUT 20000
 
+/* Idle connections kept open for each host */
+#define HTTP_MAX_IDLE 2
+
 struct httpentry;
+struct httpfs;
 
-struct httplocalfile {
+struct httpconn {
+    char *host;
+    int sock;
     struct filebuf *sockfb;
+    struct httpconn *next;
+};
+
+struct httplocalfile {
+    struct httpfs *fs;
+    struct httpconn *conn;
     struct httpentry *ent;
+    int status;
+    int keepalive;
+    avoff_t contentlength;
+    avoff_t rangestart;
+    avoff_t rangesize;
+    avoff_t bodyleft;           /* -1 if the body ends with the connection */
+    int chunked;
 };
 
 struct httpentry {
     char *url;
     struct cacheobj *cobj;
     avoff_t size;
+    int ranges;                 /* -1 if not yet known */
+    struct httplocalfile *pending;
     struct httpentry *next;
 };
 
 struct httpfs {
     struct httpentry *ents;
+    struct httpconn *idle;
     char *proxyname;
 };
 
@@ -48,7 +72,12 @@ static int write_socket(int sock, const char *buf, avsize_t buflen)
     int res;
 
     while(buflen > 0) {
+#ifdef MSG_NOSIGNAL
+        /* the server may have closed an idle connection */
+        res = send(sock, buf, buflen, MSG_NOSIGNAL);
+#else
         res = write(sock, buf, buflen);
+#endif
         if(res == -1)
             return -errno;
         
@@ -77,18 +106,18 @@ static int http_get_line(struct httplocalfile *lf, char **linep)
     char *line;
 
     while(1) {        
-        res = av_filebuf_readline(lf->sockfb, &line);
+        res = av_filebuf_readline(lf->conn->sockfb, &line);
         if(res < 0)
             return res;
         if(res == 1)
             break;
 
-        if(av_filebuf_eof(lf->sockfb)) {
+        if(av_filebuf_eof(lf->conn->sockfb)) {
             av_log(AVLOG_ERROR, "HTTP: connection closed in header");
             return -EIO;
         }
 
-        res = av_filebuf_check(&lf->sockfb, 1, HTTP_READ_TIMEOUT);
+        res = av_filebuf_check(&lf->conn->sockfb, 1, HTTP_READ_TIMEOUT);
         if(res < 0)
             return res;
 
@@ -121,6 +150,47 @@ static char *http_split_header(char *line)
     return s;
 }
 
+static int http_parse_offset(const char *s, avoff_t *offp, const char **endp)
+{
+    char *end;
+    avoff_t off;
+
+    if(!isdigit((unsigned char) *s))
+        return -1;
+
+    off = strtoll(s, &end, 10);
+    *offp = off;
+    *endp = end;
+
+    return 0;
+}
+
+/* Content-Range: bytes first-last/total */
+static void http_process_content_range(struct httplocalfile *lf,
+                                       const char *s)
+{
+    avoff_t first, last, total;
+
+    if(strncasecmp(s, "bytes", 5) != 0)
+        return;
+    for(s += 5; isspace((unsigned char) *s); s++);
+
+    if(*s == '*') {
+        s++;
+        first = 0;
+        last = -1;
+    }
+    else if(http_parse_offset(s, &first, &s) == -1 || *s != '-' ||
+            http_parse_offset(s + 1, &last, &s) == -1 || last < first)
+        return;
+
+    if(*s != '/' || http_parse_offset(s + 1, &total, &s) == -1)
+        return;
+
+    lf->rangestart = first;
+    lf->rangesize = total;
+}
+
 static void http_process_header_line(struct httplocalfile *lf, char *line)
 {
     char *s;
@@ -130,12 +200,23 @@ static void http_process_header_line(struct httplocalfile *lf, char *line)
     if(strcasecmp("content-length:", line) == 0) {
         char *end;
         avoff_t size;
-        size = strtol(s, &end, 10);
+        size = strtoll(s, &end, 10);
         while(*end && isspace((unsigned char) *end))
             end++;
         
         if(!*end)
-            lf->ent->size = size;
+            lf->contentlength = size;
+    }
+    else if(strcasecmp("content-range:", line) == 0)
+        http_process_content_range(lf, s);
+    else if(strcasecmp("connection:", line) == 0) {
+        if(strncasecmp(s, "close", 5) == 0)
+            lf->keepalive = 0;
+    }
+    else if(strcasecmp("transfer-encoding:", line) == 0) {
+        /* chunked bodies are not decoded, so their end is not known */
+        lf->keepalive = 0;
+        lf->chunked = 1;
     }
 }
 
@@ -199,6 +280,10 @@ static int http_process_status_line(struct httplocalfile *lf, char *line)
     
     av_log(AVLOG_DEBUG, "HTTP: status code: %i", statuscode);
 
+    lf->status = statuscode;
+    if(strncmp(line, "HTTP/1.0", 8) == 0)
+        lf->keepalive = 0;
+
     if(statuscode / 100 == 1) {
         res = http_ignore_header(lf);
         if(res < 0)
@@ -207,7 +292,9 @@ static int http_process_status_line(struct httplocalfile *lf, char *line)
         return 0;
     }
     
-    if(statuscode / 100 == 2)
+    /* beyond the end of the file, for an empty one the caller checks
+       Content-Range */
+    if(statuscode / 100 == 2 || statuscode == 416)
         return 1;
 
     av_log(AVLOG_WARNING, "HTTP: error: %s", s);
@@ -249,8 +336,17 @@ static int http_wait_response(struct httplocalfile *lf)
 
     do res = http_check_header_line(lf);
     while(res == 1);
+    if(res < 0)
+        return res;
 
-    return res;
+    if(lf->chunked)
+        lf->contentlength = -1;
+    if(lf->status == 416)
+        lf->bodyleft = -1;
+    else
+        lf->bodyleft = lf->contentlength;
+
+    return 0;
 }
 
 static const char *http_strip_resource_type(const char *url)
@@ -290,12 +386,14 @@ static char *http_url_host(const char *url)
         return av_strndup(s, t - s);
 }
 
-static int http_request_get(int sock, struct httpfile *fil)
+static int http_request_get(int sock, struct httpfile *fil, avoff_t start,
+                            avoff_t end)
 {
     int res;
     char *req;
     char *url;
     char *host;
+    char range[64];
     
     if(fil->fs->proxyname != NULL)
         url = av_strdup(fil->ent->url);
@@ -304,10 +402,14 @@ static int http_request_get(int sock, struct httpfile *fil)
 
     host = http_url_host(fil->ent->url);
 
+    range[0] = '\0';
+    if(start >= 0)
+        sprintf(range, "Range: bytes=%lli-%lli\r\n", start, end);
+
     req = av_stradd(NULL, 
                       "GET ", url, " HTTP/1.1\r\n",
-                      "Host: ", host, "\r\n"
-                      "Connection: close\r\n"
+                      "Host: ", host, "\r\n",
+                      range,
                       "\r\n",
                       NULL);
 
@@ -322,20 +424,63 @@ static int http_request_get(int sock, struct httpfile *fil)
     return res;
 }
 
+static void http_conn_free(struct httpconn *conn)
+{
+    av_unref_obj(conn->sockfb);
+    av_free(conn->host);
+}
 
-static void http_stop(struct httplocalfile *lf)
+/* Take an idle connection to host from the pool.  Connections which
+   became readable while idle were closed by the server. */
+static struct httpconn *http_get_idle(struct httpfs *fs, const char *host)
 {
-    av_unref_obj(lf->sockfb);
+    struct httpconn **cp;
+    struct httpconn *conn;
+
+    cp = &fs->idle;
+    while(*cp != NULL) {
+        conn = *cp;
+        if(strcmp(conn->host, host) != 0) {
+            cp = &conn->next;
+            continue;
+        }
+
+        *cp = conn->next;
+        conn->next = NULL;
+        if(av_filebuf_check(&conn->sockfb, 1, 0) == 0)
+            return conn;
+
+        av_unref_obj(conn);
+    }
+
+    return NULL;
 }
 
-static int http_start(void *data, void **resp)
+static void http_put_idle(struct httpfs *fs, struct httpconn *conn)
+{
+    struct httpconn *c;
+    int num = 0;
+
+    for(c = fs->idle; c != NULL; c = c->next) {
+        if(strcmp(c->host, conn->host) == 0)
+            num++;
+    }
+    if(num >= HTTP_MAX_IDLE) {
+        av_unref_obj(conn);
+        return;
+    }
+
+    conn->next = fs->idle;
+    fs->idle = conn;
+}
+
+static int http_connect(struct httpfile *fil, struct httpconn **connp,
+                        int *reusedp)
 {
     int res;
-    int sock;
     int defaultport;
     char *host;
-    struct httpfile *fil = (struct httpfile *) data;
-    struct httplocalfile *lf;
+    struct httpconn *conn;
 
     if(fil->fs->proxyname != NULL) {
         host = av_strdup(fil->fs->proxyname);
@@ -346,32 +491,108 @@ static int http_start(void *data, void **resp)
         defaultport = 80;
     }
 
+    conn = http_get_idle(fil->fs, host);
+    if(conn != NULL) {
+        av_free(host);
+        *connp = conn;
+        *reusedp = 1;
+        return 0;
+    }
+
     res = av_sock_connect(host, defaultport);
-    av_free(host);
-    if(res < 0)
+    if(res < 0) {
+        av_free(host);
         return res;
+    }
+    av_registerfd(res);
 
-    sock = res;
-    av_registerfd(sock);
+    AV_NEW_OBJ(conn, http_conn_free);
+    conn->host = host;
+    conn->sock = res;
+    conn->sockfb = av_filebuf_new(res, 0);
+    conn->next = NULL;
 
-    res = http_request_get(sock, fil);
-    if(res < 0) {
-        close(sock);
+    *connp = conn;
+    *reusedp = 0;
+
+    return 0;
+}
+
+static void http_stop(struct httplocalfile *lf)
+{
+    if(lf->keepalive && lf->bodyleft == 0)
+        http_put_idle(lf->fs, lf->conn);
+    else
+        av_unref_obj(lf->conn);
+}
+
+/* Send a GET request for the file, or for bytes start to end of it if
+   start is not negative, and read the header of the response */
+static int http_request(struct httpfile *fil, avoff_t start, avoff_t end,
+                        struct httplocalfile **lfp)
+{
+    int res;
+    int reused;
+    int status;
+    struct httpconn *conn;
+    struct httplocalfile *lf;
+
+    do {
+        res = http_connect(fil, &conn, &reused);
+        if(res < 0)
+            return res;
+
+        AV_NEW_OBJ(lf, http_stop);
+        lf->fs = fil->fs;
+        lf->conn = conn;
+        lf->ent = fil->ent;
+        lf->status = 0;
+        lf->keepalive = 1;
+        lf->contentlength = -1;
+        lf->rangestart = -1;
+        lf->rangesize = -1;
+        lf->bodyleft = -1;
+        lf->chunked = 0;
+
+        res = http_request_get(conn->sock, fil, start, end);
+        if(res == 0)
+            res = http_wait_response(lf);
+
+        status = lf->status;
+        if(res < 0)
+            av_unref_obj(lf);
+
+        /* the server may have closed the idle connection just now */
+    } while(res < 0 && reused && status == 0);
+
+    if(res < 0)
         return res;
+
+    *lfp = lf;
+    return 0;
+}
+
+static int http_start(void *data, void **resp)
+{
+    int res;
+    struct httpfile *fil = (struct httpfile *) data;
+    struct httplocalfile *lf;
+
+    /* the response to the first range request, if it was ignored */
+    lf = fil->ent->pending;
+    if(lf != NULL) {
+        fil->ent->pending = NULL;
+        *resp = lf;
+        return 0;
     }
 
     fil->ent->size = -1;
 
-    AV_NEW_OBJ(lf, http_stop);
-    lf->sockfb = av_filebuf_new(sock, 0);
-    lf->ent = fil->ent;
-
-    res = http_wait_response(lf);
-    if(res < 0) {
-        av_unref_obj(lf);
+    res = http_request(fil, -1, -1, &lf);
+    if(res < 0)
         return res;
-    }
 
+    fil->ent->size = lf->contentlength;
     *resp = lf;
     
     return 0;
@@ -382,15 +603,27 @@ static avssize_t http_sread(void *data, char *buf, avsize_t nbyte)
     avssize_t res;
     struct httplocalfile *lf = (struct httplocalfile *) data;
 
+    if(lf->bodyleft == 0)
+        return 0;
+    if(lf->bodyleft > 0 && nbyte > lf->bodyleft)
+        nbyte = lf->bodyleft;
+
     do {
-        res = av_filebuf_read(lf->sockfb, buf, nbyte);
+        res = av_filebuf_read(lf->conn->sockfb, buf, nbyte);
+        if(res > 0 && lf->bodyleft > 0)
+            lf->bodyleft -= res;
         if(res != 0)
             return res;
         
-        if(av_filebuf_eof(lf->sockfb))
+        if(av_filebuf_eof(lf->conn->sockfb)) {
+            if(lf->bodyleft > 0) {
+                av_log(AVLOG_ERROR, "HTTP: connection closed in body");
+                return -EIO;
+            }
             return 0;
+        }
         
-        res = av_filebuf_check(&lf->sockfb, 1, HTTP_READ_TIMEOUT);
+        res = av_filebuf_check(&lf->conn->sockfb, 1, HTTP_READ_TIMEOUT);
         if(res < 0)
             return res;
         
@@ -400,6 +633,82 @@ static avssize_t http_sread(void *data, char *buf, avsize_t nbyte)
     return -EIO;
 }
 
+static avssize_t http_fetch(void *data, char *buf, avsize_t nbyte,
+                            avoff_t offset)
+{
+    avssize_t res;
+    avsize_t got = 0;
+    struct httpfile *fil = (struct httpfile *) data;
+    struct httplocalfile *lf;
+
+    res = http_request(fil, offset, offset + nbyte - 1, &lf);
+    if(res < 0)
+        return res;
+
+    if(lf->status != 206 || lf->rangestart != offset) {
+        av_log(AVLOG_ERROR, "HTTP: bad response to range request");
+        av_unref_obj(lf);
+        return -EIO;
+    }
+
+    while(got < nbyte) {
+        res = http_sread(lf, buf + got, nbyte - got);
+        if(res < 0) {
+            av_unref_obj(lf);
+            return res;
+        }
+        if(res == 0)
+            break;
+
+        got += res;
+    }
+    av_unref_obj(lf);
+
+    return got;
+}
+
+/* Ask for the first byte to see if the server accepts range requests.
+   If it sends the whole file instead, the response is kept for
+   http_start(). */
+static avoff_t http_size(void *data)
+{
+    int res;
+    char c;
+    struct httpfile *fil = (struct httpfile *) data;
+    struct httpentry *ent = fil->ent;
+    struct httplocalfile *lf;
+
+    if(ent->ranges == -1) {
+        res = http_request(fil, 0, 0, &lf);
+        if(res < 0)
+            return res;
+
+        if((lf->status == 206 && lf->rangestart == 0 && lf->rangesize >= 0) ||
+           (lf->status == 416 && lf->rangesize == 0)) {
+            ent->ranges = 1;
+            ent->size = lf->rangesize;
+            if(lf->status == 206)
+                http_sread(lf, &c, 1);
+            av_unref_obj(lf);
+        }
+        else {
+            ent->ranges = 0;
+            if(lf->status == 200) {
+                ent->size = lf->contentlength;
+                av_unref_obj(ent->pending);
+                ent->pending = lf;
+            }
+            else
+                av_unref_obj(lf);
+        }
+    }
+
+    if(!ent->ranges)
+        return -ENOSYS;
+
+    return ent->size;
+}
+
 static struct sfile *http_get_serialfile(struct httpfile *fil)
 {
     struct sfile *sf;
@@ -407,7 +716,12 @@ static struct sfile *http_get_serialfile(struct httpfile *fil)
     struct httpentry *ent = fil->ent;
     static struct sfilefuncs func = {
         http_start,
-        http_sread
+        http_sread,
+        NULL,
+        NULL,
+        NULL,
+        http_fetch,
+        http_size
     };
 
     sf = (struct sfile *) av_cacheobj_get(ent->cobj);
@@ -425,14 +739,10 @@ static struct sfile *http_get_serialfile(struct httpfile *fil)
     return sf;
 }
 
-static void http_set_size(struct httpfile *fil, struct sfile *sf)
+static void http_set_size(struct httpfile *fil, avoff_t du)
 {
-    struct httpentry *ent = fil->ent;
-    avoff_t du;
-
-    du = av_sfile_diskusage(sf);
     if(du >= 0)
-        av_cacheobj_setsize(ent->cobj, du);
+        av_cacheobj_setsize(fil->ent->cobj, du);
 }
 
 static struct httpentry *http_get_entry(struct httpfs *fs, const char *url)
@@ -449,6 +759,9 @@ static struct httpentry *http_get_entry(struct httpfs *fs, const char *url)
     AV_NEW(ent);
     ent->url = av_strdup(url);
     ent->cobj = NULL;
+    ent->size = -1;
+    ent->ranges = -1;
+    ent->pending = NULL;
     ent->next = NULL;
     
     *ep = ent;
@@ -504,7 +817,7 @@ static int http_open(ventry *ve, int flags, avmode_t mode, void **resp)
 
     sf = http_get_serialfile(fil);
     res = av_sfile_startget(sf);
-    http_set_size(fil, sf);
+    http_set_size(fil, av_sfile_diskusage(sf));
     av_unref_obj(sf);
 
     if(res == 0) 
@@ -533,7 +846,7 @@ static avssize_t http_read(vfile *vf, char *buf, avsize_t nbyte)
 
     sf = http_get_serialfile(fil);
     res = av_sfile_pread(sf, buf, nbyte, vf->ptr);
-    http_set_size(fil, sf);
+    http_set_size(fil, av_sfile_diskusage(sf));
     av_unref_obj(sf);
 
     if(res > 0)
@@ -560,7 +873,7 @@ static int http_getattr(vfile *vf, struct avstat *buf, int attrmask)
         if(size == -1)
             size = av_sfile_size(sf);
 
-        http_set_size(fil, sf);
+        http_set_size(fil, av_sfile_diskusage(sf));
         av_unref_obj(sf);
     }
 
@@ -593,6 +906,7 @@ static void http_destroy(struct avfs *avfs)
 {
     struct httpentry *ent;
     struct httpentry *nextent;
+    struct httpconn *conn;
     struct httpfs *fs = (struct httpfs *) avfs->data;
 
     ent = fs->ents;
@@ -600,10 +914,17 @@ static void http_destroy(struct avfs *avfs)
         nextent = ent->next;
         av_free(ent->url);
         av_unref_obj(ent->cobj);
+        av_unref_obj(ent->pending);
         av_free(ent);
         ent = nextent;
     }
 
+    while(fs->idle != NULL) {
+        conn = fs->idle;
+        fs->idle = conn->next;
+        av_unref_obj(conn);
+    }
+
     av_free(fs->proxyname);
     av_free(fs);
 }
@@ -688,6 +1009,7 @@ int av_init_module_http(struct vmodule *module)
 
     AV_NEW(fs);
     fs->ents = NULL;
+    fs->idle = NULL;
     fs->proxyname = NULL;
     
     http_default_proxy(fs);
@@ -14,6 +14,9 @@
 #include "filecache.h"
 #include "oper.h"
 #include "version.h"
+#include "internal.h"
+#include <stdio.h>
+#include <stdlib.h>
 
 struct bznode {
     struct avstat sig;
@@ -80,30 +83,36 @@ static struct bznode *bz_do_get_node(ventry *ve, const char *key,
     return nod;
 }
 
-static int bz_getnode(ventry *ve, vfile *base, struct bznode **resp)
+static int bz_find_node(ventry *ve, struct avstat *stbuf,
+                        struct bznode **resp)
 {
     int res;
-    struct avstat stbuf;
-    const int attrmask = AVA_INO | AVA_DEV | AVA_SIZE | AVA_MTIME;
-    struct bznode *nod;
     char *key;
 
-    res = av_fgetattr(base, &stbuf, attrmask);
-    if(res < 0)
-        return res;
-
     res = av_filecache_getkey(ve, &key);
     if(res < 0)
         return res;
 
-    nod = bz_do_get_node(ve, key, &stbuf);
+    *resp = bz_do_get_node(ve, key, stbuf);
 
     av_free(key);
 
-    *resp = nod;
     return 0;
 }
 
+static int bz_getnode(ventry *ve, vfile *base, struct bznode **resp)
+{
+    int res;
+    struct avstat stbuf;
+    const int attrmask = AVA_INO | AVA_DEV | AVA_SIZE | AVA_MTIME;
+
+    res = av_fgetattr(base, &stbuf, attrmask);
+    if(res < 0)
+        return res;
+
+    return bz_find_node(ve, &stbuf, resp);
+}
+
 static int bz_lookup(ventry *ve, const char *name, void **newp)
 {
     char *path = (char *) ve->data;
@@ -191,6 +200,16 @@ static avssize_t bz_read(vfile *vf, char *buf, avsize_t nbyte)
     return res;
 }
 
+static void bz_set_attr(struct avfs *avfs, struct bznode *nod,
+                        struct avstat *buf)
+{
+    buf->mode &= ~(07000);
+    buf->blksize = 4096;
+    buf->dev = avfs->dev;
+    buf->ino = nod->ino;
+    buf->nlink = 1;
+}
+
 static int bz_getattr(vfile *vf, struct avstat *buf, int attrmask)
 {
     int res;
@@ -216,15 +235,75 @@ static int bz_getattr(vfile *vf, struct avstat *buf, int attrmask)
         buf->blocks = AV_BLOCKS(buf->size);
     }
 
-    buf->mode &= ~(07000);
-    buf->blksize = 4096;
-    buf->dev = vf->mnt->avfs->dev;
-    buf->ino = nod->ino;
-    buf->nlink = 1;
+    bz_set_attr(vf->mnt->avfs, nod, buf);
     
     return 0;
 }
 
+/* Without opening anything, unless the size is needed and not known */
+static int bz_statent(ventry *ve, struct avstat *buf, int attrmask,
+                      int flags)
+{
+    int res;
+    struct bznode *nod;
+    avoff_t size;
+    const int basemask = AVA_INO | AVA_DEV | AVA_SIZE | AVA_MODE | AVA_UID |
+        AVA_GID | AVA_MTIME | AVA_ATIME | AVA_CTIME;
+
+    res = av_getattr(ve->mnt->base, buf, basemask, 0);
+    if(res < 0)
+        return res;
+
+    res = bz_find_node(ve, buf, &nod);
+    if(res < 0)
+        return res;
+
+    if((attrmask & (AVA_SIZE | AVA_BLKCNT)) != 0) {
+        av_bzfile_size(NULL, nod->cache, &size);
+        if(size == -1) {
+            av_unref_obj(nod);
+            return -ENOSYS;
+        }
+
+        buf->size = size;
+        buf->blocks = AV_BLOCKS(buf->size);
+    }
+
+    bz_set_attr(ve->mnt->avfs, nod, buf);
+    av_unref_obj(nod);
+
+    return 0;
+}
+
+static int bz_threads_get(struct entry *ent, const char *param, char **retp)
+{
+    char buf[32];
+
+    sprintf(buf, "%i\n", av_bzfile_get_threads());
+    *retp = av_strdup(buf);
+
+    return 0;
+}
+
+static int bz_threads_set(struct entry *ent, const char *param,
+                          const char *val)
+{
+    int numthreads;
+    char *end;
+
+    numthreads = strtol(val, &end, 0);
+    if(end == val || numthreads < 0)
+        return -EINVAL;
+    if(*end == '\n')
+        end++;
+    if(*end != '\0')
+        return -EINVAL;
+
+    av_bzfile_set_threads(numthreads);
+
+    return 0;
+}
+
 extern int av_init_module_ubz2(struct vmodule *module);
 
 int av_init_module_ubz2(struct vmodule *module)
@@ -232,6 +311,8 @@ int av_init_module_ubz2(struct vmodule *module)
     int res;
     struct avfs *avfs;
     struct ext_info ubz_exts[6];
+    struct statefile statf;
+    const char *threadsenv;
 
     ubz_exts[0].from = ".tar.bz2",  ubz_exts[0].to = ".tar";
     ubz_exts[1].from = ".bz2",  ubz_exts[1].to = NULL;
@@ -244,8 +325,19 @@ int av_init_module_ubz2(struct vmodule *module)
     if(res < 0)
         return res;
 
+    /* Parallel decoding is off unless at least two threads are given */
+    threadsenv = getenv("AVFS_UBZ2_THREADS");
+    if(threadsenv != NULL)
+        av_bzfile_set_threads(atoi(threadsenv));
+
+    statf.get = bz_threads_get;
+    statf.set = bz_threads_set;
+    statf.data = avfs;
+    av_avfsstat_register("ubz2_threads", &statf);
+
     avfs->lookup   = bz_lookup;
     avfs->access   = bz_access;
+    avfs->statent  = bz_statent;
     avfs->open     = bz_open;
     avfs->close    = bz_close; 
     avfs->read     = bz_read;
@@ -32,6 +32,11 @@
 #define UCFTP_ST_VALID 20
 #define UCFTP_DIR_VALID 10
 
+/* bytes kept behind the transfer position for reads going back a bit */
+#define UCFTP_BEHIND_SIZE (64 * 1024)
+/* forward seeks up to this are read through instead of restarting */
+#define UCFTP_SKIP_MAX (256 * 1024)
+
 /***************************************
  * some internal structures
  ***************************************/
@@ -47,6 +52,7 @@ struct ucftpconn {
     int binary;
     char *cwd;
     short ft_cancel_ok;
+    short rest_ok;
 
     struct ucftpentry *root;
 };
@@ -62,6 +68,10 @@ struct ucftpfile {
     struct ucftpconn *conn;
     int writing;
     short eof;
+
+    /* the last bytes before numbytes, byte at offset N is at N % size */
+    char *behind;
+    avsize_t behindlen;
 };
 
 /* a generic information node */
@@ -988,6 +998,7 @@ static struct ucftpconn *ucftp_lookup_conn(struct ucftpfs *fs, const char *host,
     conn->binary = -1;
     conn->cwd = av_strdup("");
     conn->ft_cancel_ok = 1;
+    conn->rest_ok = 1;
     
     conn->root = ucftp_new_entry("/");
     ucftp_make_node(fs, conn->root, 0755 | AV_IFDIR);
@@ -1028,7 +1039,8 @@ static int ucftp_get_conn(struct ucftpfs *fs, const char *userhost,
 
 #define TRY_REUSE_CONN_AFTER_CLOSE
 
-static void ucftp_free_file(struct ucftpfile *f)
+/* Stop the transfer of a file, and give back the control connection */
+static void ucftp_stop_transfer(struct ucftpfile *f)
 {
 #ifndef TRY_REUSE_CONN_AFTER_CLOSE
     if(f->conn != NULL) {
@@ -1073,10 +1085,19 @@ static void ucftp_free_file(struct ucftpfile *f)
     
     f->sock = -1;
     f->sockfb = NULL;
-    f->numbytes = 0;
     f->conn = NULL;
+}
+
+static void ucftp_free_file(struct ucftpfile *f)
+{
+    ucftp_stop_transfer(f);
+
+    f->numbytes = 0;
     f->writing = 0;
     f->eof = 0;
+    av_free(f->behind);
+    f->behind = NULL;
+    f->behindlen = 0;
     
     av_unref_obj(f->ent);
     f->ent = NULL;
@@ -1095,6 +1116,8 @@ static struct ucftpfile *ucftp_new_file(struct ucftpentry *ent, int flags)
     f->flags = flags;
     f->writing = 0;
     f->eof = 0;
+    f->behind = NULL;
+    f->behindlen = 0;
 
     av_ref_obj(ent);
     f->ent = ent;
@@ -1741,11 +1764,14 @@ static int ucftp_close(vfile *vf)
  ***************************************/
 
 static int ucftp_do_get(const char *dir, const char *file,
-                        struct ucftpconn *conn, struct ucftpfile *uf)
+                        struct ucftpconn *conn, struct ucftpfile *uf,
+                        avoff_t offset)
 {
     int res;
     int getsock;
     char *cmd;
+    char offsetstr[32];
+    avoff_t start = 0;
 
     res = ucftp_open_conn(conn);
     if(res < 0)
@@ -1764,6 +1790,25 @@ static int ucftp_do_get(const char *dir, const char *file,
         return res;
 
     getsock = res;
+
+    /* without REST the file is read from the start and skipped */
+    if(offset > 0 && conn->rest_ok) {
+        sprintf(offsetstr, "%lli", offset);
+        cmd = av_stradd(NULL, "REST ", offsetstr, NULL);
+        res = ucftp_command(conn, cmd);
+        av_free(cmd);
+        if(res < 0) {
+            close(getsock);
+            return res;
+        }
+        if(res == 350)
+            start = offset;
+        else {
+            av_log(AVLOG_WARNING, "UCFTP: server does not support REST\n");
+            conn->rest_ok = 0;
+        }
+    }
+
     cmd = av_stradd(NULL, "RETR ", file, NULL);
     res = ucftp_command(conn, cmd);
     av_free(cmd);
@@ -1781,11 +1826,13 @@ static int ucftp_do_get(const char *dir, const char *file,
     }
 
     uf->conn = conn;
+    uf->numbytes = start;
+    uf->behindlen = 0;
     
     return 0;
 }
 
-static int ucftp_init_get(vfile *vf)
+static int ucftp_init_get(vfile *vf, avoff_t offset)
 {
     int res;
     struct ucftpfile *uf = ucftp_vfile_ucftpfile(vf);
@@ -1807,7 +1854,8 @@ static int ucftp_init_get(vfile *vf)
     dir = ucftp_create_path(ent->parent);
     file = av_strdup(ent->name);
 
-    res = ucftp_do_get(( dir[0] == '\0' ) ? "/" : dir, file, conn, uf);
+    res = ucftp_do_get(( dir[0] == '\0' ) ? "/" : dir, file, conn, uf,
+                       offset);
     av_free(dir);
     av_free(file);
 
@@ -1815,45 +1863,21 @@ static int ucftp_init_get(vfile *vf)
         ucftp_release_conn(conn);
     }
 
+    if(res == 0 && uf->behind == NULL)
+        uf->behind = av_malloc(UCFTP_BEHIND_SIZE);
+
     return res;
 }
 
-/* TODO: perhaps try filling buf as it happens that bytes read from sock are lower than nbyte */
-static avssize_t ucftp_read(vfile *vf, char *buf, avsize_t nbyte)
+static avssize_t ucftp_recv(struct ucftpfile *uf, char *buf, avsize_t nbyte)
 {
-    avoff_t nact;
-    struct ucftpfile *uf = ucftp_vfile_ucftpfile(vf);
     avsize_t nbytes;
     int res;
 
-    if(AV_ISDIR(uf->ent->node->st.mode))
-        return -EISDIR;
-    
-    if(uf->eof) {
-        return 0;
-    }
-    
-    if(!uf->sockfb) {
-        if(!AV_ISREG(uf->ent->node->st.mode))
-            return -EINVAL;
-        if((uf->flags & AVO_ACCMODE) != AVO_RDONLY)
-            return -EINVAL;
-        if(ucftp_init_get(vf) < 0)
-            return -EIO;
-    }
-
-    nact = nbyte;
-    
-    if ( uf->numbytes != vf->ptr ) {
-        av_log(AVLOG_ERROR, "UCFTP: wrong file position\n");
-        return -EIO;
-    }
-
     for(;;) {
-        nbytes = av_filebuf_read(uf->sockfb, buf, nact);
+        nbytes = av_filebuf_read(uf->sockfb, buf, nbyte);
         if(nbytes != 0) {
             uf->numbytes += nbytes;
-            vf->ptr += nbytes;
             break;
         } else {
             if(av_filebuf_eof(uf->sockfb)) {
@@ -1892,6 +1916,135 @@ static avssize_t ucftp_read(vfile *vf, char *buf, avsize_t nbyte)
     return nbytes;
 }
 
+/* Remember the nbyte bytes just received before numbytes */
+static void ucftp_keep_behind(struct ucftpfile *uf, const char *buf,
+                              avsize_t nbyte)
+{
+    avoff_t offset;
+    avsize_t pos;
+    avsize_t n;
+
+    if(nbyte > UCFTP_BEHIND_SIZE) {
+        buf += nbyte - UCFTP_BEHIND_SIZE;
+        nbyte = UCFTP_BEHIND_SIZE;
+    }
+    uf->behindlen = AV_MIN(uf->behindlen + nbyte, UCFTP_BEHIND_SIZE);
+
+    for(offset = uf->numbytes - nbyte; nbyte > 0; offset += n) {
+        pos = offset % UCFTP_BEHIND_SIZE;
+        n = AV_MIN(nbyte, UCFTP_BEHIND_SIZE - pos);
+        memcpy(uf->behind + pos, buf, n);
+        buf += n;
+        nbyte -= n;
+    }
+}
+
+static avsize_t ucftp_copy_behind(struct ucftpfile *uf, char *buf,
+                                  avsize_t nbyte, avoff_t offset)
+{
+    avsize_t pos;
+    avsize_t n;
+    avsize_t nact;
+
+    nbyte = AV_MIN(nbyte, uf->numbytes - offset);
+    for(nact = 0; nact < nbyte; nact += n) {
+        pos = (offset + nact) % UCFTP_BEHIND_SIZE;
+        n = AV_MIN(nbyte - nact, UCFTP_BEHIND_SIZE - pos);
+        memcpy(buf + nact, uf->behind + pos, n);
+    }
+
+    return nbyte;
+}
+
+/* Read through the transfer up to offset, returns 0 at the end of file */
+static avssize_t ucftp_skip(struct ucftpfile *uf, avoff_t offset)
+{
+    avssize_t res;
+    avsize_t pos;
+
+    while(uf->numbytes < offset) {
+        pos = uf->numbytes % UCFTP_BEHIND_SIZE;
+        res = ucftp_recv(uf, uf->behind + pos,
+                         AV_MIN(offset - uf->numbytes,
+                                UCFTP_BEHIND_SIZE - pos));
+        if(res <= 0)
+            return res;
+
+        uf->behindlen = AV_MIN(uf->behindlen + res, UCFTP_BEHIND_SIZE);
+    }
+
+    return 1;
+}
+
+static avssize_t ucftp_read_part(vfile *vf, char *buf, avsize_t nbyte)
+{
+    struct ucftpfile *uf = ucftp_vfile_ucftpfile(vf);
+    avoff_t offset = vf->ptr;
+    avssize_t res;
+
+    if(AV_ISDIR(uf->ent->node->st.mode))
+        return -EISDIR;
+    
+    if(offset < uf->numbytes && uf->numbytes - offset <= uf->behindlen) {
+        res = ucftp_copy_behind(uf, buf, nbyte, offset);
+        vf->ptr += res;
+        return res;
+    }
+
+    if(uf->eof && offset >= uf->numbytes) {
+        return 0;
+    }
+
+    /* going back, or far ahead: restart the transfer at the offset */
+    if(uf->sockfb && (offset < uf->numbytes ||
+                      (offset - uf->numbytes > UCFTP_SKIP_MAX &&
+                       uf->conn->rest_ok)))
+        ucftp_stop_transfer(uf);
+
+    if(!uf->sockfb) {
+        if(!AV_ISREG(uf->ent->node->st.mode))
+            return -EINVAL;
+        if((uf->flags & AVO_ACCMODE) != AVO_RDONLY)
+            return -EINVAL;
+        if(ucftp_init_get(vf, offset) < 0)
+            return -EIO;
+    }
+
+    res = ucftp_skip(uf, offset);
+    if(res <= 0)
+        return res;
+
+    res = ucftp_recv(uf, buf, nbyte);
+    if(res > 0) {
+        ucftp_keep_behind(uf, buf, res);
+        vf->ptr += res;
+    }
+
+    return res;
+}
+
+/* fill buf, short reads look like the end of file to some callers */
+static avssize_t ucftp_read(vfile *vf, char *buf, avsize_t nbyte)
+{
+    avssize_t res;
+    avsize_t nact = 0;
+
+    while(nact < nbyte) {
+        res = ucftp_read_part(vf, buf + nact, nbyte - nact);
+        if(res < 0) {
+            if(nact == 0)
+                return res;
+            break;
+        }
+        if(res == 0)
+            break;
+
+        nact += res;
+    }
+
+    return nact;
+}
+
 /***************************************
  * attribute code (stat)
  ***************************************/
@@ -0,0 +1,584 @@
+/*
+    AVFS: A Virtual File System Library
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+
+    CPIO module
+
+    Reads the "newc" (and "crc"), the portable ASCII ("odc") and the
+    old binary formats.  Members are stored uncompressed and
+    contiguously, so they are read directly from the archive.
+*/
+
+#include "archive.h"
+#include "oper.h"
+#include "version.h"
+
+#define CPIO_NEWC_HDRLEN  110
+#define CPIO_ODC_HDRLEN   76
+#define CPIO_BIN_HDRLEN   26
+#define CPIO_MAGICLEN     6
+
+#define CPIO_TRAILER      "TRAILER!!!"
+#define CPIO_MAXNAME      65536
+#define CPIO_MAXLINK      65536
+#define CPIO_PADBUF       512
+
+enum cpio_format {
+    CPIO_NEWC,
+    CPIO_ODC,
+    CPIO_BIN
+};
+
+struct cpio_values {
+    avdev_t dev;
+    avino_t ino;
+    avmode_t mode;
+    avuid_t uid;
+    avgid_t gid;
+    avnlink_t nlink;
+    avdev_t rdev;
+    avtime_t mtime;
+    avoff_t size;
+    avsize_t namesize;
+    avoff_t offset;
+};
+
+/* Files with more than one link, newc stores the data only with the
+   last one */
+struct cpio_link {
+    avdev_t dev;
+    avino_t ino;
+    struct archnode *nod;
+};
+
+struct cpio_parse {
+    vfile *vf;
+    struct archive *arch;
+    avoff_t pos;
+    struct cpio_link *links;
+    int numlinks;
+};
+
+static avoff_t getnum(const char *s, int len, int base, int *errp)
+{
+    avoff_t num = 0;
+    int i;
+
+    for(i = 0; i < len; i++) {
+        int c = s[i];
+        int d;
+
+        if(c >= '0' && c <= '9')
+            d = c - '0';
+        else if(c >= 'a' && c <= 'f')
+            d = c - 'a' + 10;
+        else if(c >= 'A' && c <= 'F')
+            d = c - 'A' + 10;
+        else
+            d = base;
+
+        if(d >= base) {
+            *errp = 1;
+            break;
+        }
+        num = num * base + d;
+    }
+
+    return num;
+}
+
+static int interpret_newc(const char *h, struct cpio_values *cv)
+{
+    int err = 0;
+    avuint devmajor, devminor, rdevmajor, rdevminor;
+
+    cv->ino       = getnum(h + 6,   8, 16, &err);
+    cv->mode      = getnum(h + 14,  8, 16, &err);
+    cv->uid       = getnum(h + 22,  8, 16, &err);
+    cv->gid       = getnum(h + 30,  8, 16, &err);
+    cv->nlink     = getnum(h + 38,  8, 16, &err);
+    cv->mtime     = getnum(h + 46,  8, 16, &err);
+    cv->size      = getnum(h + 54,  8, 16, &err);
+    devmajor      = getnum(h + 62,  8, 16, &err);
+    devminor      = getnum(h + 70,  8, 16, &err);
+    rdevmajor     = getnum(h + 78,  8, 16, &err);
+    rdevminor     = getnum(h + 86,  8, 16, &err);
+    cv->namesize  = getnum(h + 94,  8, 16, &err);
+
+    cv->dev = av_mkdev(devmajor, devminor);
+    cv->rdev = av_mkdev(rdevmajor, rdevminor);
+
+    return err ? -1 : 0;
+}
+
+static int interpret_odc(const char *h, struct cpio_values *cv)
+{
+    int err = 0;
+    avuint rdev;
+
+    cv->dev       = getnum(h + 6,   6, 8, &err);
+    cv->ino       = getnum(h + 12,  6, 8, &err);
+    cv->mode      = getnum(h + 18,  6, 8, &err);
+    cv->uid       = getnum(h + 24,  6, 8, &err);
+    cv->gid       = getnum(h + 30,  6, 8, &err);
+    cv->nlink     = getnum(h + 36,  6, 8, &err);
+    rdev          = getnum(h + 42,  6, 8, &err);
+    cv->mtime     = getnum(h + 48, 11, 8, &err);
+    cv->namesize  = getnum(h + 59,  6, 8, &err);
+    cv->size      = getnum(h + 65, 11, 8, &err);
+
+    cv->rdev = av_mkdev((rdev >> 8) & 0xFF, rdev & 0xFF);
+
+    return err ? -1 : 0;
+}
+
+static void interpret_bin(const unsigned char *h, int swap,
+                          struct cpio_values *cv)
+{
+    avuint w[13];
+    int i;
+
+    for(i = 0; i < 13; i++) {
+        if(swap)
+            w[i] = (h[i * 2] << 8) | h[i * 2 + 1];
+        else
+            w[i] = h[i * 2] | (h[i * 2 + 1] << 8);
+    }
+
+    cv->dev       = w[1];
+    cv->ino       = w[2];
+    cv->mode      = w[3];
+    cv->uid       = w[4];
+    cv->gid       = w[5];
+    cv->nlink     = w[6];
+    cv->rdev      = av_mkdev((w[7] >> 8) & 0xFF, w[7] & 0xFF);
+    cv->mtime     = ((avtime_t) w[8] << 16) | w[9];
+    cv->namesize  = w[10];
+    cv->size      = ((avoff_t) w[11] << 16) | w[12];
+}
+
+static avoff_t cpio_align(avoff_t pos, enum cpio_format format)
+{
+    if(format == CPIO_NEWC)
+        return (pos + 3) & ~3;
+    else if(format == CPIO_BIN)
+        return (pos + 1) & ~1;
+    else
+        return pos;
+}
+
+static int cpio_seek(struct cpio_parse *cp, avoff_t pos)
+{
+    avoff_t sres;
+
+    if(pos == cp->pos)
+        return 0;
+
+    sres = av_lseek(cp->vf, pos, AVSEEK_SET);
+    if(sres < 0)
+        return sres;
+
+    cp->pos = pos;
+    return 0;
+}
+
+/* Returns 0 and warns if the archive ends before nbyte */
+static int cpio_read(struct cpio_parse *cp, char *buf, avsize_t nbyte)
+{
+    avssize_t rres;
+
+    rres = av_read(cp->vf, buf, nbyte);
+    if(rres < 0)
+        return rres;
+
+    cp->pos += rres;
+    if(rres != nbyte) {
+        av_log(AVLOG_WARNING, "CPIO: Broken archive");
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Zeroes may follow the trailer, and then maybe another archive.
+   Returns 1 if the vfile is positioned at the next header, 0 at the
+   end of the archive. */
+static int skip_padding(struct cpio_parse *cp, const char *start, int len)
+{
+    int res;
+    avssize_t rres = len;
+    char buf[CPIO_PADBUF];
+    const char *s = start;
+    int i;
+
+    while(1) {
+        for(i = 0; i < rres && s[i] == 0; i++);
+        if(i < rres) {
+            res = cpio_seek(cp, cp->pos - rres + i);
+            return res < 0 ? res : 1;
+        }
+
+        rres = av_read(cp->vf, buf, CPIO_PADBUF);
+        if(rres <= 0)
+            return rres;
+
+        cp->pos += rres;
+        s = buf;
+    }
+}
+
+static int read_header(struct cpio_parse *cp, struct cpio_values *cv,
+                       enum cpio_format *formatp)
+{
+    int res;
+    avssize_t rres;
+    char hbuf[CPIO_NEWC_HDRLEN];
+    const unsigned char *ubuf = (const unsigned char *) hbuf;
+    int hdrlen;
+
+    rres = av_read(cp->vf, hbuf, CPIO_MAGICLEN);
+    if(rres <= 0)
+        return rres;
+    cp->pos += rres;
+
+    if(hbuf[0] == 0) {
+        res = skip_padding(cp, hbuf, rres);
+        if(res <= 0)
+            return res;
+
+        rres = av_read(cp->vf, hbuf, CPIO_MAGICLEN);
+        if(rres < 0)
+            return rres;
+        cp->pos += rres;
+    }
+    if(rres != CPIO_MAGICLEN) {
+        av_log(AVLOG_WARNING, "CPIO: Broken archive");
+        return 0;
+    }
+
+    if(memcmp(hbuf, "070701", 6) == 0 || memcmp(hbuf, "070702", 6) == 0) {
+        *formatp = CPIO_NEWC;
+        hdrlen = CPIO_NEWC_HDRLEN;
+    }
+    else if(memcmp(hbuf, "070707", 6) == 0) {
+        *formatp = CPIO_ODC;
+        hdrlen = CPIO_ODC_HDRLEN;
+    }
+    else if((ubuf[0] == 0xC7 && ubuf[1] == 0x71) ||
+            (ubuf[0] == 0x71 && ubuf[1] == 0xC7)) {
+        *formatp = CPIO_BIN;
+        hdrlen = CPIO_BIN_HDRLEN;
+    }
+    else if(cp->pos == CPIO_MAGICLEN) {
+        /* Not even the first header */
+        av_log(AVLOG_ERROR, "CPIO: Not a cpio archive");
+        return -EIO;
+    }
+    else {
+        av_log(AVLOG_WARNING, "CPIO: Broken archive");
+        return 0;
+    }
+
+    res = cpio_read(cp, hbuf + CPIO_MAGICLEN, hdrlen - CPIO_MAGICLEN);
+    if(res <= 0)
+        return res;
+
+    if(*formatp == CPIO_NEWC)
+        res = interpret_newc(hbuf, cv);
+    else if(*formatp == CPIO_ODC)
+        res = interpret_odc(hbuf, cv);
+    else {
+        interpret_bin(ubuf, ubuf[0] == 0x71, cv);
+        res = 0;
+    }
+    if(res < 0 || cv->namesize == 0 || cv->namesize > CPIO_MAXNAME) {
+        av_log(AVLOG_WARNING, "CPIO: Broken archive");
+        return 0;
+    }
+
+    return 1;
+}
+
+static struct cpio_link *find_link(struct cpio_parse *cp,
+                                   struct cpio_values *cv)
+{
+    int i;
+
+    for(i = 0; i < cp->numlinks; i++) {
+        struct cpio_link *cl = &cp->links[i];
+
+        if(cl->dev == cv->dev && cl->ino == cv->ino)
+            return cl;
+    }
+
+    return NULL;
+}
+
+static void add_link(struct cpio_parse *cp, struct cpio_values *cv,
+                     struct archnode *nod)
+{
+    struct cpio_link *cl;
+
+    cp->links = av_realloc(cp->links, sizeof(struct cpio_link) *
+                           (cp->numlinks + 1));
+    cl = &cp->links[cp->numlinks];
+    cl->dev = cv->dev;
+    cl->ino = cv->ino;
+    cl->nod = nod;
+    av_ref_obj(nod);
+    cp->numlinks ++;
+}
+
+static void free_links(struct cpio_parse *cp)
+{
+    int i;
+
+    for(i = 0; i < cp->numlinks; i++)
+        av_unref_obj(cp->links[i].nod);
+    av_free(cp->links);
+    cp->links = NULL;
+    cp->numlinks = 0;
+}
+
+static void set_data(struct archnode *nod, struct cpio_values *cv)
+{
+    nod->offset = cv->offset;
+    nod->realsize = cv->size;
+    nod->st.size = cv->size;
+    nod->st.blocks = AV_BLOCKS(cv->size);
+}
+
+static void fill_node(struct archnode *nod, struct cpio_values *cv)
+{
+    nod->st.mode = cv->mode;
+    nod->st.uid = cv->uid;
+    nod->st.gid = cv->gid;
+    nod->st.mtime.sec = cv->mtime;
+    nod->st.mtime.nsec = 0;
+    nod->st.atime = nod->st.mtime;
+    nod->st.ctime = nod->st.mtime;
+    nod->st.blksize = 512;
+}
+
+static void insert_link(struct cpio_parse *cp, struct entry *ent,
+                        struct cpio_link *cl, struct cpio_values *cv)
+{
+    struct archnode *nod = cl->nod;
+
+    av_namespace_set(ent, nod);
+    av_ref_obj(ent);
+    av_ref_obj(nod);
+
+    if(cv->size != 0 && nod->realsize == 0)
+        set_data(nod, cv);
+}
+
+static int check_existing(struct entry *ent, struct cpio_values *cv)
+{
+    struct archnode *nod;
+
+    nod = (struct archnode *) av_namespace_get(ent);
+    if(nod == NULL)
+        return 1;
+
+    if(AV_ISDIR(nod->st.mode)) {
+        if(AV_ISDIR(cv->mode))
+            fill_node(nod, cv);
+        else
+            av_log(AVLOG_WARNING, "CPIO: Overwriting directory with file");
+        return 0;
+    }
+
+    av_arch_del_node(ent);
+    return 1;
+}
+
+static void insert_cpioentry(struct cpio_parse *cp, struct cpio_values *cv,
+                             char *name, char *linkname)
+{
+    struct entry *ent;
+    struct archnode *nod;
+    struct cpio_link *cl = NULL;
+    int isdir = AV_ISDIR(cv->mode);
+
+    if((cv->mode & AV_IFMT) == 0) {
+        av_log(AVLOG_WARNING, "CPIO: Illegal type");
+        return;
+    }
+
+    ent = av_arch_resolve(cp->arch, name, 1, 0);
+    if(ent == NULL)
+        return;
+
+    /* Archives made with "find . | cpio -o" have a "." entry */
+    if(av_arch_isroot(cp->arch, ent) || !check_existing(ent, cv)) {
+        av_unref_obj(ent);
+        return;
+    }
+
+    if(!isdir && cv->nlink > 1)
+        cl = find_link(cp, cv);
+
+    if(cl != NULL)
+        insert_link(cp, ent, cl, cv);
+    else {
+        nod = av_arch_new_node(cp->arch, ent, isdir);
+        fill_node(nod, cv);
+
+        if(AV_ISLNK(cv->mode)) {
+            nod->linkname = linkname;
+            nod->st.size = strlen(linkname);
+            linkname = NULL;
+        }
+        else if(AV_ISREG(cv->mode))
+            set_data(nod, cv);
+        else if(AV_ISCHR(cv->mode) || AV_ISBLK(cv->mode))
+            nod->st.rdev = cv->rdev;
+
+        if(!isdir) {
+            nod->st.nlink = cv->nlink ? cv->nlink : 1;
+            if(cv->nlink > 1)
+                add_link(cp, cv, nod);
+        }
+    }
+
+    av_free(linkname);
+    av_unref_obj(ent);
+}
+
+static int read_linkname(struct cpio_parse *cp, struct cpio_values *cv,
+                         char **linknamep)
+{
+    int res;
+    char *linkname;
+
+    if(cv->size > CPIO_MAXLINK) {
+        *linknamep = NULL;
+        return 1;
+    }
+
+    linkname = av_malloc(cv->size + 1);
+    res = cpio_read(cp, linkname, cv->size);
+    if(res <= 0) {
+        av_free(linkname);
+        return res;
+    }
+    linkname[cv->size] = '\0';
+
+    *linknamep = linkname;
+    return 1;
+}
+
+static int read_entry(struct cpio_parse *cp)
+{
+    int res;
+    struct cpio_values cv;
+    enum cpio_format format;
+    char *name;
+    char *s;
+    char *linkname = NULL;
+    avoff_t next;
+
+    res = read_header(cp, &cv, &format);
+    if(res <= 0)
+        return res;
+
+    name = av_malloc(cv.namesize + 1);
+    res = cpio_read(cp, name, cv.namesize);
+    if(res <= 0) {
+        av_free(name);
+        return res;
+    }
+    name[cv.namesize] = '\0';
+
+    cv.offset = cpio_align(cp->pos, format);
+    next = cpio_align(cv.offset + cv.size, format);
+
+    if(strcmp(name, CPIO_TRAILER) == 0) {
+        /* A following archive numbers its inodes from scratch */
+        free_links(cp);
+        av_free(name);
+        res = cpio_seek(cp, next);
+        return res < 0 ? res : 1;
+    }
+
+    res = 1;
+    if(AV_ISLNK(cv.mode)) {
+        res = cpio_seek(cp, cv.offset);
+        if(res == 0)
+            res = read_linkname(cp, &cv, &linkname);
+    }
+
+    if(res > 0) {
+        for(s = name; *s == '/' || (s[0] == '.' && s[1] == '/'); s++);
+        if(AV_ISLNK(cv.mode) && linkname == NULL)
+            av_log(AVLOG_WARNING, "CPIO: Symlink %s too long", s);
+        else
+            insert_cpioentry(cp, &cv, s, linkname);
+
+        res = cpio_seek(cp, next);
+        if(res == 0)
+            res = 1;
+    }
+    av_free(name);
+
+    return res;
+}
+
+static int read_cpiofile(struct cpio_parse *cp)
+{
+    int res;
+
+    do res = read_entry(cp);
+    while(res == 1);
+
+    free_links(cp);
+
+    return res;
+}
+
+static int parse_cpiofile(void *data, ventry *ve, struct archive *arch)
+{
+    int res;
+    struct cpio_parse cp;
+
+    res = av_open(ve->mnt->base, AVO_RDONLY, 0, &cp.vf);
+    if(res < 0)
+        return res;
+
+    cp.arch = arch;
+    cp.pos = 0;
+    cp.links = NULL;
+    cp.numlinks = 0;
+
+    res = read_cpiofile(&cp);
+    av_close(cp.vf);
+
+    return res;
+}
+
+int av_init_module_ucpio(struct vmodule *module);
+
+int av_init_module_ucpio(struct vmodule *module)
+{
+    int res;
+    struct avfs *avfs;
+    struct ext_info cpioexts[2];
+    struct archparams *ap;
+
+    cpioexts[0].from = ".cpio", cpioexts[0].to = NULL;
+    cpioexts[1].from = NULL;
+
+    res = av_archive_init("ucpio", cpioexts, AV_VER, module, &avfs);
+    if(res < 0)
+        return res;
+
+    ap = (struct archparams *) avfs->data;
+    ap->parse = parse_cpiofile;
+
+    av_add_avfs(avfs);
+
+    return 0;
+}
@@ -14,6 +14,13 @@
 #include "cache.h"
 #include "oper.h"
 #include "version.h"
+#include "internal.h"
+
+#include <stdlib.h>
+
+struct gzfs {
+    char *indexdir;          /* Directory of persistent indexes or NULL */
+};
 
 struct gznode {
     avmutex lock;
@@ -22,6 +29,7 @@ struct gznode {
     struct cacheobj *cache;
     avino_t ino;
     avtime_t mtime;
+    avoff_t isize;           /* Size in the trailer, or -1 */
 };
 
 struct gzfile {
@@ -175,6 +183,15 @@ static int gz_read_header(vfile *vf, struct gznode *nod)
             return res;
     }
 
+    /* Uncompressed size modulo 2^32, of the last member only */
+    if(nod->sig.size >= GZHEADER_SIZE + GZFOOTER_SIZE) {
+        res = av_pread(vf, (char *) buf, 4, nod->sig.size - 4);
+        if(res < 0)
+            return res;
+        if(res == 4)
+            nod->isize = QBYTE(buf);
+    }
+
     nod->ready = 1;
     
     return 0;
@@ -196,6 +213,7 @@ static struct gznode *gz_new_node(ventry *ve, struct avstat *stbuf)
     nod->sig = *stbuf;
     nod->cache = NULL;
     nod->ino = av_new_ino(ve->mnt->avfs);
+    nod->isize = -1;
     
     return nod;
 }
@@ -273,22 +291,43 @@ static int gz_getnode(ventry *ve, vfile *base, struct gznode **resp)
     return 0;
 }
 
-static struct zcache *gz_getcache(ventry *base, struct gznode *nod)
+static char *gz_get_indexdir(struct avfs *avfs)
+{
+    struct gzfs *fs = (struct gzfs *) avfs->data;
+    char *dir;
+
+    AV_LOCK(avfs->lock);
+    dir = av_strdup(fs->indexdir);
+    AV_UNLOCK(avfs->lock);
+
+    return dir;
+}
+
+static struct zcache *gz_getcache(struct avmount *mnt, struct gznode *nod)
 {
+    ventry *base = mnt->base;
     struct zcache *cache;
     
     cache = (struct zcache *) av_cacheobj_get(nod->cache);
     if(cache == NULL) {
         int res;
         char *name;
+        char *indexdir;
 
         res = av_generate_path(base, &name);
         if(res < 0)
             name = NULL;
+
+        indexdir = gz_get_indexdir(mnt->avfs);
+        if(indexdir != NULL && name != NULL)
+            cache = av_zcache_new_persistent(indexdir, name, &nod->sig);
         else
+            cache = av_zcache_new();
+        av_free(indexdir);
+
+        if(name != NULL)
             name = av_stradd(name, "(index)", NULL);
 
-        cache = av_zcache_new();
         av_unref_obj(nod->cache);
 
         /* FIXME: the cacheobj should only be created when the zcache
@@ -383,7 +422,7 @@ static avssize_t gz_read(vfile *vf, char *buf, avsize_t nbyte)
     struct cacheobj *cobj;
 
     AV_LOCK(fil->node->lock);
-    zc = gz_getcache(vf->mnt->base, fil->node);
+    zc = gz_getcache(vf->mnt, fil->node);
     cobj = fil->node->cache;
     av_ref_obj(cobj);
     AV_UNLOCK(fil->node->lock);
@@ -408,6 +447,13 @@ static avssize_t gz_read(vfile *vf, char *buf, avsize_t nbyte)
     return res;
 }
 
+/* The trailer is trusted with the -s option only, it is wrong for
+   multi-member files and for sizes of 4GB and more */
+static int gz_use_isize(struct avmount *mnt, struct gznode *nod)
+{
+    return nod->isize != -1 && strcmp(mnt->opts, "-s") == 0;
+}
+
 static int gz_getsize(vfile *vf, struct avstat *buf)
 {
     int res;
@@ -417,12 +463,14 @@ static int gz_getsize(vfile *vf, struct avstat *buf)
     avoff_t size;
 
     AV_LOCK(fil->node->lock);
-    zc = gz_getcache(vf->mnt->base, fil->node);
+    zc = gz_getcache(vf->mnt, fil->node);
     cobj = fil->node->cache;
     av_ref_obj(cobj);
     AV_UNLOCK(fil->node->lock);
 
     res = av_zfile_size(fil->zfil, zc, &size);
+    if(res == 0 && size == -1 && gz_use_isize(vf->mnt, fil->node))
+        size = fil->node->isize;
     if(res == 0 && size == -1) {
         fil->zfil = av_zfile_new(fil->base, 0,
                                  0, AV_ZFILE_DATA_GZIP_ENCAPSULATED);
@@ -436,6 +484,18 @@ static int gz_getsize(vfile *vf, struct avstat *buf)
     return res;
 }
 
+static void gz_set_attr(struct avfs *avfs, struct gznode *nod,
+                        struct avstat *buf)
+{
+    buf->mode &= ~(07000);
+    buf->blksize = 4096;
+    buf->dev = avfs->dev;
+    buf->ino = nod->ino;
+    buf->nlink = 1;
+    buf->mtime.sec = nod->mtime;
+    buf->mtime.nsec = 0;
+}
+
 static int gz_getattr(vfile *vf, struct avstat *buf, int attrmask)
 {
     int res;
@@ -454,17 +514,117 @@ static int gz_getattr(vfile *vf, struct avstat *buf, int attrmask)
             return res;
     }
 
-    buf->mode &= ~(07000);
-    buf->blksize = 4096;
-    buf->dev = vf->mnt->avfs->dev;
-    buf->ino = nod->ino;
-    buf->nlink = 1;
-    buf->mtime.sec = nod->mtime;
-    buf->mtime.nsec = 0;
+    gz_set_attr(vf->mnt->avfs, nod, buf);
     
     return 0;
 }
 
+/* Without opening anything, if the header was read already and the
+   size is not needed or known */
+static int gz_statent(ventry *ve, struct avstat *buf, int attrmask, int flags)
+{
+    int res;
+    struct gznode *nod;
+    struct zcache *zc;
+    avoff_t size;
+    char *key;
+    const int basemask = AVA_INO | AVA_DEV | AVA_SIZE | AVA_MTIME |
+        AVA_MODE | AVA_UID | AVA_GID | AVA_ATIME | AVA_CTIME | AVA_BLKCNT;
+
+    res = av_getattr(ve->mnt->base, buf, basemask, 0);
+    if(res < 0)
+        return res;
+
+    res = av_filecache_getkey(ve, &key);
+    if(res < 0)
+        return res;
+
+    nod = gz_findnode(ve, key, buf);
+    av_free(key);
+
+    res = 0;
+    AV_LOCK(nod->lock);
+    if(!nod->ready)
+        res = -ENOSYS;
+    else if((attrmask & (AVA_SIZE | AVA_BLKCNT)) != 0) {
+        zc = gz_getcache(ve->mnt, nod);
+        av_zfile_size(NULL, zc, &size);
+        av_unref_obj(zc);
+
+        if(size == -1 && gz_use_isize(ve->mnt, nod))
+            size = nod->isize;
+        if(size == -1)
+            res = -ENOSYS;
+        else
+            buf->size = size;
+    }
+    AV_UNLOCK(nod->lock);
+
+    if(res == 0)
+        gz_set_attr(ve->mnt->avfs, nod, buf);
+    av_unref_obj(nod);
+
+    return res;
+}
+
+static int gz_indexdir_get(struct entry *ent, const char *param, char **retp)
+{
+    struct statefile *sf = (struct statefile *) av_namespace_get(ent);
+    struct avfs *avfs = (struct avfs *) sf->data;
+    struct gzfs *fs = (struct gzfs *) avfs->data;
+    char *s;
+
+    AV_LOCK(avfs->lock);
+    if(fs->indexdir != NULL)
+        s = av_stradd(NULL, fs->indexdir, "\n", NULL);
+    else
+        s = av_strdup("");
+    AV_UNLOCK(avfs->lock);
+
+    *retp = s;
+
+    return 0;
+}
+
+static int gz_indexdir_set(struct entry *ent, const char *param,
+                           const char *val)
+{
+    struct statefile *sf = (struct statefile *) av_namespace_get(ent);
+    struct avfs *avfs = (struct avfs *) sf->data;
+    struct gzfs *fs = (struct gzfs *) avfs->data;
+    char *s;
+    unsigned int len;
+
+    s = av_strdup(val);
+    len = strlen(s);
+    if(len > 0 && s[len-1] == '\n')
+        s[len-1] = '\0';
+
+    if(s[0] == '\0') {
+        av_free(s);
+        s = NULL;
+    }
+    else if(s[0] != '/') {
+        av_free(s);
+        return -EINVAL;
+    }
+
+    AV_LOCK(avfs->lock);
+    av_free(fs->indexdir);
+    fs->indexdir = s;
+    AV_UNLOCK(avfs->lock);
+
+    return 0;
+}
+
+static void gz_destroy(struct avfs *avfs)
+{
+    struct gzfs *fs = (struct gzfs *) avfs->data;
+
+    av_free(fs->indexdir);
+    av_free(fs);
+}
+
 extern int av_init_module_ugz(struct vmodule *module);
 
 int av_init_module_ugz(struct vmodule *module)
@@ -472,6 +632,9 @@ int av_init_module_ugz(struct vmodule *module)
     int res;
     struct avfs *avfs;
     struct ext_info ugz_exts[3];
+    struct gzfs *fs;
+    struct statefile statf;
+    const char *indexenv;
 
     ugz_exts[0].from = ".gz",  ugz_exts[0].to = NULL;
     ugz_exts[1].from = ".tgz", ugz_exts[1].to = ".tar";
@@ -481,8 +644,25 @@ int av_init_module_ugz(struct vmodule *module)
     if(res < 0)
         return res;
 
+    /* Persistent seek indexes are off unless a directory is given */
+    AV_NEW(fs);
+    indexenv = getenv("AVFS_UGZ_INDEX_DIR");
+    if(indexenv != NULL && indexenv[0] == '/')
+        fs->indexdir = av_strdup(indexenv);
+    else
+        fs->indexdir = NULL;
+    avfs->data = fs;
+
+    statf.get = gz_indexdir_get;
+    statf.set = gz_indexdir_set;
+    statf.data = avfs;
+    av_avfsstat_register("ugz_index_dir", &statf);
+
+    avfs->destroy  = gz_destroy;
+
     avfs->lookup   = gz_lookup;
     avfs->access   = gz_access;
+    avfs->statent  = gz_statent;
     avfs->open     = gz_open;
     avfs->close    = gz_close; 
     avfs->read     = gz_read;
@@ -0,0 +1,838 @@
+/*
+    AVFS: A Virtual File System Library
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+
+    ISO9660 module
+
+    Files of an ISO9660 image are stored uncompressed in one or more
+    extents, so they are read directly from the image.  Rock Ridge
+    names and attributes are used if present, otherwise the Joliet
+    names.
+*/
+
+#include "archive.h"
+#include "oper.h"
+#include "version.h"
+
+#define ISO_SECTOR      2048
+#define ISO_VD_START    16
+#define ISO_VD_MAX      64
+#define ISO_MAXDIR      (64 * 1024 * 1024)
+#define ISO_MAXDEPTH    256
+#define ISO_MAXCE       16
+
+#define ISO_VD_PRIMARY        1
+#define ISO_VD_SUPPLEMENTARY  2
+#define ISO_VD_END            255
+
+#define ISO_VD_ESCAPES  88
+#define ISO_VD_ROOT     156
+
+#define ISO_FL_DIR      (1 << 1)
+#define ISO_FL_ASSOC    (1 << 2)
+#define ISO_FL_MULTI    (1 << 7)
+
+/* Offsets in a directory record */
+#define DR_XALEN        1
+#define DR_EXTENT       2
+#define DR_SIZE         10
+#define DR_DATE         18
+#define DR_FLAGS        25
+#define DR_UNITSIZE     26
+#define DR_NAMELEN      32
+#define DR_NAME         33
+
+#define DR_MINLEN       34
+
+struct isoextent {
+    avoff_t offset;
+    avoff_t size;
+};
+
+/* Only for files stored in more than one extent */
+struct isonode {
+    int numext;
+    struct isoextent *ext;
+};
+
+struct isorec {
+    int flags;
+    const unsigned char *id;    /* identifier in the directory record */
+    int idlen;
+    char *name;
+    char *linkname;
+    int slcont;
+    int relocated;
+    avoff_t child;
+    int numext;
+    struct isoextent *ext;
+    int has_px;
+    avmode_t mode;
+    avnlink_t nlink;
+    avuid_t uid;
+    avgid_t gid;
+    avdev_t rdev;
+    avtimestruc_t mtime;
+    avtimestruc_t atime;
+    avtimestruc_t ctime;
+};
+
+struct isoparse {
+    vfile *vf;
+    struct archive *arch;
+    int joliet;
+    int rockridge;
+    int suspskip;
+    avoff_t *dirs;
+    int numdirs;
+};
+
+static avuint iso_le32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((avuint) p[3] << 24);
+}
+
+static avtime_t iso_mktime(int year, int mon, int day, int hour, int min,
+                           int sec, int gmtoff)
+{
+    long y, era, yoe, doy, doe, days;
+
+    if(mon < 1 || mon > 12 || day < 1 || day > 31)
+        return 0;
+
+    /* Days since the epoch in the proleptic Gregorian calendar */
+    y = year - (mon <= 2);
+    era = (y >= 0 ? y : y - 399) / 400;
+    yoe = y - era * 400;
+    doy = (153 * (mon + (mon > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    days = era * 146097 + doe - 719468;
+
+    /* The offset from GMT is in 15 minute intervals */
+    return (avtime_t) days * 86400 + hour * 3600 + min * 60 + sec -
+        gmtoff * 15 * 60;
+}
+
+static avtime_t iso_short_time(const unsigned char *p)
+{
+    return iso_mktime(1900 + p[0], p[1], p[2], p[3], p[4], p[5],
+                      (signed char) p[6]);
+}
+
+static int iso_digits(const unsigned char *p, int n)
+{
+    int i;
+    int num = 0;
+
+    for(i = 0; i < n; i++)
+        num = num * 10 + (p[i] >= '0' && p[i] <= '9' ? p[i] - '0' : 0);
+
+    return num;
+}
+
+static avtime_t iso_long_time(const unsigned char *p)
+{
+    return iso_mktime(iso_digits(p, 4), iso_digits(p + 4, 2),
+                      iso_digits(p + 6, 2), iso_digits(p + 8, 2),
+                      iso_digits(p + 10, 2), iso_digits(p + 12, 2),
+                      (signed char) p[16]);
+}
+
+static void iso_set_time(avtimestruc_t *tp, avtime_t sec)
+{
+    tp->sec = sec;
+    tp->nsec = 0;
+}
+
+/* UCS-2 (or UTF-16) big endian to UTF-8 */
+static char *iso_joliet_name(const unsigned char *p, int len)
+{
+    int i;
+    char *name = av_malloc(len / 2 * 3 + 1);
+    char *s = name;
+
+    for(i = 0; i + 1 < len; i += 2) {
+        avuint c = (p[i] << 8) | p[i + 1];
+
+        if(c >= 0xD800 && c < 0xDC00 && i + 3 < len) {
+            avuint lo = (p[i + 2] << 8) | p[i + 3];
+
+            if(lo >= 0xDC00 && lo < 0xE000) {
+                c = 0x10000 + ((c - 0xD800) << 10) + (lo - 0xDC00);
+                i += 2;
+            }
+        }
+        if(c < 0x80)
+            *s++ = c;
+        else if(c < 0x800) {
+            *s++ = 0xC0 | (c >> 6);
+            *s++ = 0x80 | (c & 0x3F);
+        }
+        else if(c < 0x10000) {
+            *s++ = 0xE0 | (c >> 12);
+            *s++ = 0x80 | ((c >> 6) & 0x3F);
+            *s++ = 0x80 | (c & 0x3F);
+        }
+        else {
+            *s++ = 0xF0 | (c >> 18);
+            *s++ = 0x80 | ((c >> 12) & 0x3F);
+            *s++ = 0x80 | ((c >> 6) & 0x3F);
+            *s++ = 0x80 | (c & 0x3F);
+        }
+    }
+    *s = '\0';
+
+    return name;
+}
+
+/* Strip the version number, and the dot of names without extension */
+static void iso_strip_version(char *name, int joliet)
+{
+    char *s = strrchr(name, ';');
+
+    if(s != NULL)
+        *s = '\0';
+
+    if(!joliet) {
+        s = name + strlen(name);
+        if(s > name && s[-1] == '.')
+            s[-1] = '\0';
+    }
+}
+
+static void iso_add_link(struct isorec *rec, const char *s, int len,
+                         int isroot)
+{
+    if(rec->linkname == NULL)
+        rec->linkname = av_strdup("");
+    else if(!rec->slcont && rec->linkname[0] != '\0' &&
+            strcmp(rec->linkname, "/") != 0)
+        rec->linkname = av_stradd(rec->linkname, "/", NULL);
+
+    if(isroot)
+        s = "/", len = 1;
+
+    rec->linkname = av_realloc(rec->linkname,
+                               strlen(rec->linkname) + len + 1);
+    strncat(rec->linkname, s, len);
+}
+
+static void iso_rr_symlink(struct isorec *rec, const unsigned char *p,
+                           int len)
+{
+    while(len >= 2 && 2 + p[1] <= len) {
+        int cflags = p[0];
+        int clen = p[1];
+
+        if(cflags & 2)
+            iso_add_link(rec, ".", 1, 0);
+        else if(cflags & 4)
+            iso_add_link(rec, "..", 2, 0);
+        else
+            iso_add_link(rec, (const char *) p + 2, clen, cflags & 8);
+
+        rec->slcont = cflags & 1;
+        p += 2 + clen;
+        len -= 2 + clen;
+    }
+}
+
+static void iso_rr_times(struct isorec *rec, const unsigned char *p, int len)
+{
+    int flags = p[4];
+    int size = (flags & 0x80) ? 17 : 7;
+    int pos = 5;
+    int i;
+
+    for(i = 0; i < 7; i++) {
+        avtime_t t;
+
+        if(!(flags & (1 << i)))
+            continue;
+        if(pos + size > len)
+            break;
+
+        t = (size == 17) ? iso_long_time(p + pos) : iso_short_time(p + pos);
+        if(i == 1)
+            iso_set_time(&rec->mtime, t);
+        else if(i == 2)
+            iso_set_time(&rec->atime, t);
+        else if(i == 3)
+            iso_set_time(&rec->ctime, t);
+
+        pos += size;
+    }
+}
+
+/* Parse one System Use area, the location of a continuation area is
+   returned in *ceoffp and *celenp */
+static void iso_susp_area(struct isorec *rec, const unsigned char *p,
+                          int len, avoff_t *ceoffp, int *celenp)
+{
+    while(len >= 4) {
+        int elen = p[2];
+
+        if(elen < 4 || elen > len)
+            break;
+
+        if(p[0] == 'N' && p[1] == 'M' && elen >= 5) {
+            if(!(p[4] & 6)) {
+                int oldlen = rec->name == NULL ? 0 : strlen(rec->name);
+
+                rec->name = av_realloc(rec->name, oldlen + elen - 5 + 1);
+                memcpy(rec->name + oldlen, p + 5, elen - 5);
+                rec->name[oldlen + elen - 5] = '\0';
+            }
+        }
+        else if(p[0] == 'P' && p[1] == 'X' && elen >= 36) {
+            rec->has_px = 1;
+            rec->mode = iso_le32(p + 4);
+            rec->nlink = iso_le32(p + 12);
+            rec->uid = iso_le32(p + 20);
+            rec->gid = iso_le32(p + 28);
+        }
+        else if(p[0] == 'P' && p[1] == 'N' && elen >= 20) {
+            avuint high = iso_le32(p + 4);
+            avuint low = iso_le32(p + 12);
+
+            if(high == 0)
+                rec->rdev = av_mkdev((low >> 8) & 0xFF, low & 0xFF);
+            else
+                rec->rdev = av_mkdev(high, low);
+        }
+        else if(p[0] == 'S' && p[1] == 'L' && elen >= 5)
+            iso_rr_symlink(rec, p + 5, elen - 5);
+        else if(p[0] == 'T' && p[1] == 'F' && elen >= 5)
+            iso_rr_times(rec, p, elen);
+        else if(p[0] == 'R' && p[1] == 'E')
+            rec->relocated = 1;
+        else if(p[0] == 'C' && p[1] == 'L' && elen >= 12)
+            rec->child = (avoff_t) iso_le32(p + 4) * ISO_SECTOR;
+        else if(p[0] == 'C' && p[1] == 'E' && elen >= 28) {
+            *ceoffp = (avoff_t) iso_le32(p + 4) * ISO_SECTOR +
+                iso_le32(p + 12);
+            *celenp = iso_le32(p + 20);
+        }
+        else if(p[0] == 'S' && p[1] == 'T')
+            break;
+
+        p += elen;
+        len -= elen;
+    }
+}
+
+static int iso_susp(struct isoparse *ip, struct isorec *rec,
+                    const unsigned char *area, int len)
+{
+    int i;
+    avssize_t res;
+    unsigned char *buf = NULL;
+
+    for(i = 0; i < ISO_MAXCE; i++) {
+        avoff_t ceoff = -1;
+        int celen = 0;
+
+        iso_susp_area(rec, area, len, &ceoff, &celen);
+        if(ceoff < 0)
+            break;
+        if(celen <= 0 || celen > ISO_SECTOR) {
+            av_log(AVLOG_WARNING, "ISO9660: Bad continuation area");
+            break;
+        }
+
+        buf = av_realloc(buf, celen);
+        res = av_pread_all(ip->vf, (char *) buf, celen, ceoff);
+        if(res < 0) {
+            av_free(buf);
+            return res;
+        }
+        area = buf;
+        len = celen;
+    }
+    av_free(buf);
+
+    return 0;
+}
+
+static void iso_free_rec(struct isorec *rec)
+{
+    av_free(rec->name);
+    av_free(rec->linkname);
+    av_free(rec->ext);
+}
+
+static int iso_get_rec(struct isoparse *ip, const unsigned char *p,
+                       struct isorec *rec)
+{
+    int res;
+    int namelen = p[DR_NAMELEN];
+    int su = DR_NAME + namelen + ((namelen & 1) == 0 ? 1 : 0);
+
+    memset(rec, 0, sizeof(*rec));
+    rec->flags = p[DR_FLAGS];
+    rec->id = p + DR_NAME;
+    rec->idlen = namelen;
+    rec->child = -1;
+    rec->numext = 1;
+    rec->ext = av_malloc(sizeof(struct isoextent));
+    rec->ext[0].offset =
+        (avoff_t) (iso_le32(p + DR_EXTENT) + p[DR_XALEN]) * ISO_SECTOR;
+    rec->ext[0].size = iso_le32(p + DR_SIZE);
+    iso_set_time(&rec->mtime, iso_short_time(p + DR_DATE));
+    rec->atime = rec->mtime;
+    rec->ctime = rec->mtime;
+
+    if(ip->rockridge && su + ip->suspskip < p[0]) {
+        res = iso_susp(ip, rec, p + su + ip->suspskip,
+                       p[0] - su - ip->suspskip);
+        if(res < 0)
+            return res;
+    }
+
+    if(rec->name == NULL) {
+        if(ip->joliet)
+            rec->name = iso_joliet_name(p + DR_NAME, namelen);
+        else
+            rec->name = av_strndup((const char *) p + DR_NAME, namelen);
+        iso_strip_version(rec->name, ip->joliet);
+    }
+
+    return 0;
+}
+
+static void iso_add_extent(struct isorec *rec, struct isoextent *ext)
+{
+    struct isoextent *last = &rec->ext[rec->numext - 1];
+
+    if(last->offset + last->size == ext->offset) {
+        last->size += ext->size;
+        return;
+    }
+
+    rec->ext = av_realloc(rec->ext, sizeof(struct isoextent) *
+                          (rec->numext + 1));
+    rec->ext[rec->numext] = *ext;
+    rec->numext ++;
+}
+
+static void isonode_delete(struct isonode *info)
+{
+    av_free(info->ext);
+}
+
+static void iso_fill_node(struct archnode *nod, struct isorec *rec,
+                          int isdir)
+{
+    avoff_t size = 0;
+    int i;
+
+    for(i = 0; i < rec->numext; i++)
+        size += rec->ext[i].size;
+
+    if(rec->has_px) {
+        nod->st.mode = rec->mode;
+        if(isdir)
+            nod->st.mode = (nod->st.mode & ~AV_IFMT) | AV_IFDIR;
+        else if((nod->st.mode & AV_IFMT) == 0 || AV_ISDIR(nod->st.mode))
+            nod->st.mode = (nod->st.mode & ~AV_IFMT) | AV_IFREG;
+        nod->st.uid = rec->uid;
+        nod->st.gid = rec->gid;
+        if(!isdir && rec->nlink != 0)
+            nod->st.nlink = rec->nlink;
+    }
+    else if(isdir)
+        nod->st.mode = AV_IFDIR | 0555;
+    else
+        nod->st.mode = AV_IFREG | 0444;
+
+    nod->st.mtime = rec->mtime;
+    nod->st.atime = rec->atime;
+    nod->st.ctime = rec->ctime;
+    nod->st.blksize = ISO_SECTOR;
+
+    if(isdir)
+        return;
+
+    if(rec->linkname != NULL && AV_ISLNK(nod->st.mode)) {
+        nod->linkname = rec->linkname;
+        rec->linkname = NULL;
+        nod->st.size = strlen(nod->linkname);
+        return;
+    }
+
+    if(AV_ISCHR(nod->st.mode) || AV_ISBLK(nod->st.mode))
+        nod->st.rdev = rec->rdev;
+
+    nod->st.size = size;
+    nod->st.blocks = AV_BLOCKS(size);
+    nod->offset = rec->ext[0].offset;
+    nod->realsize = size;
+
+    if(rec->numext > 1) {
+        struct isonode *info;
+
+        AV_NEW_OBJ(info, isonode_delete);
+        info->numext = rec->numext;
+        info->ext = rec->ext;
+        rec->ext = NULL;
+        nod->data = info;
+    }
+}
+
+static int iso_read_dir(struct isoparse *ip, const char *path,
+                        avoff_t offset, avoff_t size, int depth);
+
+/* The size of a directory is in its "." entry */
+static int iso_dir_size(struct isoparse *ip, avoff_t offset, avoff_t *sizep)
+{
+    avssize_t res;
+    unsigned char buf[DR_MINLEN];
+
+    res = av_pread_all(ip->vf, (char *) buf, DR_MINLEN, offset);
+    if(res < 0)
+        return res;
+
+    *sizep = iso_le32(buf + DR_SIZE);
+    return 0;
+}
+
+static int iso_insert(struct isoparse *ip, const char *dir,
+                      struct isorec *rec, int depth)
+{
+    int res;
+    char *path;
+    struct entry *ent;
+    struct archnode *nod;
+    int isdir = (rec->flags & ISO_FL_DIR) != 0;
+    avoff_t diroff = rec->ext[0].offset;
+    avoff_t dirsize = rec->ext[0].size;
+
+    if(rec->relocated)
+        return 0;
+
+    if(!rec->name[0] || strcmp(rec->name, ".") == 0 ||
+       strcmp(rec->name, "..") == 0 || strchr(rec->name, '/') != NULL) {
+        av_log(AVLOG_WARNING, "ISO9660: Illegal name \"%s\"", rec->name);
+        return 0;
+    }
+
+    if(rec->child >= 0) {
+        isdir = 1;
+        diroff = rec->child;
+        res = iso_dir_size(ip, diroff, &dirsize);
+        if(res < 0)
+            return res;
+    }
+
+    path = av_stradd(NULL, dir, "/", rec->name, NULL);
+    ent = av_arch_create(ip->arch, path, 0);
+    if(ent == NULL) {
+        av_free(path);
+        return 0;
+    }
+
+    nod = av_arch_new_node(ip->arch, ent, isdir);
+    iso_fill_node(nod, rec, isdir);
+    av_unref_obj(ent);
+
+    if(isdir)
+        res = iso_read_dir(ip, path, diroff, dirsize, depth + 1);
+    else
+        res = 0;
+
+    av_free(path);
+    return res;
+}
+
+static int iso_visited(struct isoparse *ip, avoff_t offset)
+{
+    int lo = 0;
+    int hi = ip->numdirs;
+
+    while(lo < hi) {
+        int mid = (lo + hi) / 2;
+
+        if(ip->dirs[mid] == offset)
+            return 1;
+        if(ip->dirs[mid] < offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    ip->dirs = av_realloc(ip->dirs, sizeof(avoff_t) * (ip->numdirs + 1));
+    memmove(ip->dirs + lo + 1, ip->dirs + lo,
+            sizeof(avoff_t) * (ip->numdirs - lo));
+    ip->dirs[lo] = offset;
+    ip->numdirs ++;
+
+    return 0;
+}
+
+static int iso_read_dir(struct isoparse *ip, const char *path,
+                        avoff_t offset, avoff_t size, int depth)
+{
+    int res = 0;
+    avsize_t pos;
+    unsigned char *buf;
+    struct isorec pend;
+    int havepend = 0;
+
+    if(iso_visited(ip, offset))
+        return 0;
+
+    if(depth > ISO_MAXDEPTH || size > ISO_MAXDIR) {
+        av_log(AVLOG_WARNING, "ISO9660: Directory %s too deep or too large",
+               path[0] ? path : "/");
+        return 0;
+    }
+
+    buf = av_malloc(size);
+    res = av_pread_all(ip->vf, (char *) buf, size, offset);
+    if(res < 0) {
+        av_free(buf);
+        return res;
+    }
+    res = 0;
+
+    pos = 0;
+    while(pos < size) {
+        struct isorec rec;
+        const unsigned char *p = buf + pos;
+
+        if(p[0] == 0) {
+            /* Records don't cross sectors, the rest is padding */
+            pos = (pos / ISO_SECTOR + 1) * ISO_SECTOR;
+            continue;
+        }
+        if(p[0] < DR_MINLEN || pos + p[0] > size ||
+           pos % ISO_SECTOR + p[0] > ISO_SECTOR ||
+           DR_NAME + p[DR_NAMELEN] > p[0]) {
+            av_log(AVLOG_WARNING, "ISO9660: Broken directory %s",
+                   path[0] ? path : "/");
+            break;
+        }
+        pos += p[0];
+
+        /* Skip "." and ".." and associated files */
+        if((p[DR_NAMELEN] == 1 && p[DR_NAME] <= 1) ||
+           (p[DR_FLAGS] & ISO_FL_ASSOC) != 0)
+            continue;
+
+        if(p[DR_UNITSIZE] != 0) {
+            av_log(AVLOG_WARNING, "ISO9660: Interleaved files not supported");
+            continue;
+        }
+
+        res = iso_get_rec(ip, p, &rec);
+        if(res < 0)
+            break;
+
+        /* The following extents of a file have the same identifier */
+        if(havepend && (pend.idlen != rec.idlen ||
+                        memcmp(pend.id, rec.id, rec.idlen) != 0 ||
+                        (rec.flags & ISO_FL_DIR) != 0)) {
+            av_log(AVLOG_WARNING, "ISO9660: Incomplete file %s", pend.name);
+            res = iso_insert(ip, path, &pend, depth);
+            iso_free_rec(&pend);
+            havepend = 0;
+            if(res < 0) {
+                iso_free_rec(&rec);
+                break;
+            }
+        }
+        if(havepend) {
+            iso_add_extent(&pend, &rec.ext[0]);
+            pend.flags = rec.flags;
+            iso_free_rec(&rec);
+        }
+        else {
+            pend = rec;
+            havepend = 1;
+        }
+
+        if(!(pend.flags & ISO_FL_MULTI)) {
+            res = iso_insert(ip, path, &pend, depth);
+            iso_free_rec(&pend);
+            havepend = 0;
+            if(res < 0)
+                break;
+        }
+    }
+
+    if(havepend) {
+        if(res == 0)
+            res = iso_insert(ip, path, &pend, depth);
+        iso_free_rec(&pend);
+    }
+    av_free(buf);
+
+    return res;
+}
+
+/* Rock Ridge is announced by an SP entry in the "." entry of the root */
+static int iso_check_rockridge(struct isoparse *ip, avoff_t offset)
+{
+    avssize_t res;
+    unsigned char buf[DR_MINLEN + 7];
+
+    res = av_pread(ip->vf, (char *) buf, sizeof(buf), offset);
+    if(res < 0)
+        return res;
+
+    if(res == sizeof(buf) && buf[0] >= sizeof(buf) &&
+       buf[DR_MINLEN] == 'S' && buf[DR_MINLEN + 1] == 'P' &&
+       buf[DR_MINLEN + 4] == 0xBE && buf[DR_MINLEN + 5] == 0xEF) {
+        ip->rockridge = 1;
+        ip->suspskip = buf[DR_MINLEN + 6];
+    }
+
+    return 0;
+}
+
+static int iso_is_joliet(const unsigned char *vd)
+{
+    const unsigned char *esc = vd + ISO_VD_ESCAPES;
+
+    return esc[0] == '%' && esc[1] == '/' &&
+        (esc[2] == '@' || esc[2] == 'C' || esc[2] == 'E');
+}
+
+static int read_isofile(struct isoparse *ip)
+{
+    int res;
+    int i;
+    unsigned char vd[ISO_SECTOR];
+    unsigned char root[DR_MINLEN];
+    unsigned char jroot[DR_MINLEN];
+    int havepvd = 0;
+    int havejoliet = 0;
+    avoff_t offset;
+    avoff_t size;
+
+    for(i = 0; i < ISO_VD_MAX; i++) {
+        res = av_pread_all(ip->vf, (char *) vd, ISO_SECTOR,
+                           (avoff_t) (ISO_VD_START + i) * ISO_SECTOR);
+        if(res < 0)
+            return res;
+
+        if(memcmp(vd + 1, "CD001", 5) != 0) {
+            av_log(AVLOG_ERROR, "ISO9660: Bad volume descriptor");
+            return -EIO;
+        }
+        if(vd[0] == ISO_VD_END)
+            break;
+        if(vd[0] == ISO_VD_PRIMARY && !havepvd) {
+            memcpy(root, vd + ISO_VD_ROOT, DR_MINLEN);
+            havepvd = 1;
+        }
+        else if(vd[0] == ISO_VD_SUPPLEMENTARY && !havejoliet &&
+                iso_is_joliet(vd)) {
+            memcpy(jroot, vd + ISO_VD_ROOT, DR_MINLEN);
+            havejoliet = 1;
+        }
+    }
+    if(!havepvd) {
+        av_log(AVLOG_ERROR, "ISO9660: No primary volume descriptor");
+        return -EIO;
+    }
+
+    offset = (avoff_t) iso_le32(root + DR_EXTENT) * ISO_SECTOR;
+    res = iso_check_rockridge(ip, offset);
+    if(res < 0)
+        return res;
+
+    if(!ip->rockridge && havejoliet) {
+        ip->joliet = 1;
+        memcpy(root, jroot, DR_MINLEN);
+        offset = (avoff_t) iso_le32(root + DR_EXTENT) * ISO_SECTOR;
+    }
+    size = iso_le32(root + DR_SIZE);
+
+    return iso_read_dir(ip, "", offset, size, 0);
+}
+
+static int parse_isofile(void *data, ventry *ve, struct archive *arch)
+{
+    int res;
+    struct isoparse ip;
+
+    res = av_open(ve->mnt->base, AVO_RDONLY, 0, &ip.vf);
+    if(res < 0)
+        return res;
+
+    ip.arch = arch;
+    ip.joliet = 0;
+    ip.rockridge = 0;
+    ip.suspskip = 0;
+    ip.dirs = NULL;
+    ip.numdirs = 0;
+
+    res = read_isofile(&ip);
+    av_free(ip.dirs);
+    av_close(ip.vf);
+
+    return res;
+}
+
+static avssize_t iso_read(vfile *vf, char *buf, avsize_t nbyte)
+{
+    avssize_t res;
+    struct archfile *fil = arch_vfile_file(vf);
+    struct isonode *info = (struct isonode *) fil->nod->data;
+    avsize_t nread = 0;
+
+    if(info == NULL)
+        return av_arch_read(vf, buf, nbyte);
+
+    while(nread < nbyte) {
+        avoff_t pos = vf->ptr;
+        avoff_t nact;
+        int i;
+
+        for(i = 0; i < info->numext && pos >= info->ext[i].size; i++)
+            pos -= info->ext[i].size;
+        if(i == info->numext)
+            break;
+
+        nact = AV_MIN((avoff_t) (nbyte - nread), info->ext[i].size - pos);
+        res = av_pread(fil->basefile, buf + nread, nact,
+                       info->ext[i].offset + pos);
+        if(res < 0)
+            return res;
+        if(res == 0)
+            break;
+
+        nread += res;
+        vf->ptr += res;
+    }
+
+    return nread;
+}
+
+int av_init_module_uiso9660(struct vmodule *module);
+
+int av_init_module_uiso9660(struct vmodule *module)
+{
+    int res;
+    struct avfs *avfs;
+    struct ext_info isoexts[2];
+    struct archparams *ap;
+
+    isoexts[0].from = ".iso", isoexts[0].to = NULL;
+    isoexts[1].from = NULL;
+
+    res = av_archive_init("uiso9660", isoexts, AV_VER, module, &avfs);
+    if(res < 0)
+        return res;
+
+    ap = (struct archparams *) avfs->data;
+    ap->parse = parse_isofile;
+    ap->read = iso_read;
+
+    av_add_avfs(avfs);
+
+    return 0;
+}
@@ -14,6 +14,8 @@
 #include "prog.h"
 #include "oper.h"
 #include "version.h"
+#include "cache.h"
+#include "tmpfile.h"
 
 #include <fcntl.h>
 #include <unistd.h>
@@ -121,14 +123,17 @@ enum { RAR5_HEADER_TYPE_MAIN_ARCHIVE_HEADER = 1,
        RAR5_HEADER_TYPE_FILE_HEADER = 2,
        RAR5_HEADER_TYPE_END_OF_ARCHIVE = 5 };
 enum { RAR5_HEADER_FLAGS_EXTRA_PRESENT = 1,
-       RAR5_HEADER_FLAGS_DATA_PRESENT = 2 };
+       RAR5_HEADER_FLAGS_DATA_PRESENT = 2,
+       RAR5_HEADER_FLAGS_SPLIT_BEFORE = 8,
+       RAR5_HEADER_FLAGS_SPLIT_AFTER = 16 };
 enum { RAR5_HEADER_FILE_HEADER_FILE_FLAGS_DIRECTORY_OBJECT = 1,
        RAR5_HEADER_FILE_HEADER_FILE_FLAGS_UNIX_TIME_PRESENT = 2,
        RAR5_HEADER_FILE_HEADER_FILE_FLAGS_CRC_PRESENT = 4,
        RAR5_HEADER_FILE_HEADER_FILE_FLAGS_UNPACKED_SIZE_UNKNOWN = 8 };
 enum { RAR5_HEADER_FILE_HEADER_HOST_OS_WINDOWS = 0,
        RAR5_HEADER_FILE_HEADER_HOST_OS_UNIX = 1 };
-enum { RAR5_HEADER_FILE_HEADER_EXTRA_TYPE_FILE_TIME = 3 };
+enum { RAR5_HEADER_FILE_HEADER_EXTRA_TYPE_ENCRYPTION = 1,
+       RAR5_HEADER_FILE_HEADER_EXTRA_TYPE_FILE_TIME = 3 };
 enum { RAR5_HEADER_FILE_HEADER_EXTRA_FILE_TIME_FLAGS_UNIX_TIME = 0x01,
        RAR5_HEADER_FILE_HEADER_EXTRA_FILE_TIME_FLAGS_MTIME_PRESENT = 0x02,
        RAR5_HEADER_FILE_HEADER_EXTRA_FILE_TIME_FLAGS_CTIME_PRESENT = 0x04,
@@ -160,10 +165,20 @@ struct rar5_entinfo {
     avtimestruc_t atime;
     avtimestruc_t ctime;
     avmode_t mode;
+    avoff_t datastart;
+    avushort flags;
+    avbyte method;
 };
 
-struct rarfile {
+/* Extracted members are kept in the cache under their path, and are
+   used as long as the archive doesn't change */
+struct rarcacheentry {
+    struct avstat sig;
     char *tmpfile;
+};
+
+struct rarfile {
+    struct rarcacheentry *cent;
     int fd;
 };
 
@@ -360,6 +375,16 @@ static avmode_t rar_get_mode(struct rar_entinfo *ei, avmode_t origmode)
     }
 }
 
+/* Stored members in a single volume are read directly from the archive */
+static int rar_in_place(avbyte method, avushort flags)
+{
+    if(method == M_STORE &&
+       (flags & (FF_CONT_FROM_PREV | FF_CONT_IN_NEXT | FF_WITH_PASSWORD)) == 0)
+        return 1;
+    else
+        return 0;
+}
+
 static void fill_rarentry(struct archive *arch, struct entry *ent,
                          struct rar_entinfo *ei)
 {
@@ -379,7 +404,7 @@ static void fill_rarentry(struct archive *arch, struct entry *ent,
     nod->st.blksize = 4096;
 
     nod->offset = ei->datastart;
-    if(fh_method(ei->fh) == M_STORE)
+    if(rar_in_place(fh_method(ei->fh), bh_flags(ei->bh)))
         nod->realsize = fh_origsize(ei->fh);
     else
         nod->realsize = 0;
@@ -433,18 +458,21 @@ static void fill_rar5entry(struct archive *arch, struct entry *ent,
     nod->st.blocks = AV_BLOCKS(nod->st.size);
     nod->st.blksize = 512;
 
-    nod->offset = 0;
-    nod->realsize = 0;
+    nod->offset = ei->datastart;
+    if(rar_in_place(ei->method, ei->flags))
+        nod->realsize = ei->size;
+    else
+        nod->realsize = 0;
 
     nod->linkname = NULL;
 
     AV_NEW_OBJ(info, rarnode_delete);
     nod->data = info;
 
-    info->flags = 0;
+    info->flags = ei->flags;
     info->hostos = 0;
     info->packer_version = 0;
-    info->method = 0;
+    info->method = ei->method;
     info->path = av_strdup(ei->name);
 }
 
@@ -764,6 +792,8 @@ static int parse_rar5_extra_header(vfile *vf,
             if (res < 0) {
                 return res;
             }
+        } else if (type == RAR5_HEADER_FILE_HEADER_EXTRA_TYPE_ENCRYPTION) {
+            ei->flags |= FF_WITH_PASSWORD;
         }
 
         if (vf->ptr - extra_header_pos > size ||
@@ -783,6 +813,7 @@ static int parse_rar5_extra_header(vfile *vf,
 
 static int parse_rar5_file_header(vfile *vf, struct archive *arch,
                                   avuquad remaining_header_bytes,
+                                  avuquad header_flags, avoff_t datastart,
                                   avuint *crc)
 {
     avoff_t start_pos = vf->ptr;
@@ -823,6 +854,16 @@ static int parse_rar5_file_header(vfile *vf, struct archive *arch,
 
     READ_VINT(vf, &compression_information, crc);
     READ_VINT(vf, &host_os, crc);
+
+    /* method 0 is store, the others map to the RAR 1.5 values */
+    ei.method = M_STORE + ((compression_information >> 7) & 0x07);
+    ei.datastart = datastart;
+    if (header_flags & RAR5_HEADER_FLAGS_SPLIT_BEFORE) {
+        ei.flags |= FF_CONT_FROM_PREV;
+    }
+    if (header_flags & RAR5_HEADER_FLAGS_SPLIT_AFTER) {
+        ei.flags |= FF_CONT_IN_NEXT;
+    }
     READ_VINT(vf, &name_length, crc);
 
     if (name_length <= PATH_MAX) {
@@ -938,7 +979,8 @@ static int parse_rar5_block(vfile *vf, struct archive *arch)
     }
 
     if (header_type == RAR5_HEADER_TYPE_FILE_HEADER) {
-        res = parse_rar5_file_header(vf, arch, header_size - (vf->ptr - headstart), &crc);
+        res = parse_rar5_file_header(vf, arch, header_size - (vf->ptr - headstart),
+                                     header_flags, headstart + header_size, &crc);
         if (res < 0) {
             return res;
         }
@@ -1046,8 +1088,8 @@ static int parse_rarfile(void *data, ventry *ve, struct archive *arch)
     return res;  
 }
 
-/* FIXME: Because we use the 'rar' program to extract the contents of
-   each file individually , we get _VERY_ poor performance */
+/* Compressed members are extracted with the 'rar' program one by one,
+   which is slow, so the extracted files are cached */
 
 static int get_rar_file(ventry *ve, struct archfile *fil, int fd)
 {
@@ -1117,10 +1159,17 @@ static int get_rar_file(ventry *ve, struct archfile *fil, int fd)
     return res;
 }
 
-static int do_unrar(ventry *ve, struct archfile *fil)
+static void rarcacheentry_delete(struct rarcacheentry *cent)
+{
+    if(cent->tmpfile != NULL)
+        av_del_tmpfile(cent->tmpfile);
+}
+
+static int extract_rar_file(ventry *ve, struct archfile *fil,
+                            struct rarcacheentry **resp)
 {
     int res;
-    struct rarfile *rfil;
+    struct rarcacheentry *cent;
     char *tmpfile;
     int fd;
 
@@ -1138,14 +1187,72 @@ static int do_unrar(ventry *ve, struct archfile *fil)
     }
 
     res = get_rar_file(ve, fil, fd);
+    close(fd);
     if(res < 0) {
-        close(fd);
         av_del_tmpfile(tmpfile);
         return res;
     }
 
+    AV_NEW_OBJ(cent, rarcacheentry_delete);
+    cent->tmpfile = tmpfile;
+
+    *resp = cent;
+    return 0;
+}
+
+static int do_unrar(ventry *ve, struct archfile *fil)
+{
+    int res;
+    struct rarfile *rfil;
+    struct rarcacheentry *cent;
+    struct avstat sig;
+    avoff_t size;
+    char *key;
+    int fd;
+
+    res = av_getattr(ve->mnt->base, &sig, REALFILE_SIGMASK, 0);
+    if(res < 0)
+        return res;
+
+    res = av_generate_path(ve, &key);
+    if(res < 0)
+        return res;
+
+    cent = (struct rarcacheentry *) av_cache2_get(key);
+    if(cent != NULL && !av_realfile_same(&cent->sig, &sig)) {
+        av_unref_obj(cent);
+        cent = NULL;
+    }
+
+    if(cent == NULL) {
+        res = extract_rar_file(ve, fil, &cent);
+        if(res < 0) {
+            av_free(key);
+            return res;
+        }
+        cent->sig = sig;
+
+        /* Like av_get_realfile, don't let one member flush the cache */
+        size = av_tmpfile_blksize(cent->tmpfile);
+        if(size <= av_cache_limit() / 2) {
+            av_cache2_set(cent, key);
+            if(size > 0)
+                av_cache2_setsize(key, size);
+        }
+    }
+    av_free(key);
+
+    fd = open(cent->tmpfile, O_RDONLY);
+    if(fd == -1) {
+        res = -errno; 
+        av_log(AVLOG_ERROR, "RAR: Could not open %s: %s", cent->tmpfile,
+               strerror(errno));
+        av_unref_obj(cent);
+        return res;
+    }
+
     AV_NEW(rfil);
-    rfil->tmpfile = tmpfile;
+    rfil->cent = cent;
     rfil->fd = fd;
 
     fil->data = rfil;
@@ -1168,7 +1275,7 @@ static int rar_open(ventry *ve, struct archfile *fil)
         return -EACCES;
     }
 
-    if(info->method != M_STORE)
+    if(!rar_in_place(info->method, info->flags))
         return do_unrar(ve, fil);
     
     return 0;
@@ -1180,7 +1287,7 @@ static int rar_close(struct archfile *fil)
 
     if(rfil != NULL) {
         close(rfil->fd);
-        av_del_tmpfile(rfil->tmpfile);
+        av_unref_obj(rfil->cent);
         av_free(rfil);
     }
     
@@ -1194,6 +1194,19 @@ static void tar_release(struct archive *arch, struct archnode *nod)
 }
 
 
+/* The base file is shared by all readers of the archive, so use
+   positional reads instead of moving its file pointer */
+static int get_block_at(vfile *vf, union block *blk, avoff_t offset)
+{
+    avssize_t res;
+
+    res = av_pread_all(vf, blk->buffer, BLOCKSIZE, offset);
+    if(res < 0)
+        return res;
+
+    return 0;
+}
+
 static int read_sparsearray(struct archfile *fil)
 {
     int res;
@@ -1202,11 +1215,12 @@ static int read_sparsearray(struct archfile *fil)
     struct sp_array *sparses;
     struct tarnode *tn = (struct tarnode *) fil->nod->data;
     int size, len;
+    avoff_t offset = tn->headeroff;
   
-    av_lseek(fil->basefile, tn->headeroff, AVSEEK_SET);
-    res = get_next_block(fil->basefile, &header);
+    res = get_block_at(fil->basefile, &header, offset);
     if(res < 0)
         return res;
+    offset += BLOCKSIZE;
 
     size = 10;
     len = 0;
@@ -1228,11 +1242,12 @@ static int read_sparsearray(struct archfile *fil)
            the sparsearray as before.  */
 
         while (1) {
-            res = get_next_block(fil->basefile, &header);
+            res = get_block_at(fil->basefile, &header, offset);
             if(res < 0) {
                 av_free(sparses);
                 return res;
             }
+            offset += BLOCKSIZE;
       
             for (counter = 0; counter < SPARSES_IN_SPARSE_HEADER; counter++) {
                 if (counter + len > size - 1) {
@@ -1261,7 +1276,7 @@ static int read_sparsearray(struct archfile *fil)
   
     tn->sparsearray = sparses;
     tn->sp_array_len = len;
-    fil->nod->offset = fil->basefile->ptr; /* the correct offset */
+    fil->nod->offset = offset; /* the correct offset */
 
     return 0;
 }
@@ -1288,13 +1303,16 @@ static avssize_t read_sparse(vfile *vf, char *buf, avsize_t nbyte)
     if(vf->ptr >= size) 
         return 0;
   
-    if(tn->sparsearray == NULL) {
+    AV_LOCK(fil->nod->lock);
+    if(tn->sparsearray == NULL)
         res = read_sparsearray(fil);
-        if(res < 0)
-            return res;
-    }
+    else
+        res = 0;
     sparses = tn->sparsearray;
     offset = fil->nod->offset;
+    AV_UNLOCK(fil->nod->lock);
+    if(res < 0)
+        return res;
 
     // since nbyte is avsize_t, the min will not be larger than that datatype
     nact = (avsize_t)AV_MIN((avoff_t)nbyte, (avoff_t) (size - vf->ptr));
@@ -80,30 +80,36 @@ static struct xznode *xz_do_get_node(ventry *ve, const char *key,
     return nod;
 }
 
-static int xz_getnode(ventry *ve, vfile *base, struct xznode **resp)
+static int xz_find_node(ventry *ve, struct avstat *stbuf,
+                        struct xznode **resp)
 {
     int res;
-    struct avstat stbuf;
-    const int attrmask = AVA_INO | AVA_DEV | AVA_SIZE | AVA_MTIME;
-    struct xznode *nod;
     char *key;
 
-    res = av_fgetattr(base, &stbuf, attrmask);
-    if(res < 0)
-        return res;
-
     res = av_filecache_getkey(ve, &key);
     if(res < 0)
         return res;
 
-    nod = xz_do_get_node(ve, key, &stbuf);
+    *resp = xz_do_get_node(ve, key, stbuf);
 
     av_free(key);
 
-    *resp = nod;
     return 0;
 }
 
+static int xz_getnode(ventry *ve, vfile *base, struct xznode **resp)
+{
+    int res;
+    struct avstat stbuf;
+    const int attrmask = AVA_INO | AVA_DEV | AVA_SIZE | AVA_MTIME;
+
+    res = av_fgetattr(base, &stbuf, attrmask);
+    if(res < 0)
+        return res;
+
+    return xz_find_node(ve, &stbuf, resp);
+}
+
 static int xz_lookup(ventry *ve, const char *name, void **newp)
 {
     char *path = (char *) ve->data;
@@ -191,6 +197,16 @@ static avssize_t xz_read(vfile *vf, char *buf, avsize_t nbyte)
     return res;
 }
 
+static void xz_set_attr(struct avfs *avfs, struct xznode *nod,
+                        struct avstat *buf)
+{
+    buf->mode &= ~(07000);
+    buf->blksize = 4096;
+    buf->dev = avfs->dev;
+    buf->ino = nod->ino;
+    buf->nlink = 1;
+}
+
 static int xz_getattr(vfile *vf, struct avstat *buf, int attrmask)
 {
     int res;
@@ -216,15 +232,46 @@ static int xz_getattr(vfile *vf, struct avstat *buf, int attrmask)
         buf->blocks = AV_BLOCKS(buf->size);
     }
 
-    buf->mode &= ~(07000);
-    buf->blksize = 4096;
-    buf->dev = vf->mnt->avfs->dev;
-    buf->ino = nod->ino;
-    buf->nlink = 1;
+    xz_set_attr(vf->mnt->avfs, nod, buf);
     
     return 0;
 }
 
+/* Without opening anything, unless the size is needed and not known */
+static int xz_statent(ventry *ve, struct avstat *buf, int attrmask,
+                      int flags)
+{
+    int res;
+    struct xznode *nod;
+    avoff_t size;
+    const int basemask = AVA_INO | AVA_DEV | AVA_SIZE | AVA_MODE | AVA_UID |
+        AVA_GID | AVA_MTIME | AVA_ATIME | AVA_CTIME;
+
+    res = av_getattr(ve->mnt->base, buf, basemask, 0);
+    if(res < 0)
+        return res;
+
+    res = xz_find_node(ve, buf, &nod);
+    if(res < 0)
+        return res;
+
+    if((attrmask & (AVA_SIZE | AVA_BLKCNT)) != 0) {
+        av_xzfile_size(NULL, nod->cache, &size);
+        if(size == -1) {
+            av_unref_obj(nod);
+            return -ENOSYS;
+        }
+
+        buf->size = size;
+        buf->blocks = AV_BLOCKS(buf->size);
+    }
+
+    xz_set_attr(ve->mnt->avfs, nod, buf);
+    av_unref_obj(nod);
+
+    return 0;
+}
+
 extern int av_init_module_uxz(struct vmodule *module);
 
 int av_init_module_uxz(struct vmodule *module)
@@ -245,6 +292,7 @@ int av_init_module_uxz(struct vmodule *module)
 
     avfs->lookup   = xz_lookup;
     avfs->access   = xz_access;
+    avfs->statent  = xz_statent;
     avfs->open     = xz_open;
     avfs->close    = xz_close; 
     avfs->read     = xz_read;
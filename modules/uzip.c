@@ -814,14 +814,20 @@ static avssize_t zip_deflate_read(vfile *vf, char *buf, avsize_t nbyte)
     struct zipnode *info = (struct zipnode *) fil->nod->data;
     struct zcache *zc;
 
+    /* the inflate itself runs unlocked, only the shared index cache
+       of the node is protected */
+    AV_LOCK(fil->nod->lock);
     zc = (struct zcache *) av_cacheobj_get(info->cache);
     if(zc == NULL) {
         av_unref_obj(info->cache);
         info->cache = NULL;
         zc = av_zcache_new();
     }
+    AV_UNLOCK(fil->nod->lock);
     
     res = av_zfile_pread(zfil, zc, buf, nbyte, vf->ptr);
+
+    AV_LOCK(fil->nod->lock);
     if(res >= 0) {
         avoff_t cachesize;
 
@@ -838,6 +844,7 @@ static avssize_t zip_deflate_read(vfile *vf, char *buf, avsize_t nbyte)
         av_unref_obj(info->cache);
         info->cache = NULL;
     }
+    AV_UNLOCK(fil->nod->lock);
     av_unref_obj(zc);
 
     return res;
@@ -80,30 +80,36 @@ static struct zstdnode *zstd_do_get_node(ventry *ve, const char *key,
     return nod;
 }
 
-static int zstd_getnode(ventry *ve, vfile *base, struct zstdnode **resp)
+static int zstd_find_node(ventry *ve, struct avstat *stbuf,
+                          struct zstdnode **resp)
 {
     int res;
-    struct avstat stbuf;
-    const int attrmask = AVA_INO | AVA_DEV | AVA_SIZE | AVA_MTIME;
-    struct zstdnode *nod;
     char *key;
 
-    res = av_fgetattr(base, &stbuf, attrmask);
-    if(res < 0)
-        return res;
-
     res = av_filecache_getkey(ve, &key);
     if(res < 0)
         return res;
 
-    nod = zstd_do_get_node(ve, key, &stbuf);
+    *resp = zstd_do_get_node(ve, key, stbuf);
 
     av_free(key);
 
-    *resp = nod;
     return 0;
 }
 
+static int zstd_getnode(ventry *ve, vfile *base, struct zstdnode **resp)
+{
+    int res;
+    struct avstat stbuf;
+    const int attrmask = AVA_INO | AVA_DEV | AVA_SIZE | AVA_MTIME;
+
+    res = av_fgetattr(base, &stbuf, attrmask);
+    if(res < 0)
+        return res;
+
+    return zstd_find_node(ve, &stbuf, resp);
+}
+
 static int zstd_lookup(ventry *ve, const char *name, void **newp)
 {
     char *path = (char *) ve->data;
@@ -191,6 +197,16 @@ static avssize_t zstd_read(vfile *vf, char *buf, avsize_t nbyte)
     return res;
 }
 
+static void zstd_set_attr(struct avfs *avfs, struct zstdnode *nod,
+                          struct avstat *buf)
+{
+    buf->mode &= ~(07000);
+    buf->blksize = 4096;
+    buf->dev = avfs->dev;
+    buf->ino = nod->ino;
+    buf->nlink = 1;
+}
+
 static int zstd_getattr(vfile *vf, struct avstat *buf, int attrmask)
 {
     int res;
@@ -216,15 +232,46 @@ static int zstd_getattr(vfile *vf, struct avstat *buf, int attrmask)
         buf->blocks = AV_BLOCKS(buf->size);
     }
 
-    buf->mode &= ~(07000);
-    buf->blksize = 4096;
-    buf->dev = vf->mnt->avfs->dev;
-    buf->ino = nod->ino;
-    buf->nlink = 1;
+    zstd_set_attr(vf->mnt->avfs, nod, buf);
     
     return 0;
 }
 
+/* Without opening anything, unless the size is needed and not known */
+static int zstd_statent(ventry *ve, struct avstat *buf, int attrmask,
+                        int flags)
+{
+    int res;
+    struct zstdnode *nod;
+    avoff_t size;
+    const int basemask = AVA_INO | AVA_DEV | AVA_SIZE | AVA_MODE | AVA_UID |
+        AVA_GID | AVA_MTIME | AVA_ATIME | AVA_CTIME;
+
+    res = av_getattr(ve->mnt->base, buf, basemask, 0);
+    if(res < 0)
+        return res;
+
+    res = zstd_find_node(ve, buf, &nod);
+    if(res < 0)
+        return res;
+
+    if((attrmask & (AVA_SIZE | AVA_BLKCNT)) != 0) {
+        av_zstdfile_size(NULL, nod->cache, &size);
+        if(size == -1) {
+            av_unref_obj(nod);
+            return -ENOSYS;
+        }
+
+        buf->size = size;
+        buf->blocks = AV_BLOCKS(buf->size);
+    }
+
+    zstd_set_attr(ve->mnt->avfs, nod, buf);
+    av_unref_obj(nod);
+
+    return 0;
+}
+
 extern int av_init_module_uzstd(struct vmodule *module);
 
 int av_init_module_uzstd(struct vmodule *module)
@@ -244,6 +291,7 @@ int av_init_module_uzstd(struct vmodule *module)
 
     avfs->lookup   = zstd_lookup;
     avfs->access   = zstd_access;
+    avfs->statent  = zstd_statent;
     avfs->open     = zstd_open;
     avfs->close    = zstd_close; 
     avfs->read     = zstd_read;
@@ -15,6 +15,8 @@ struct volnode {
     struct avstat st;
     struct volentry *subdir;  /* only dir */
     struct volentry *parent;  /* only dir */
+    struct volentry *dircurs; /* only dir, last entry returned by readdir */
+    int dircursn;             /* only dir, index of dircurs */
     char *content;            /* only regular & symlink */
 };
 
@@ -37,6 +39,11 @@ struct volfs {
 /* av_obj.destr for volentry */
 static void vol_unlink_entry(struct volentry *ent)
 {
+    /* the position of the following entries changes */
+    if(ent->prevp != NULL && ent->parent != NULL &&
+       ent->parent->node != NULL)
+        ent->parent->node->dircurs = NULL;
+
     if(ent->prevp != NULL)
         *ent->prevp = ent->next;
     if(ent->next != NULL)
@@ -82,6 +89,8 @@ static struct volnode *vol_new_node(struct avstat *initstat)
     nod->st = *initstat;
     nod->subdir = NULL;
     nod->parent = NULL;
+    nod->dircurs = NULL;
+    nod->dircursn = 0;
     nod->content = NULL;
 
     return nod;
@@ -502,13 +511,24 @@ static struct volnode *vol_nth_entry(int n, struct volnode *nod,
         n -= 2;
     }
 
-    ent = nod->subdir;
-    for(i = 0; i < n && ent != NULL; i++)
+    /* continue from the last entry returned if possible */
+    if(nod->dircurs != NULL && n >= nod->dircursn) {
+        ent = nod->dircurs;
+        i = nod->dircursn;
+    }
+    else {
+        ent = nod->subdir;
+        i = 0;
+    }
+    for(; i < n && ent != NULL; i++)
         ent = ent->next;
     
     if(ent == NULL)
         return NULL;
 
+    nod->dircurs = ent;
+    nod->dircursn = n;
+
     *namep = ent->name;
     return ent->node;
 }
@@ -7,15 +7,31 @@
 */
 
 #if 1
+#include "config.h"
 #include "avfs.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+/* The counter is only used for the leak report at exit, so with atomic
+   operations there is no need for a lock on every allocation */
 static int malloctr;
+
+#ifdef HAVE_ATOMIC_BUILTINS
+#define MALLOCTR_ADD(n) __atomic_add_fetch(&malloctr, (n), __ATOMIC_RELAXED)
+#define MALLOCTR_GET()  __atomic_load_n(&malloctr, __ATOMIC_RELAXED)
+#else
 static AV_LOCK_DECL(mallock);
 
-void av_check_malloc()
+static void malloctr_add(int n)
+{
+    AV_LOCK(mallock);
+    malloctr += n;
+    AV_UNLOCK(mallock);
+}
+
+static int malloctr_get()
 {
     int ctr;
 
@@ -23,6 +39,19 @@ void av_check_malloc()
     ctr = malloctr;
     AV_UNLOCK(mallock);
 
+    return ctr;
+}
+
+#define MALLOCTR_ADD(n) malloctr_add(n)
+#define MALLOCTR_GET()  malloctr_get()
+#endif
+
+void av_check_malloc()
+{
+    int ctr;
+
+    ctr = MALLOCTR_GET();
+
     if(ctr != 0) 
         av_log(AVLOG_WARNING, "Unfreed memory remaining (%i)", ctr);
     else
@@ -40,9 +69,7 @@ void *av_malloc(avsize_t nbyte)
 {
     void *p;
 
-    AV_LOCK(mallock);
-    malloctr ++;
-    AV_UNLOCK(mallock);
+    MALLOCTR_ADD(1);
 
     if(nbyte == 0)
         nbyte = 1;
@@ -58,9 +85,7 @@ void *av_calloc(avsize_t nbyte)
 {
     void *p;
 
-    AV_LOCK(mallock);
-    malloctr ++;
-    AV_UNLOCK(mallock);
+    MALLOCTR_ADD(1);
     
     if(nbyte == 0)
         nbyte = 1;
@@ -76,12 +101,10 @@ void *av_realloc(void *ptr, avsize_t nbyte)
 {
     void *p;
     
-    AV_LOCK(mallock);
     if(ptr == 0)
-        malloctr ++;
+        MALLOCTR_ADD(1);
     else if(nbyte == 0)
-        malloctr --;
-    AV_UNLOCK(mallock);
+        MALLOCTR_ADD(-1);
 
     if(ptr == NULL && nbyte == 0)
         nbyte = 1;
@@ -95,12 +118,182 @@ void *av_realloc(void *ptr, avsize_t nbyte)
 
 void av_free(void *ptr)
 {
-    AV_LOCK(mallock);
-    if(ptr != NULL)
-        malloctr --;
-    AV_UNLOCK(mallock);
-
-    if(ptr != NULL)
+    if(ptr != NULL) {
+        MALLOCTR_ADD(-1);
 	free(ptr);
+    }
+}
+
+#ifdef USE_ARENA_ALLOC
+
+/* Size-class arenas for small objects.  Objects are carved from large
+   slabs and recycled through free lists, a per-thread list in front of
+   a shared one for each class.  Slabs are never returned to the
+   system. */
+
+#define ARENA_ALIGN 16
+#define ARENA_MAXSIZE 256
+#define ARENA_NUMCLASSES (ARENA_MAXSIZE / ARENA_ALIGN)
+#define ARENA_SLABSIZE (64 * 1024)
+#define ARENA_LOCALMAX 64
+#define ARENA_BATCH 32
+
+struct arena_free {
+    struct arena_free *next;
+};
+
+struct arena_class {
+    avmutex lock;
+    struct arena_free *freelist;
+    char *slab;
+    avsize_t slabfree;
+};
+
+static struct arena_class arena_classes[ARENA_NUMCLASSES];
+static pthread_key_t arena_key;
+static pthread_once_t arena_key_once = PTHREAD_ONCE_INIT;
+
+static __thread struct arena_free *arena_local[ARENA_NUMCLASSES];
+static __thread int arena_localctr[ARENA_NUMCLASSES];
+static __thread int arena_registered;
+
+/* Move num objects from the thread's list to the shared one */
+static void arena_release(int cls, int num)
+{
+    struct arena_class *ac = &arena_classes[cls];
+    struct arena_free *first = arena_local[cls];
+    struct arena_free *last = first;
+    int i;
+
+    if(first == NULL)
+        return;
+
+    for(i = 1; i < num && last->next != NULL; i++)
+        last = last->next;
+
+    arena_local[cls] = last->next;
+    arena_localctr[cls] -= i;
+
+    AV_LOCK(ac->lock);
+    last->next = ac->freelist;
+    ac->freelist = first;
+    AV_UNLOCK(ac->lock);
 }
+
+static void arena_thread_exit(void *data)
+{
+    int cls;
+
+    for(cls = 0; cls < ARENA_NUMCLASSES; cls++)
+        arena_release(cls, arena_localctr[cls]);
+}
+
+static void arena_init_key()
+{
+    int cls;
+
+    for(cls = 0; cls < ARENA_NUMCLASSES; cls++)
+        AV_INITLOCK(arena_classes[cls].lock);
+
+    pthread_key_create(&arena_key, arena_thread_exit);
+}
+
+/* Fill the thread's list from the shared list or a new slab */
+static void arena_refill(int cls)
+{
+    struct arena_class *ac = &arena_classes[cls];
+    avsize_t size = (cls + 1) * ARENA_ALIGN;
+    int i;
+
+    pthread_once(&arena_key_once, arena_init_key);
+    if(!arena_registered) {
+        /* makes arena_thread_exit() run when the thread exits */
+        pthread_setspecific(arena_key, &arena_registered);
+        arena_registered = 1;
+    }
+
+    AV_LOCK(ac->lock);
+    for(i = 0; i < ARENA_BATCH; i++) {
+        struct arena_free *af;
+
+        if(ac->freelist != NULL) {
+            af = ac->freelist;
+            ac->freelist = af->next;
+        }
+        else {
+            if(ac->slabfree < size) {
+                ac->slab = malloc(ARENA_SLABSIZE);
+                if(ac->slab == NULL)
+                    out_of_memory();
+                ac->slabfree = ARENA_SLABSIZE;
+            }
+            af = (struct arena_free *) ac->slab;
+            ac->slab += size;
+            ac->slabfree -= size;
+        }
+        af->next = arena_local[cls];
+        arena_local[cls] = af;
+        arena_localctr[cls]++;
+    }
+    AV_UNLOCK(ac->lock);
+}
+
+void *av_calloc_fixed(avsize_t nbyte)
+{
+    int cls;
+    struct arena_free *af;
+
+    if(nbyte == 0 || nbyte > ARENA_MAXSIZE)
+        return av_calloc(nbyte);
+
+    cls = (nbyte - 1) / ARENA_ALIGN;
+    if(arena_local[cls] == NULL)
+        arena_refill(cls);
+
+    af = arena_local[cls];
+    arena_local[cls] = af->next;
+    arena_localctr[cls]--;
+
+    MALLOCTR_ADD(1);
+    memset(af, 0, nbyte);
+
+    return af;
+}
+
+void av_free_fixed(void *ptr, avsize_t nbyte)
+{
+    int cls;
+    struct arena_free *af = ptr;
+
+    if(nbyte == 0 || nbyte > ARENA_MAXSIZE) {
+        av_free(ptr);
+        return;
+    }
+    if(ptr == NULL)
+        return;
+
+    MALLOCTR_ADD(-1);
+
+    cls = (nbyte - 1) / ARENA_ALIGN;
+    af->next = arena_local[cls];
+    arena_local[cls] = af;
+    arena_localctr[cls]++;
+
+    if(arena_localctr[cls] > ARENA_LOCALMAX)
+        arena_release(cls, ARENA_BATCH);
+}
+
+#else /* USE_ARENA_ALLOC */
+
+void *av_calloc_fixed(avsize_t nbyte)
+{
+    return av_calloc(nbyte);
+}
+
+void av_free_fixed(void *ptr, avsize_t nbyte)
+{
+    av_free(ptr);
+}
+
+#endif /* USE_ARENA_ALLOC */
 #endif
@@ -316,7 +316,6 @@ static void arch_do_close(struct archfile *fil, int realopen)
     av_unref_obj(fil->arch);
     av_unref_obj(fil->nod);
     av_unref_obj(fil->ent);
-    av_unref_obj(fil->curr);
     av_free(fil);
 }
 
@@ -367,9 +366,6 @@ static int arch_do_open(ventry *ve, int flags, avmode_t mode, void **resp)
     else
         fil->ent = NULL;
 
-    fil->curr = NULL;
-    fil->currn = -1;
-
     av_ref_obj(fil->arch);
     av_ref_obj(fil->nod);
     av_ref_obj(fil->ent);
@@ -445,19 +441,20 @@ avssize_t av_arch_read(vfile *vf, char *buf, avsize_t nbyte)
     return res;
 }
 
+/* The archive lock is not held during the read, so members of the
+   same archive can be read concurrently.  The open file keeps the
+   node and the base file referenced, and the node type does not
+   change after parsing. */
 static avssize_t arch_read(vfile *vf, char *buf, avsize_t nbyte)
 {
     avssize_t res;
     struct archfile *fil = arch_vfile_file(vf);
-    struct archive *arch = fil->arch;
     struct archparams *ap = (struct archparams *) vf->mnt->avfs->data;
     
-    AV_LOCK(arch->lock);
     if(AV_ISDIR(fil->nod->st.mode))
 	res = -EISDIR;
     else
 	res =  ap->read(vf, buf, nbyte);
-    AV_UNLOCK(arch->lock);
 
     return res;
 }
@@ -496,21 +493,13 @@ static struct archnode *arch_nth_entry(int n, struct archfile *fil,
     if(n  < 2)
         return arch_special_entry(n, fil->ent, namep);
     
-    n -= 2;
-    if(n == 0 || fil->currn != n - 1)
-	ent = av_namespace_nth(NULL, fil->ent, n);
-    else
-	ent = av_namespace_next(fil->curr);
-
-    av_unref_obj(fil->curr);
-    fil->curr = ent;
-    fil->currn = n;
-
+    ent = av_namespace_nth(NULL, fil->ent, n - 2);
     if(ent == NULL)
         return NULL;
 
     *namep = av_namespace_name(ent);
     nod = (struct archnode *) av_namespace_get(ent);
+    av_unref_obj(ent);
 
     return nod;
 }
@@ -12,6 +12,7 @@ static void archnode_destroy(struct archnode *nod)
 {
     av_free(nod->linkname);
     av_unref_obj(nod->data);
+    AV_FREELOCK(nod->lock);
 }
 
 struct archnode *av_arch_new_node(struct archive *arch, struct entry *ent,
@@ -34,6 +35,7 @@ struct archnode *av_arch_new_node(struct archive *arch, struct entry *ent,
     nod->data = NULL;
     nod->flags = 0;
     nod->numopen = 0;
+    AV_INITLOCK(nod->lock);
 
     /* FIXME: This scheme will allocate the same device to a tar file
        inside a tarfile. While this is not fatal, 'find -xdev' would not do
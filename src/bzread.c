@@ -11,25 +11,21 @@
 #include "bzlib.h"
 #include "oper.h"
 #include "exit.h"
+#include "seekindex.h"
+#include "streamcache.h"
+#include "pagecache.h"
 
 #include <stdlib.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 
 
 #define INBUFSIZE 16384
 #define OUTBUFSIZE 32768
 
-struct bzstreamcache {
-    int id;
-    bz_stream *s;
-};
-
-/* FIXME: the streamcache should be cleaned up after a short timeout
-   because it uses a LOT of memory */
-
-static struct bzstreamcache bzscache;
-static int bzread_nextid;
-static AV_LOCK_DECL(bzread_lock);
+/* Memory used by a decompressor of the largest block size */
+#define BZPARKED_MEMSIZE (9 * 100000 * 4 + 65536)
 
 struct bzindex {
     avoff_t offset;          /* The number of output bytes */
@@ -41,11 +37,19 @@ struct bzindex {
 
 struct bzcache {
     int id;
+    avmutex lock;            /* protects the fields below */
     avoff_t size;
-    unsigned int numindex;
-    struct bzindex *indexes;
+    struct seekindex indexes;
+
+    /* Block boundaries found by scanning, the last one is the end of
+       the stream.  Not verified until the blocks are decoded. */
+    int scanstate;
+    unsigned int numscan;
+    avoff_t *scanbits;
 };
 
+struct bzra;
+
 struct bzfile {
     bz_stream *s;
     int iseof;
@@ -53,6 +57,8 @@ struct bzfile {
     int id; /* The id of the last used bzcache */
     
     vfile *infile;
+    struct bzra *ra;
+    int noparallel;
     char inbuf[INBUFSIZE];
 };
 
@@ -102,43 +108,26 @@ static int bz_new_stream(bz_stream **resp)
     return 0;
 }
 
-static void bzfile_scache_delete()
+static void bzparked_release(void *stream)
 {
-    AV_LOCK(bzread_lock);
-    if(bzscache.id != 0) {
-        bz_delete_stream(bzscache.s);
-        bzscache.id = 0;
-    }
-    AV_UNLOCK(bzread_lock);
+    bz_delete_stream((bz_stream *) stream);
 }
 
-static void bzfile_scache_save(int id, bz_stream *s)
+/* Give the stream of fil to the streamcache */
+static void bzfile_park(struct bzfile *fil)
 {
-    static int regdestroy = 0;
-    if(!regdestroy) {
-        regdestroy = 1;
-        av_add_exithandler(bzfile_scache_delete);
-    }
-
-    if(id == 0 || s == NULL) {
-        bz_delete_stream(s);
-        return;
-    }
-    
-    if(bzscache.id != 0)
-        bz_delete_stream(bzscache.s);
-
-    bzscache.id = id;
-    bzscache.s = s;
+    if(fil->id == 0 || fil->s == NULL || fil->iseof || fil->iserror)
+        bz_delete_stream(fil->s);
+    else
+        av_streamcache_put(fil->id, bz_total_out(fil->s), fil->s,
+                           BZPARKED_MEMSIZE, bzparked_release);
+    fil->s = NULL;
 }
 
 static int bzfile_reset(struct bzfile *fil)
 {
     /* FIXME: Is it a good idea to save the previous state or not? */
-    if (fil->iseof || fil->iserror)
-        bz_delete_stream(fil->s);
-    else
-        bzfile_scache_save(fil->id, fil->s);
+    bzfile_park(fil);
 
     fil->iseof = 0;
     fil->iserror = 0;
@@ -146,16 +135,31 @@ static int bzfile_reset(struct bzfile *fil)
 }
 
 #ifndef USE_SYSTEM_BZLIB
+/* Make bzlib continue at a block boundary: the stream header is
+   followed by the bits of the block which start in the previous byte,
+   the rest of the bits of that byte are given to BZ2_bzRestoreBlockEnd */
+static void bz_restore_header(char *buf, unsigned int bitsrem,
+                              unsigned int startbits, unsigned int blocksize)
+{
+    unsigned int val;
+
+    val = ('B' << 24) + ('Z' << 16) + ('h' << 8) + (blocksize + '0');
+    val <<= bitsrem;
+    val += startbits;
+
+    buf[0] = (val >> 24) & 0xFF;
+    buf[1] = (val >> 16) & 0xFF;
+    buf[2] = (val >> 8) & 0xFF;
+    buf[3] = val & 0xFF;
+}
+
 static int bzfile_seek_index(struct bzfile *fil, struct bzindex *zi)
 {
     int res;
     unsigned int bitsrem;
     avoff_t total_in;
-    unsigned int val;
     
-    /* FIXME: Is it a good idea to save the previous state or not? */
-    bzfile_scache_save(fil->id, fil->s);
-    res = bz_new_stream(&fil->s);
+    res = bzfile_reset(fil);
     if(res < 0)
         return res;
 
@@ -171,14 +175,7 @@ static int bzfile_seek_index(struct bzfile *fil, struct bzindex *zi)
     fil->s->total_out_lo32 = zi->offset & 0xFFFFFFFF;
     fil->s->total_out_hi32 = (zi->offset >> 32) & 0xFFFFFFFF;
     
-    val = ('B' << 24) + ('Z' << 16) + ('h' << 8) + (zi->blocksize + '0');
-    val <<= bitsrem;
-    val += zi->startbits;
-
-    fil->inbuf[0] = (val >> 24) & 0xFF;
-    fil->inbuf[1] = (val >> 16) & 0xFF;
-    fil->inbuf[2] = (val >> 8) & 0xFF;
-    fil->inbuf[3] = val & 0xFF;
+    bz_restore_header(fil->inbuf, bitsrem, zi->startbits, zi->blocksize);
 
     av_log(AVLOG_DEBUG, "BZFILE: restore: %lli %lli/%i %08x %i",
            bz_total_out(fil->s), bz_total_in(fil->s), bitsrem,
@@ -191,16 +188,7 @@ static int bzfile_seek_index(struct bzfile *fil, struct bzindex *zi)
 
 static struct bzindex *bzcache_find_index(struct bzcache *zc, avoff_t offset)
 {
-    unsigned int i;
-
-    for(i = 0; i < zc->numindex; i++) {
-        if(zc->indexes[i].offset > offset)
-            break;
-    }
-    if(i == 0)
-        return NULL;
-    
-    return &zc->indexes[i-1];
+    return (struct bzindex *) av_seekindex_find(&zc->indexes, offset);
 }
 #endif
 
@@ -220,33 +208,35 @@ static int bzfile_fill_inbuf(struct bzfile *fil)
 }
 
 #ifndef USE_SYSTEM_BZLIB
-static void bzfile_save_state(struct bzcache *zc, bz_stream *s,
-                              unsigned int bitsrem, unsigned int bits,
+static void bzcache_add_index(struct bzcache *zc, avoff_t offset,
+                              avoff_t inbits, unsigned int startbits,
                               unsigned int crc, unsigned int blocksize)
 {
     struct bzindex *zi;
-    avoff_t offset = bz_total_out(s);
-    int i;
-    
-    for(i = 0; i < zc->numindex; i++) {
-        if(zc->indexes[i].offset >= offset)
+
+    /* Only blocks past the last known one are recorded */
+    if(zc->indexes.num != 0) {
+        zi = av_seekindex_get(&zc->indexes, zc->indexes.num - 1);
+        if(zi->offset >= offset)
             return;
     }
 
-    zc->numindex ++;
-    zc->indexes = (struct bzindex *)
-        av_realloc(zc->indexes, sizeof(*zc->indexes) * zc->numindex);
-    
-    zi = &zc->indexes[i];
-    zi->offset = offset;
-    zi->inbits = (bz_total_in(s) << 3) - bitsrem;
-    zi->startbits = bits & ((1 << bitsrem) - 1);
+    zi = av_seekindex_add(&zc->indexes, offset);
+    zi->inbits = inbits;
+    zi->startbits = startbits;
     zi->crc = crc;
     zi->blocksize = blocksize;
 
-    av_log(AVLOG_DEBUG, "BZFILE: new block end: %lli %lli/%i %08x %i",
-           zi->offset, bz_total_in(s), bitsrem, zi->crc, zi->blocksize);
+    av_log(AVLOG_DEBUG, "BZFILE: new block end: %lli %lli %08x %i",
+           zi->offset, zi->inbits, zi->crc, zi->blocksize);
+}
 
+static void bzfile_save_state(struct bzcache *zc, bz_stream *s,
+                              unsigned int bitsrem, unsigned int bits,
+                              unsigned int crc, unsigned int blocksize)
+{
+    bzcache_add_index(zc, bz_total_out(s), (bz_total_in(s) << 3) - bitsrem,
+                      bits & ((1 << bitsrem) - 1), crc, blocksize);
 }
 
 static void bz_block_end(void *data, bz_stream *s, unsigned int bitsrem,
@@ -255,9 +245,9 @@ static void bz_block_end(void *data, bz_stream *s, unsigned int bitsrem,
 {
     struct bzcache *zc = (struct bzcache *) data;
 
-    AV_LOCK(bzread_lock);
+    AV_LOCK(zc->lock);
     bzfile_save_state(zc, s, bitsrem, bits, crc, blocksize);
-    AV_UNLOCK(bzread_lock);
+    AV_UNLOCK(zc->lock);
 }
 #endif
 
@@ -284,9 +274,9 @@ static int bzfile_decompress(struct bzfile *fil, struct bzcache *zc)
     res = BZ2_bzDecompress(fil->s);
     if(res == BZ_STREAM_END) {
         fil->iseof = 1;
-        AV_LOCK(bzread_lock);
+        AV_LOCK(zc->lock);
         zc->size = bz_total_out(fil->s);
-        AV_UNLOCK(bzread_lock);
+        AV_UNLOCK(zc->lock);
         return 0;
     }
     if(res != BZ_OK) {
@@ -342,9 +332,10 @@ static int bzfile_skip_to(struct bzfile *fil, struct bzcache *zc,
 static int bzfile_seek(struct bzfile *fil, struct bzcache *zc, avoff_t offset)
 {
     struct bzindex *zi;
+    bz_stream *parked;
     avoff_t curroff = bz_total_out(fil->s);
     avoff_t zcdist;
-    avoff_t scdist;
+    avoff_t parkedoff;
     avoff_t dist;
 
     if(offset >= curroff)
@@ -358,19 +349,18 @@ static int bzfile_seek(struct bzfile *fil, struct bzcache *zc, avoff_t offset)
     else
         zcdist = offset;
 
-    if(bzscache.id == zc->id) {
-        avoff_t scacheoff = bz_total_out(bzscache.s);
-
-        if(offset >= scacheoff) {
-            scdist = offset - scacheoff;
-            if((dist == -1 || scdist < dist) && scdist < zcdist) {
-                bz_stream *tmp = fil->s;
-                fil->s = bzscache.s;
-                fil->s->avail_in = 0;
-                bzscache.s = tmp;
-                return 0;
-            }
-        }
+    /* Use a parked stream if it is closer than both the current
+       position and the index */
+    parked = av_streamcache_get(zc->id, offset,
+                                dist == -1 || zcdist < dist ? zcdist : dist,
+                                &parkedoff);
+    if(parked != NULL) {
+        bzfile_park(fil);
+        fil->s = parked;
+        fil->s->avail_in = 0;
+        fil->iseof = 0;
+        fil->iserror = 0;
+        return 0;
     }
 
     if(dist == -1 || zcdist < dist) {
@@ -384,6 +374,815 @@ static int bzfile_seek(struct bzfile *fil, struct bzcache *zc, avoff_t offset)
 }
 #endif
 
+#ifndef USE_SYSTEM_BZLIB
+
+/* Parallel readahead
+
+   bzip2 blocks can be decoded independently, so a sequential read
+   looks for the block boundaries in the compressed data ahead of the
+   current position and hands the blocks to a pool of worker threads.
+   The decoded blocks are returned in order, bzlib checks the CRC of
+   each block and the combined CRC is checked at the end of the
+   stream.  The read starts from the bzcache index, which is extended
+   with the blocks decoded here. */
+
+#define BZ_BLOCK_MAGIC 0x314159265359ULL
+#define BZ_EOS_MAGIC   0x177245385090ULL
+#define BZ_MAGIC_MASK  0xFFFFFFFFFFFFULL
+
+#define BZRA_READSIZE (256 * 1024)
+#define BZRA_MAXBLOCK (4 * 1024 * 1024) /* compressed */
+#define BZRA_SCANSIZE (1024 * 1024)
+
+enum { BZRA_QUEUED, BZRA_DONE, BZRA_ERROR };
+
+struct bzrablock {
+    struct bzrablock *next;   /* in the readahead list */
+    struct bzrablock *jnext;  /* in the job queue */
+    int state;
+    int cancelled;
+
+    avoff_t startbits;
+    avoff_t endbits;
+    unsigned int blocksize;
+    char *in;
+    avsize_t inlen;
+
+    char *out;
+    avsize_t outlen;
+    avuint crc;               /* CRC of the block alone */
+};
+
+struct bzra {
+    int id;                   /* The id of the bzcache */
+    unsigned int blocksize;
+    avoff_t outoff;           /* Output offset at the start of head */
+    avuint crc;               /* Combined CRC up to outoff */
+    avoff_t nextbits;         /* Start of the next block to queue */
+    int eos;                  /* nextbits is the end of stream marker */
+    int window;
+    int numblocks;
+    avoff_t lastend;          /* End of the previous read */
+    struct bzrablock *head;
+    struct bzrablock *tail;
+
+    /* compressed data from bufoff */
+    unsigned char *buf;
+    avoff_t bufoff;
+    avsize_t buflen;
+    avsize_t bufsize;
+    int bufeof;
+};
+
+static AV_LOCK_DECL(bzpool_lock);
+static pthread_cond_t bzpool_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t bzpool_done = PTHREAD_COND_INITIALIZER;
+static struct bzrablock *bzpool_head;
+static struct bzrablock *bzpool_tail;
+static pthread_t *bzpool_threads;
+static int bzpool_numthreads;
+static int bzpool_stop;
+static int bzread_threads;
+
+static void bzrablock_destroy(struct bzrablock *b)
+{
+    av_free(b->in);
+    av_free(b->out);
+}
+
+struct bzradecode {
+    int ended;
+    avoff_t endbits;
+    avuint crc;
+};
+
+static void bzra_block_end(void *data, bz_stream *s, unsigned int bitsrem,
+                           unsigned int bits, unsigned int crc,
+                           unsigned int blocksize)
+{
+    struct bzradecode *dec = (struct bzradecode *) data;
+
+    if(!dec->ended) {
+        dec->ended = 1;
+        dec->endbits = (bz_total_in(s) << 3) - bitsrem;
+        /* started with a zero combined CRC, so this is the block CRC */
+        dec->crc = crc;
+    }
+}
+
+static int bzra_decode(struct bzrablock *b)
+{
+    int res;
+    bz_stream *s;
+    avoff_t total_in;
+    avsize_t outsize;
+    struct bzradecode dec;
+
+    res = bz_new_stream(&s);
+    if(res < 0)
+        return res;
+
+    total_in = ((b->startbits + 7) >> 3) - 4;
+    s->next_in = b->in;
+    s->avail_in = b->inlen;
+    s->total_in_lo32 = total_in & 0xFFFFFFFF;
+    s->total_in_hi32 = (total_in >> 32) & 0xFFFFFFFF;
+    BZ2_bzRestoreBlockEnd(s, ((b->startbits + 7) & ~7) - b->startbits, 0);
+
+    dec.ended = 0;
+    BZ2_bzSetBlockEndHandler(s, bzra_block_end, &dec);
+
+    outsize = b->blocksize * 100000;
+    b->out = av_malloc(outsize);
+    b->outlen = 0;
+    while(1) {
+        s->next_out = b->out + b->outlen;
+        s->avail_out = outsize - b->outlen;
+        res = BZ2_bzDecompress(s);
+        b->outlen = bz_total_out(s);
+        if(dec.ended || (res != BZ_OK && res != BZ_STREAM_END))
+            break;
+
+        /* runs of a byte can make the output larger than the block */
+        if(s->avail_out == 0) {
+            outsize *= 2;
+            b->out = av_realloc(b->out, outsize);
+        }
+        else if(s->avail_in == 0)
+            break;
+    }
+    bz_delete_stream(s);
+
+    /* The end must be where the next block was found, otherwise the
+       magic was found inside the compressed data */
+    if(!dec.ended || dec.endbits != b->endbits) {
+        av_log(AVLOG_DEBUG, "BZFILE: parallel decode failed at %lli: %i",
+               b->startbits, res);
+        return -EIO;
+    }
+
+    b->crc = dec.crc;
+    return 0;
+}
+
+static void *bzpool_worker(void *arg)
+{
+    struct bzrablock *b;
+    int res;
+
+    AV_LOCK(bzpool_lock);
+    while(!bzpool_stop) {
+        b = bzpool_head;
+        if(b == NULL) {
+            pthread_cond_wait(&bzpool_cond, &bzpool_lock);
+            continue;
+        }
+        bzpool_head = b->jnext;
+        if(bzpool_head == NULL)
+            bzpool_tail = NULL;
+
+        if(b->cancelled)
+            res = -ECANCELED;
+        else {
+            AV_UNLOCK(bzpool_lock);
+            res = bzra_decode(b);
+            AV_LOCK(bzpool_lock);
+        }
+        b->state = res < 0 ? BZRA_ERROR : BZRA_DONE;
+        pthread_cond_broadcast(&bzpool_done);
+
+        AV_UNLOCK(bzpool_lock);
+        av_unref_obj(b);
+        AV_LOCK(bzpool_lock);
+    }
+    AV_UNLOCK(bzpool_lock);
+
+    return NULL;
+}
+
+static void bzpool_shutdown()
+{
+    int i;
+    struct bzrablock *b;
+
+    AV_LOCK(bzpool_lock);
+    bzpool_stop = 1;
+    pthread_cond_broadcast(&bzpool_cond);
+    AV_UNLOCK(bzpool_lock);
+
+    for(i = 0; i < bzpool_numthreads; i++)
+        pthread_join(bzpool_threads[i], NULL);
+
+    while((b = bzpool_head) != NULL) {
+        bzpool_head = b->jnext;
+        av_unref_obj(b);
+    }
+    bzpool_tail = NULL;
+    av_free(bzpool_threads);
+    bzpool_threads = NULL;
+    bzpool_numthreads = 0;
+    bzpool_stop = 0;
+}
+
+/* Called with bzpool_lock held */
+static int bzpool_start(int numthreads)
+{
+    if(bzpool_threads == NULL)
+        av_add_exithandler(bzpool_shutdown);
+
+    if(bzpool_numthreads >= numthreads)
+        return bzpool_numthreads;
+
+    bzpool_threads = av_realloc(bzpool_threads,
+                                sizeof(*bzpool_threads) * numthreads);
+    while(bzpool_numthreads < numthreads) {
+        if(pthread_create(&bzpool_threads[bzpool_numthreads], NULL,
+                          bzpool_worker, NULL) != 0) {
+            av_log(AVLOG_ERROR, "BZFILE: could not start decoder thread");
+            break;
+        }
+        bzpool_numthreads++;
+    }
+
+    return bzpool_numthreads;
+}
+
+/* Make sure the compressed data from byte 'off' up to 'end' is in the
+   buffer, returns the end of the available data */
+static avssize_t bzra_fill(struct bzfile *fil, struct bzra *ra, avoff_t off,
+                           avoff_t end)
+{
+    avssize_t res;
+
+    if(off < ra->bufoff || off > ra->bufoff + ra->buflen) {
+        ra->bufoff = off;
+        ra->buflen = 0;
+        ra->bufeof = 0;
+    }
+    else if(off - ra->bufoff > ra->bufsize / 2) {
+        /* drop data before the block that is searched */
+        avsize_t skip = off - ra->bufoff;
+
+        memmove(ra->buf, ra->buf + skip, ra->buflen - skip);
+        ra->bufoff += skip;
+        ra->buflen -= skip;
+    }
+
+    while(ra->bufoff + ra->buflen < end && !ra->bufeof) {
+        if(ra->buflen + BZRA_READSIZE > ra->bufsize) {
+            ra->bufsize = ra->buflen + BZRA_READSIZE;
+            ra->buf = av_realloc(ra->buf, ra->bufsize);
+        }
+        res = av_pread(fil->infile, (char *) ra->buf + ra->buflen,
+                       BZRA_READSIZE, ra->bufoff + ra->buflen);
+        if(res < 0)
+            return res;
+        if(res == 0)
+            ra->bufeof = 1;
+
+        ra->buflen += res;
+    }
+
+    return ra->bufoff + ra->buflen;
+}
+
+/* Every byte alignment of the two magics determines the second and third
+   byte of the 7 bytes it spans, this table gives the alignments for
+   those two bytes: bit k is the block magic starting k bits into the
+   first byte, bit k + 8 the end of stream magic. */
+static unsigned short bz_scantab[65536];
+static pthread_once_t bz_scantab_once = PTHREAD_ONCE_INIT;
+
+static void bz_scantab_init()
+{
+    int k;
+
+    for(k = 0; k < 8; k++) {
+        unsigned long long blk = BZ_BLOCK_MAGIC << (8 - k);
+        unsigned long long eos = BZ_EOS_MAGIC << (8 - k);
+
+        bz_scantab[(blk >> 32) & 0xFFFF] |= 1 << k;
+        bz_scantab[(eos >> 32) & 0xFFFF] |= 1 << (k + 8);
+    }
+}
+
+/* Look for a magic starting in buf[i] for i in [start, end), needs 7
+   bytes at each position.  Returns the bit offset from the start of
+   buf, or -1 */
+static avoff_t bz_scan(const unsigned char *buf, avsize_t start, avsize_t end,
+                       int *iseosp)
+{
+    avsize_t i;
+    int k;
+
+    for(i = start; i < end; i++) {
+        unsigned int m = bz_scantab[(buf[i + 1] << 8) | buf[i + 2]];
+        unsigned long long w;
+
+        if(m == 0)
+            continue;
+
+        w = ((unsigned long long) buf[i] << 48) |
+            ((unsigned long long) buf[i + 1] << 40) |
+            ((unsigned long long) buf[i + 2] << 32) |
+            ((unsigned long long) buf[i + 3] << 24) |
+            ((unsigned long long) buf[i + 4] << 16) |
+            ((unsigned long long) buf[i + 5] << 8) | buf[i + 6];
+
+        for(k = 0; k < 8; k++) {
+            unsigned long long val = (w >> (8 - k)) & BZ_MAGIC_MASK;
+
+            if((m & (1 << k)) != 0 && val == BZ_BLOCK_MAGIC) {
+                *iseosp = 0;
+                return ((avoff_t) i << 3) + k;
+            }
+            if((m & (1 << (k + 8))) != 0 && val == BZ_EOS_MAGIC) {
+                *iseosp = 1;
+                return ((avoff_t) i << 3) + k;
+            }
+        }
+    }
+
+    return -1;
+}
+
+/* Find the first block or end of stream magic starting at or after the
+   bit offset 'from'.  The data from byte 'keep' stays in the buffer. */
+static int bzra_find_marker(struct bzfile *fil, struct bzra *ra, avoff_t keep,
+                            avoff_t from, avoff_t *posp, int *iseosp)
+{
+    avssize_t res;
+    avoff_t i = from >> 3;
+    avoff_t end = i;
+    avoff_t limit = i + BZRA_MAXBLOCK;
+    avoff_t pos;
+
+    pthread_once(&bz_scantab_once, bz_scantab_init);
+
+    while(i < limit) {
+        res = bzra_fill(fil, ra, keep, end + BZRA_READSIZE);
+        if(res < 0)
+            return res;
+        if(res - 6 <= end)
+            break;
+        end = res - 6;
+
+        pos = bz_scan(ra->buf, i - ra->bufoff, end - ra->bufoff, iseosp);
+        /* a magic may start earlier in the first byte */
+        if(pos != -1 && pos + (ra->bufoff << 3) < from)
+            pos = bz_scan(ra->buf, i + 1 - ra->bufoff, end - ra->bufoff,
+                          iseosp);
+        if(pos != -1) {
+            *posp = pos + (ra->bufoff << 3);
+            return 0;
+        }
+        i = end;
+    }
+
+    av_log(AVLOG_ERROR, "BZFILE: no block found after %lli", from);
+    return -EIO;
+}
+
+/* Find the block boundaries from 'startbits' to the end of the stream
+   with one pass over the compressed file */
+static void bzcache_scan(struct bzfile *fil, struct bzcache *zc,
+                         avoff_t startbits)
+{
+    avssize_t res;
+    unsigned char *buf;
+    avoff_t bufoff = startbits >> 3;
+    avsize_t buflen = 0;
+    avoff_t *scanbits = NULL;
+    unsigned int numscan = 0;
+    avoff_t pos;
+    avsize_t i = 0;
+    int iseos = 0;
+
+    pthread_once(&bz_scantab_once, bz_scantab_init);
+
+    buf = av_malloc(BZRA_SCANSIZE + 7);
+    while(!iseos) {
+        res = av_pread(fil->infile, (char *) buf + buflen,
+                       BZRA_SCANSIZE + 7 - buflen, bufoff + buflen);
+        if(res <= 0)
+            break;
+        buflen += res;
+        if(buflen < 7)
+            continue;
+
+        while(!iseos &&
+              (pos = bz_scan(buf, i, buflen - 6, &iseos)) != -1) {
+            pos += bufoff << 3;
+            if(pos >= startbits) {
+                if(numscan % 1024 == 0)
+                    scanbits = av_realloc(scanbits, sizeof(*scanbits) *
+                                          (numscan + 1024));
+                scanbits[numscan++] = pos;
+            }
+            else
+                iseos = 0;
+            i = (pos >> 3) - bufoff + 1;
+        }
+
+        /* keep the last bytes, a magic may start there */
+        memmove(buf, buf + buflen - 6, 6);
+        bufoff += buflen - 6;
+        buflen = 6;
+        i = 0;
+    }
+    av_free(buf);
+
+    AV_LOCK(zc->lock);
+    if(zc->scanstate == 0 && iseos && numscan != 0 &&
+       scanbits[0] == startbits) {
+        zc->scanstate = 1;
+        zc->numscan = numscan;
+        zc->scanbits = scanbits;
+        scanbits = NULL;
+
+        av_log(AVLOG_DEBUG, "BZFILE: found %u blocks", numscan - 1);
+    }
+    else if(zc->scanstate == 0)
+        zc->scanstate = -1;
+    AV_UNLOCK(zc->lock);
+
+    av_free(scanbits);
+}
+
+/* The next boundary after 'bits' from the scan, if there is one */
+static int bzcache_scan_next(struct bzcache *zc, avoff_t bits,
+                             avoff_t *nextp, int *iseosp)
+{
+    unsigned int lo = 0;
+    unsigned int hi;
+    int found = 0;
+
+    AV_LOCK(zc->lock);
+    if(zc->scanstate == 1 && bits >= zc->scanbits[0]) {
+        hi = zc->numscan;
+        while(lo < hi) {
+            unsigned int mid = (lo + hi) / 2;
+
+            if(zc->scanbits[mid] <= bits)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if(lo < zc->numscan) {
+            *nextp = zc->scanbits[lo];
+            *iseosp = (lo == zc->numscan - 1);
+            found = 1;
+        }
+    }
+    AV_UNLOCK(zc->lock);
+
+    return found;
+}
+
+static int bzra_queue_block(struct bzfile *fil, struct bzcache *zc,
+                            struct bzra *ra)
+{
+    int res;
+    int iseos;
+    avoff_t endbits;
+    avoff_t start;
+    avoff_t end;
+    unsigned int bitsrem;
+    struct bzrablock *b;
+
+    /* the block ends where the next marker starts */
+    if(bzcache_scan_next(zc, ra->nextbits, &endbits, &iseos)) {
+        res = bzra_fill(fil, ra, ra->nextbits >> 3, (endbits + 7) >> 3);
+        if(res >= 0 && res < (endbits + 7) >> 3)
+            res = -EIO;
+    }
+    else
+        res = bzra_find_marker(fil, ra, ra->nextbits >> 3, ra->nextbits + 48,
+                               &endbits, &iseos);
+    if(res < 0)
+        return res;
+
+    start = (ra->nextbits + 7) >> 3;
+    end = (endbits + 7) >> 3;
+    bitsrem = (start << 3) - ra->nextbits;
+
+    AV_NEW_OBJ(b, bzrablock_destroy);
+    b->next = NULL;
+    b->jnext = NULL;
+    b->state = BZRA_QUEUED;
+    b->cancelled = 0;
+    b->startbits = ra->nextbits;
+    b->endbits = endbits;
+    b->blocksize = ra->blocksize;
+    b->inlen = 4 + end - start;
+    b->in = av_malloc(b->inlen);
+    b->out = NULL;
+    b->outlen = 0;
+    bz_restore_header(b->in, bitsrem,
+                      ra->buf[(ra->nextbits >> 3) - ra->bufoff] &
+                      ((1 << bitsrem) - 1), ra->blocksize);
+    memcpy(b->in + 4, ra->buf + (start - ra->bufoff), end - start);
+
+    if(ra->tail == NULL)
+        ra->head = b;
+    else
+        ra->tail->next = b;
+    ra->tail = b;
+    ra->numblocks++;
+    ra->nextbits = endbits;
+    ra->eos = iseos;
+
+    av_ref_obj(b);
+    AV_LOCK(bzpool_lock);
+    if(bzpool_tail == NULL)
+        bzpool_head = b;
+    else
+        bzpool_tail->jnext = b;
+    bzpool_tail = b;
+    pthread_cond_signal(&bzpool_cond);
+    AV_UNLOCK(bzpool_lock);
+
+    return 0;
+}
+
+static void bzra_clear(struct bzra *ra)
+{
+    struct bzrablock *b;
+
+    AV_LOCK(bzpool_lock);
+    for(b = ra->head; b != NULL; b = b->next)
+        b->cancelled = 1;
+    AV_UNLOCK(bzpool_lock);
+
+    while((b = ra->head) != NULL) {
+        ra->head = b->next;
+        av_unref_obj(b);
+    }
+    ra->tail = NULL;
+    ra->numblocks = 0;
+}
+
+static void bzra_free(struct bzra *ra)
+{
+    if(ra != NULL) {
+        bzra_clear(ra);
+        av_free(ra->buf);
+        av_free(ra);
+    }
+}
+
+/* Start the readahead at the last block boundary before 'offset' */
+static int bzra_start(struct bzfile *fil, struct bzcache *zc, avoff_t offset)
+{
+    avssize_t res;
+    struct bzra *ra = fil->ra;
+    struct bzindex *zi;
+    int iseos;
+    avoff_t pos;
+
+    bzra_clear(ra);
+    ra->id = zc->id;
+    ra->window = 1;
+
+    AV_LOCK(zc->lock);
+    zi = bzcache_find_index(zc, offset);
+    if(zi != NULL) {
+        ra->outoff = zi->offset;
+        ra->nextbits = zi->inbits;
+        ra->crc = zi->crc;
+        ra->blocksize = zi->blocksize;
+    }
+    AV_UNLOCK(zc->lock);
+
+    if(zi == NULL) {
+        res = bzra_fill(fil, ra, 0, 4);
+        if(res < 0)
+            return res;
+        if(res < 4 || ra->buf[0] != 'B' || ra->buf[1] != 'Z' ||
+           ra->buf[2] != 'h' || ra->buf[3] < '1' || ra->buf[3] > '9')
+            return -EIO;
+
+        ra->outoff = 0;
+        ra->nextbits = 32;
+        ra->crc = 0;
+        ra->blocksize = ra->buf[3] - '0';
+    }
+
+    res = bzra_find_marker(fil, ra, ra->nextbits >> 3, ra->nextbits, &pos,
+                           &iseos);
+    if(res < 0)
+        return res;
+    if(pos != ra->nextbits)
+        return -EIO;
+
+    ra->eos = iseos;
+    return 0;
+}
+
+static int bzra_finish(struct bzfile *fil, struct bzcache *zc,
+                       struct bzra *ra)
+{
+    avssize_t res;
+    avoff_t off = (ra->nextbits + 48) >> 3;
+    unsigned int shift = (ra->nextbits + 48) & 7;
+    unsigned long long w = 0;
+    avuint crc;
+    int i;
+
+    res = bzra_fill(fil, ra, off, off + 5);
+    if(res < off + 5)
+        return res < 0 ? res : -EIO;
+
+    for(i = 0; i < 5; i++)
+        w = (w << 8) | ra->buf[off + i - ra->bufoff];
+    crc = (w >> (8 - shift)) & 0xFFFFFFFF;
+
+    if(crc != ra->crc) {
+        av_log(AVLOG_ERROR, "BZFILE: combined CRC mismatch");
+        return -EIO;
+    }
+
+    AV_LOCK(zc->lock);
+    zc->size = ra->outoff;
+    AV_UNLOCK(zc->lock);
+
+    return 0;
+}
+
+/* Called when the head block is consumed */
+static void bzra_next(struct bzcache *zc, struct bzra *ra)
+{
+    struct bzrablock *b = ra->head;
+    unsigned int bitsrem = ((b->endbits + 7) & ~7) - b->endbits;
+    
+    ra->outoff += b->outlen;
+    ra->crc = ((ra->crc << 1) | (ra->crc >> 31)) ^ b->crc;
+
+    AV_LOCK(zc->lock);
+    bzcache_add_index(zc, ra->outoff, b->endbits,
+                      b->in[b->inlen - 1] & ((1 << bitsrem) - 1),
+                      ra->crc, b->blocksize);
+    AV_UNLOCK(zc->lock);
+
+    ra->head = b->next;
+    if(ra->head == NULL)
+        ra->tail = NULL;
+    ra->numblocks--;
+    av_unref_obj(b);
+}
+
+static avssize_t bzra_pread(struct bzfile *fil, struct bzcache *zc,
+                            char *buf, avsize_t nbyte, avoff_t offset,
+                            int numthreads)
+{
+    int res;
+    struct bzra *ra = fil->ra;
+    struct bzrablock *b;
+    avsize_t nact = 0;
+    int restart = 0;
+    avoff_t known;
+
+    if(ra == NULL) {
+        AV_NEW(ra);
+        memset(ra, 0, sizeof(*ra));
+        fil->ra = ra;
+        restart = 1;
+    }
+    else if(ra->id != zc->id || offset < ra->outoff)
+        restart = 1;
+    else {
+        struct bzindex *zi;
+
+        known = ra->outoff;
+        AV_LOCK(bzpool_lock);
+        for(b = ra->head; b != NULL && b->state == BZRA_DONE; b = b->next)
+            known += b->outlen;
+        AV_UNLOCK(bzpool_lock);
+
+        /* jump ahead if the index has a closer block */
+        AV_LOCK(zc->lock);
+        zi = bzcache_find_index(zc, offset);
+        if(zi != NULL && zi->offset > known)
+            restart = 1;
+        AV_UNLOCK(zc->lock);
+    }
+    if(restart) {
+        res = bzra_start(fil, zc, offset);
+        if(res < 0)
+            return res;
+        known = ra->outoff;
+    }
+
+    /* A seek past the decoded data: with the block boundaries of the
+       whole stream the blocks up to the offset can be decoded at once,
+       instead of finding them one by one.  Blocks usually decode to
+       about their nominal size. */
+    if((restart || offset != ra->lastend) && !ra->eos &&
+       offset >= known + ra->blocksize * 100000) {
+        int scanstate;
+        avoff_t needed = (offset - known) / (ra->blocksize * 100000) + 1;
+
+        AV_LOCK(zc->lock);
+        scanstate = zc->scanstate;
+        AV_UNLOCK(zc->lock);
+        if(scanstate == 0)
+            bzcache_scan(fil, zc, ra->nextbits);
+
+        if(needed > ra->window)
+            ra->window = AV_MIN(needed, numthreads * 2);
+    }
+
+    AV_LOCK(bzpool_lock);
+    res = bzpool_start(numthreads);
+    AV_UNLOCK(bzpool_lock);
+    if(res == 0)
+        return -EIO;
+
+    while(nact < nbyte) {
+        avsize_t n;
+
+        while(!ra->eos && ra->numblocks < ra->window) {
+            res = bzra_queue_block(fil, zc, ra);
+            if(res < 0)
+                return res;
+        }
+
+        b = ra->head;
+        if(b == NULL) {
+            res = bzra_finish(fil, zc, ra);
+            if(res < 0)
+                return res;
+            break;
+        }
+
+        AV_LOCK(bzpool_lock);
+        while(b->state == BZRA_QUEUED)
+            pthread_cond_wait(&bzpool_done, &bzpool_lock);
+        AV_UNLOCK(bzpool_lock);
+
+        if(b->state == BZRA_ERROR) {
+            /* maybe a false boundary, don't use the scan again */
+            AV_LOCK(zc->lock);
+            if(zc->scanstate == 1)
+                zc->scanstate = -1;
+            AV_UNLOCK(zc->lock);
+            return -EIO;
+        }
+
+        if(offset >= ra->outoff + b->outlen) {
+            bzra_next(zc, ra);
+            /* a sequential reader gets more blocks decoded ahead */
+            ra->window = AV_MIN(ra->window * 2, numthreads * 2);
+            continue;
+        }
+
+        n = AV_MIN(nbyte - nact, ra->outoff + b->outlen - offset);
+        memcpy(buf + nact, b->out + (offset - ra->outoff), n);
+        nact += n;
+        offset += n;
+    }
+    ra->lastend = offset;
+
+    return nact;
+}
+
+void av_bzfile_set_threads(int numthreads)
+{
+    long numcpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    /* more decoders than processors only thrash the cache */
+    if(numcpus > 0 && numthreads > numcpus)
+        numthreads = numcpus;
+
+    AV_LOCK(bzpool_lock);
+    bzread_threads = numthreads;
+    AV_UNLOCK(bzpool_lock);
+}
+
+int av_bzfile_get_threads()
+{
+    int numthreads;
+
+    AV_LOCK(bzpool_lock);
+    numthreads = bzread_threads;
+    AV_UNLOCK(bzpool_lock);
+
+    return numthreads;
+}
+
+#else /* USE_SYSTEM_BZLIB */
+
+void av_bzfile_set_threads(int numthreads)
+{
+}
+
+int av_bzfile_get_threads()
+{
+    return 0;
+}
+
+#endif /* USE_SYSTEM_BZLIB */
+
 static avssize_t av_bzfile_do_pread(struct bzfile *fil, struct bzcache *zc,
                                    char *buf, avsize_t nbyte, avoff_t offset)
 {
@@ -394,7 +1193,7 @@ static avssize_t av_bzfile_do_pread(struct bzfile *fil, struct bzcache *zc,
 
     curroff = bz_total_out(fil->s);
     if(offset != curroff) {
-        AV_LOCK(bzread_lock);
+        AV_LOCK(zc->lock);
 #ifndef USE_SYSTEM_BZLIB
         res = bzfile_seek(fil, zc, offset);
 #else
@@ -404,7 +1203,7 @@ static avssize_t av_bzfile_do_pread(struct bzfile *fil, struct bzcache *zc,
             res = 0;
         }
 #endif
-        AV_UNLOCK(bzread_lock);
+        AV_UNLOCK(zc->lock);
         if(res < 0)
             return res;
 
@@ -418,14 +1217,31 @@ static avssize_t av_bzfile_do_pread(struct bzfile *fil, struct bzcache *zc,
     return res;
 }
 
-avssize_t av_bzfile_pread(struct bzfile *fil, struct bzcache *zc, char *buf,
-                         avsize_t nbyte, avoff_t offset)
+static avssize_t bzfile_pread(struct bzfile *fil, struct bzcache *zc, char *buf,
+                              avsize_t nbyte, avoff_t offset)
 {
     avssize_t res;
 
     if(fil->iserror)
         return -EIO;
 
+#ifndef USE_SYSTEM_BZLIB
+    if(!fil->noparallel) {
+        int numthreads = av_bzfile_get_threads();
+
+        if(numthreads > 1) {
+            res = bzra_pread(fil, zc, buf, nbyte, offset, numthreads);
+            if(res >= 0)
+                return res;
+
+            /* the normal decoder will tell what's wrong */
+            bzra_free(fil->ra);
+            fil->ra = NULL;
+            fil->noparallel = 1;
+        }
+    }
+#endif
+
     res = av_bzfile_do_pread(fil, zc, buf, nbyte, offset);
     if(res < 0)
         fil->iserror = 1;
@@ -433,14 +1249,28 @@ avssize_t av_bzfile_pread(struct bzfile *fil, struct bzcache *zc, char *buf,
     return res;
 }
 
+static avssize_t bzfile_page_read(void *fil, void *zc, char *buf,
+                                  avsize_t nbyte, avoff_t offset)
+{
+    return bzfile_pread((struct bzfile *) fil, (struct bzcache *) zc,
+                        buf, nbyte, offset);
+}
+
+avssize_t av_bzfile_pread(struct bzfile *fil, struct bzcache *zc, char *buf,
+                          avsize_t nbyte, avoff_t offset)
+{
+    return av_pagecache_pread(zc->id, bzfile_page_read, fil, zc, buf, nbyte,
+                              offset);
+}
+
 int av_bzfile_size(struct bzfile *fil, struct bzcache *zc, avoff_t *sizep)
 {
     int res;
     avoff_t size;
 
-    AV_LOCK(bzread_lock);
+    AV_LOCK(zc->lock);
     size = zc->size;
-    AV_UNLOCK(bzread_lock);
+    AV_UNLOCK(zc->lock);
 
     if(size != -1 || fil == NULL) {
         *sizep = size;
@@ -449,13 +1279,13 @@ int av_bzfile_size(struct bzfile *fil, struct bzcache *zc, avoff_t *sizep)
 
     fil->id = zc->id;
 
-    AV_LOCK(bzread_lock);
+    AV_LOCK(zc->lock);
 #ifndef USE_SYSTEM_BZLIB
     res = bzfile_seek(fil, zc, AV_MAXOFF);
 #else
     res = bzfile_reset( fil );
 #endif
-    AV_UNLOCK(bzread_lock);
+    AV_UNLOCK(zc->lock);
     if(res < 0)
         return res;
 
@@ -463,9 +1293,9 @@ int av_bzfile_size(struct bzfile *fil, struct bzcache *zc, avoff_t *sizep)
     if(res < 0)
         return res;
     
-    AV_LOCK(bzread_lock);
+    AV_LOCK(zc->lock);
     size = zc->size;
-    AV_UNLOCK(bzread_lock);
+    AV_UNLOCK(zc->lock);
     
     if(size == -1) {
         av_log(AVLOG_ERROR, "BZFILE: Internal error: could not find size");
@@ -478,9 +1308,10 @@ int av_bzfile_size(struct bzfile *fil, struct bzcache *zc, avoff_t *sizep)
 
 static void bzfile_destroy(struct bzfile *fil)
 {
-    AV_LOCK(bzread_lock);
-    bzfile_scache_save(fil->id, fil->s);
-    AV_UNLOCK(bzread_lock);
+#ifndef USE_SYSTEM_BZLIB
+    bzra_free(fil->ra);
+#endif
+    bzfile_park(fil);
 }
 
 struct bzfile *av_bzfile_new(vfile *vf)
@@ -493,6 +1324,8 @@ struct bzfile *av_bzfile_new(vfile *vf)
     fil->iserror = 0;
     fil->infile = vf;
     fil->id = 0;
+    fil->ra = NULL;
+    fil->noparallel = 0;
 
     res = bz_new_stream(&fil->s);
     if(res < 0)
@@ -503,7 +1336,11 @@ struct bzfile *av_bzfile_new(vfile *vf)
 
 static void bzcache_destroy(struct bzcache *zc)
 {
-    av_free(zc->indexes);
+    av_streamcache_forget(zc->id);
+    av_pagecache_forget(zc->id);
+    AV_FREELOCK(zc->lock);
+    av_free(zc->scanbits);
+    av_seekindex_free(&zc->indexes);
 }
 
 struct bzcache *av_bzcache_new()
@@ -511,16 +1348,13 @@ struct bzcache *av_bzcache_new()
     struct bzcache *zc;
 
     AV_NEW_OBJ(zc, bzcache_destroy);
-    zc->numindex = 0;
-    zc->indexes = NULL;
+    av_seekindex_init(&zc->indexes, sizeof(struct bzindex));
     zc->size = -1;
+    zc->scanstate = 0;
+    zc->numscan = 0;
+    zc->scanbits = NULL;
+    AV_INITLOCK(zc->lock);
+    zc->id = av_streamcache_newid();
 
-    AV_LOCK(bzread_lock);
-    if(bzread_nextid == 0)
-        bzread_nextid = 1;
-
-    zc->id = bzread_nextid ++;
-    AV_UNLOCK(bzread_lock);
-    
     return zc;
 }
@@ -32,6 +32,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+/* The cache is split into shards, each with its own lock, LRU list and
+   hash table of the V2 objects.  The disk usage accounting is global
+   and protected by cachelock, which may be taken while holding a shard
+   lock but not the other way round. */
+
+#define CACHE_SHARDS 16
+#define CACHE_HASHSIZE 251
+#define CACHE_MAX_SHRINKERS 4
+
+struct cacheshard;
+
 struct cacheobj {
     void *obj;
     avoff_t diskusage;
@@ -40,13 +51,26 @@ struct cacheobj {
     struct cacheobj *next;
     struct cacheobj *prev;
 
+    struct cacheobj *hnext;
+    struct cacheshard *shard;
+    unsigned int hash;
+
     int internal_obj;
 };
 
+struct cacheshard {
+    avmutex lock;
+    struct cacheobj list;
+    struct cacheobj *hashtab[CACHE_HASHSIZE];
+};
+
 #define MBYTE (1024 * 1024)
 
 static AV_LOCK_DECL(cachelock);
-static struct cacheobj cachelist;
+static struct cacheshard cacheshards[CACHE_SHARDS];
+static int cache_evict_next;
+static cache_shrink_func cache_shrinkers[CACHE_MAX_SHRINKERS];
+static int cache_num_shrinkers;
 static avoff_t disk_cache_limit = 100 * MBYTE;
 static avoff_t disk_keep_free = 10 * MBYTE;
 static avoff_t disk_usage = 0;
@@ -120,27 +144,38 @@ static int cache_setoff(struct entry *ent, const char *param, const char *val)
 static void destroy_cache()
 {
     struct cacheobj *cobj;
-
-    AV_LOCK(cachelock);
-    for(cobj = &cachelist; cobj->next != &cachelist; ) {
-        if(cobj->next->internal_obj) {
-            /* unref the internal objects which will remove it */
-            av_unref_obj(cobj->next);
-        } else {
-            /* this shouldn't happen, there shouldn't be
-             * any external object left at exit */
-            cobj = cobj->next;
+    int i;
+
+    for(i = 0; i < CACHE_SHARDS; i++) {
+        struct cacheshard *sh = &cacheshards[i];
+
+        AV_LOCK(sh->lock);
+        for(cobj = &sh->list; cobj->next != &sh->list; ) {
+            if(cobj->next->internal_obj) {
+                /* unref the internal objects which will remove it */
+                av_unref_obj(cobj->next);
+            } else {
+                /* this shouldn't happen, there shouldn't be
+                 * any external object left at exit */
+                cobj = cobj->next;
+            }
         }
+        AV_UNLOCK(sh->lock);
     }
-    AV_UNLOCK(cachelock);
 }
 
 void av_init_cache()
 {
     struct statefile statf;
+    int i;
+
+    for(i = 0; i < CACHE_SHARDS; i++) {
+        struct cacheshard *sh = &cacheshards[i];
 
-    cachelist.next = &cachelist;
-    cachelist.prev = &cachelist;
+        AV_INITLOCK(sh->lock);
+        sh->list.next = &sh->list;
+        sh->list.prev = &sh->list;
+    }
 
     statf.get = cache_getoff;
     statf.set = cache_setoff;
@@ -163,6 +198,16 @@ void av_init_cache()
     av_add_exithandler(destroy_cache);
 }
 
+static struct cacheshard *cache_shard(unsigned int hash)
+{
+    return &cacheshards[hash % CACHE_SHARDS];
+}
+
+static struct cacheobj **cache_bucket(struct cacheshard *sh, unsigned int hash)
+{
+    return &sh->hashtab[(hash / CACHE_SHARDS) % CACHE_HASHSIZE];
+}
+
 static void cacheobj_remove(struct cacheobj *cobj)
 {
     struct cacheobj *next;
@@ -179,14 +224,47 @@ static void cacheobj_insert(struct cacheobj *cobj)
     struct cacheobj *next;
     struct cacheobj *prev;
 
-    next = cachelist.next;
-    prev = &cachelist;
+    next = cobj->shard->list.next;
+    prev = &cobj->shard->list;
     next->prev = cobj;
     prev->next = cobj;
     cobj->next = next;
     cobj->prev = prev;
 }
 
+static void cacheobj_hash_insert(struct cacheobj *cobj)
+{
+    struct cacheobj **bucket = cache_bucket(cobj->shard, cobj->hash);
+
+    cobj->hnext = *bucket;
+    *bucket = cobj;
+}
+
+static void cacheobj_hash_remove(struct cacheobj *cobj)
+{
+    struct cacheobj **cp;
+
+    for(cp = cache_bucket(cobj->shard, cobj->hash); *cp != NULL;
+        cp = &(*cp)->hnext) {
+        if(*cp == cobj) {
+            *cp = cobj->hnext;
+            break;
+        }
+    }
+}
+
+/* Remove the object from the shard, the shard lock must be held */
+static void cacheobj_unlink(struct cacheobj *cobj)
+{
+    cacheobj_remove(cobj);
+    if(cobj->internal_obj)
+        cacheobj_hash_remove(cobj);
+
+    AV_LOCK(cachelock);
+    disk_usage -= cobj->diskusage;
+    AV_UNLOCK(cachelock);
+}
+
 static void cacheobj_free(struct cacheobj *cobj)
 {
     av_unref_obj(cobj->obj);
@@ -201,12 +279,10 @@ static void cacheobj_free(struct cacheobj *cobj)
  */
 static void cacheobj_delete(struct cacheobj *cobj)
 {
-    AV_LOCK(cachelock);
-    if(cobj->obj != NULL) {
-        cacheobj_remove(cobj);
-        disk_usage -= cobj->diskusage;
-    }
-    AV_UNLOCK(cachelock);
+    AV_LOCK(cobj->shard->lock);
+    if(cobj->obj != NULL)
+        cacheobj_unlink(cobj);
+    AV_UNLOCK(cobj->shard->lock);
 
     if(cobj->obj != NULL)
         cacheobj_free(cobj);
@@ -216,19 +292,17 @@ static void cacheobj_delete(struct cacheobj *cobj)
  * This is the destructor for internal cacheobj's created
  * using the V2 interface
  * Because of possible race conditions the object can only
- * by destroyed when holding the lock
+ * by destroyed when holding the shard lock
  */
 static void cacheobj_internal_delete(struct cacheobj *cobj)
 {
-    if(cobj->obj != NULL) {
-        cacheobj_remove(cobj);
-        disk_usage -= cobj->diskusage;
-    }
+    if(cobj->obj != NULL)
+        cacheobj_unlink(cobj);
 
-    AV_UNLOCK(cachelock);
+    AV_UNLOCK(cobj->shard->lock);
     if(cobj->obj != NULL)
         cacheobj_free(cobj);
-    AV_LOCK(cachelock);
+    AV_LOCK(cobj->shard->lock);
 }
 
 struct cacheobj *av_cacheobj_new(void *obj, const char *name)
@@ -242,51 +316,112 @@ struct cacheobj *av_cacheobj_new(void *obj, const char *name)
     cobj->obj = obj;
     cobj->diskusage = 0;
     cobj->name = av_strdup(name);
+    cobj->hash = av_strhash(name);
+    cobj->shard = cache_shard(cobj->hash);
     cobj->internal_obj = 0;
     av_ref_obj(obj);
 
-    AV_LOCK(cachelock);
+    AV_LOCK(cobj->shard->lock);
     cacheobj_insert(cobj);
-    AV_UNLOCK(cachelock);
+    AV_UNLOCK(cobj->shard->lock);
 
     return cobj;
 }
 
-static int cache_free_one(struct cacheobj *skip_entry)
+/* Free the least recently used object of the shard, the shard lock
+   must be held */
+static int cache_free_one(struct cacheshard *sh, struct cacheobj *skip_entry)
 {
     struct cacheobj *cobj;
     struct cacheobj tmpcobj;
 
-    cobj = cachelist.prev;
+    cobj = sh->list.prev;
     if(cobj == skip_entry)
 	cobj = cobj->prev;
-    if(cobj == &cachelist)
+    if(cobj == &sh->list)
         return 0;
 
     if(cobj->internal_obj) {
         av_unref_obj(cobj);
     } else {
-        cacheobj_remove(cobj);
-        disk_usage -= cobj->diskusage;
+        cacheobj_unlink(cobj);
         tmpcobj = *cobj;
         cobj->obj = NULL;
-        AV_UNLOCK(cachelock);
+        AV_UNLOCK(sh->lock);
         cacheobj_free(&tmpcobj);
-        AV_LOCK(cachelock);
+        AV_LOCK(sh->lock);
     }
 
     return 1;
 }
 
+/* Free one object, taking the shards and the memory caches in turn.
+   So the eviction order is only approximately LRU over the whole
+   cache. */
+static int cache_free_lru(struct cacheobj *skip_entry)
+{
+    int i;
+    int n;
+    int res;
+    cache_shrink_func shrink;
+
+    for(i = 0; i < CACHE_SHARDS + CACHE_MAX_SHRINKERS; i++) {
+        struct cacheshard *sh;
+
+        AV_LOCK(cachelock);
+        n = cache_evict_next;
+        cache_evict_next = (n + 1) % (CACHE_SHARDS + cache_num_shrinkers);
+        shrink = n >= CACHE_SHARDS ? cache_shrinkers[n - CACHE_SHARDS] : NULL;
+        AV_UNLOCK(cachelock);
+
+        if(n >= CACHE_SHARDS) {
+            if(shrink())
+                return 1;
+            continue;
+        }
+
+        sh = &cacheshards[n];
+        AV_LOCK(sh->lock);
+        res = cache_free_one(sh, skip_entry);
+        AV_UNLOCK(sh->lock);
+
+        if(res)
+            return 1;
+    }
+
+    return 0;
+}
+
 static int cache_clear()
 {
-    AV_LOCK(cachelock);
-    while(cache_free_one(NULL));
-    AV_UNLOCK(cachelock);
+    int i;
+
+    for(i = 0; i < CACHE_SHARDS; i++) {
+        struct cacheshard *sh = &cacheshards[i];
+
+        AV_LOCK(sh->lock);
+        while(cache_free_one(sh, NULL));
+        AV_UNLOCK(sh->lock);
+    }
+
+    for(i = 0; i < cache_num_shrinkers; i++)
+        while(cache_shrinkers[i]());
     
     return 0;
 }
 
+static int cache_over_limit(avoff_t limit)
+{
+    int over;
+
+    AV_LOCK(cachelock);
+    over = (disk_usage > limit);
+    AV_UNLOCK(cachelock);
+
+    return over;
+}
+
+/* Must be called without any cache lock held */
 static void cache_checkspace(int full, struct cacheobj *skip_entry)
 {
     avoff_t tmpfree;
@@ -302,6 +437,7 @@ static void cache_checkspace(int full, struct cacheobj *skip_entry)
     if(tmpfree == -1)
         tmpfree = AV_MAXOFF;
     
+    AV_LOCK(cachelock);
     keepfree = disk_keep_free;
     if(keepfree < 100 * 1024)
         keepfree = 100 * 1024;
@@ -309,39 +445,84 @@ static void cache_checkspace(int full, struct cacheobj *skip_entry)
     limit = disk_usage - disk_keep_free + tmpfree;
     if(disk_cache_limit < limit)
         limit = disk_cache_limit;
+    AV_UNLOCK(cachelock);
     
-    while(disk_usage > limit)
-        if(!cache_free_one(skip_entry))
+    while(cache_over_limit(limit))
+        if(!cache_free_lru(skip_entry))
             break;        
 }
 
 
 void av_cache_checkspace()
 {
-    AV_LOCK(cachelock);
     cache_checkspace(0,NULL);
-    AV_UNLOCK(cachelock);
 }
 
 void av_cache_diskfull()
 {
-    AV_LOCK(cachelock);
     cache_checkspace(1,NULL);
+}
+
+void av_cache_add_shrinker(cache_shrink_func shrink)
+{
+    AV_LOCK(cachelock);
+    if(cache_num_shrinkers < CACHE_MAX_SHRINKERS)
+        cache_shrinkers[cache_num_shrinkers++] = shrink;
     AV_UNLOCK(cachelock);
 }
 
+avoff_t av_cache_limit()
+{
+    avoff_t limit;
 
-void av_cacheobj_setsize(struct cacheobj *cobj, avoff_t diskusage)
+    AV_LOCK(cachelock);
+    limit = disk_cache_limit;
+    AV_UNLOCK(cachelock);
+
+    return limit;
+}
+
+/* Memory does not take up temporary space, so only the limit needs to
+   be checked */
+void av_cache_add_usage(avoff_t diff)
 {
+    int over;
+
     AV_LOCK(cachelock);
-    if(cobj->obj != NULL && cobj->diskusage != diskusage) {
-        disk_usage -= cobj->diskusage;
-        cobj->diskusage = diskusage;
-        disk_usage += cobj->diskusage;
-        
-        cache_checkspace(0, cobj);
-    }
+    disk_usage += diff;
+    over = (diff > 0 && disk_usage > disk_cache_limit);
     AV_UNLOCK(cachelock);
+
+    if(over)
+        cache_checkspace(0, NULL);
+}
+
+/* Update the size of an object in the cache, the shard lock must be
+   held.  Returns true if the space needs to be checked. */
+static int cacheobj_update_size(struct cacheobj *cobj, avoff_t diskusage)
+{
+    if(cobj->obj == NULL || cobj->diskusage == diskusage)
+        return 0;
+
+    AV_LOCK(cachelock);
+    disk_usage -= cobj->diskusage;
+    cobj->diskusage = diskusage;
+    disk_usage += cobj->diskusage;
+    AV_UNLOCK(cachelock);
+
+    return 1;
+}
+
+void av_cacheobj_setsize(struct cacheobj *cobj, avoff_t diskusage)
+{
+    int check;
+
+    AV_LOCK(cobj->shard->lock);
+    check = cacheobj_update_size(cobj, diskusage);
+    AV_UNLOCK(cobj->shard->lock);
+
+    if(check)
+        cache_checkspace(0, cobj);
 }
 
 void *av_cacheobj_get(struct cacheobj *cobj)
@@ -351,29 +532,29 @@ void *av_cacheobj_get(struct cacheobj *cobj)
     if(cobj == NULL)
         return NULL;
 
-    AV_LOCK(cachelock);
+    AV_LOCK(cobj->shard->lock);
     obj = cobj->obj;
     if(obj != NULL) {
         cacheobj_remove(cobj);
         cacheobj_insert(cobj);
         av_ref_obj(obj);
     }
-    AV_UNLOCK(cachelock);
+    AV_UNLOCK(cobj->shard->lock);
 
     return obj;
 }
 
-static struct cacheobj *cacheobj2_find(const char *name)
+static struct cacheobj *cacheobj2_find(struct cacheshard *sh, const char *name,
+                                       unsigned int hash)
 {
     struct cacheobj *cobj;
     
-    for(cobj = cachelist.next; cobj != &cachelist; cobj = cobj->next) {
-        if(cobj->internal_obj == 1)
-            if(strcmp(cobj->name, name) == 0)
-                break;
+    for(cobj = *cache_bucket(sh, hash); cobj != NULL; cobj = cobj->hnext) {
+        if(cobj->hash == hash && strcmp(cobj->name, name) == 0)
+            break;
     }
 
-    if(cobj->obj == NULL)
+    if(cobj == NULL || cobj->obj == NULL)
         return NULL;
 
     return cobj;
@@ -382,28 +563,34 @@ static struct cacheobj *cacheobj2_find(const char *name)
 int av_cache2_set(void *obj, const char *name)
 {
     struct cacheobj *cobj, *oldcobj;
+    unsigned int hash = av_strhash(name);
+    struct cacheshard *sh = cache_shard(hash);
 
     if(obj != NULL) {
         AV_NEW_OBJ(cobj, cacheobj_internal_delete);
         cobj->obj = obj;
         cobj->diskusage = 0;
         cobj->name = av_strdup(name);
+        cobj->hash = hash;
+        cobj->shard = sh;
         cobj->internal_obj = 1;
         av_ref_obj(obj);
     } else {
         cobj = NULL;
     }
 
-    AV_LOCK(cachelock);
-    oldcobj = cacheobj2_find(name);
+    AV_LOCK(sh->lock);
+    oldcobj = cacheobj2_find(sh, name, hash);
 
     if(oldcobj != NULL )
         av_unref_obj(oldcobj);
 
-    if(cobj != NULL)
+    if(cobj != NULL) {
         cacheobj_insert(cobj);
+        cacheobj_hash_insert(cobj);
+    }
 
-    AV_UNLOCK(cachelock);
+    AV_UNLOCK(sh->lock);
 
     return 0;
 }
@@ -412,16 +599,18 @@ void *av_cache2_get(const char *name)
 {
     struct cacheobj *cobj;
     void *obj = NULL;
+    unsigned int hash = av_strhash(name);
+    struct cacheshard *sh = cache_shard(hash);
     
-    AV_LOCK(cachelock);
-    cobj = cacheobj2_find(name);
+    AV_LOCK(sh->lock);
+    cobj = cacheobj2_find(sh, name, hash);
     if(cobj != NULL) {
         cacheobj_remove(cobj);
         cacheobj_insert(cobj);
         obj = cobj->obj;
         av_ref_obj(obj);
     }
-    AV_UNLOCK(cachelock);
+    AV_UNLOCK(sh->lock);
 
     return obj;
 }
@@ -429,15 +618,16 @@ void *av_cache2_get(const char *name)
 void av_cache2_setsize(const char *name, avoff_t diskusage)
 {
     struct cacheobj *cobj;
+    unsigned int hash = av_strhash(name);
+    struct cacheshard *sh = cache_shard(hash);
+    int check = 0;
 
-    AV_LOCK(cachelock);
-    cobj = cacheobj2_find(name);
-    if(cobj->obj != NULL && cobj->diskusage != diskusage) {
-        disk_usage -= cobj->diskusage;
-        cobj->diskusage = diskusage;
-        disk_usage += cobj->diskusage;
-        
+    AV_LOCK(sh->lock);
+    cobj = cacheobj2_find(sh, name, hash);
+    if(cobj != NULL)
+        check = cacheobj_update_size(cobj, diskusage);
+    AV_UNLOCK(sh->lock);
+
+    if(check)
         cache_checkspace(0, cobj);
-    }
-    AV_UNLOCK(cachelock);
 }
@@ -0,0 +1,377 @@
+/*
+    AVFS: A Virtual File System Library
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+/* dcache.c
+
+   Cache of path resolution results for av_get_ventry().
+
+   Two kinds of entries are stored: the resolved ventry of a path
+   prefix ending before a '/', from which parsing can continue, and
+   negative entries for paths that could not be resolved.  Entries
+   expire after a timeout, and the whole cache is invalidated when
+   something is created, removed or renamed through AVFS.
+*/
+
+#include "internal.h"
+#include "exit.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define DCACHE_MAX_SIZE 4096
+#define DCACHE_HASHSIZE 1021
+#define DCACHE_DEFAULT_TIMEOUT 1000 /* milliseconds */
+
+struct dentry {
+    struct dentry *next;
+    struct dentry *prev;
+    struct dentry *hnext;
+
+    char *key;
+    unsigned int hash;
+    avtime_t expire;
+
+    ventry *ve;
+    char *prevseg;
+    int first_seg;
+    int err;
+};
+
+static AV_LOCK_DECL(dcachelock);
+static struct dentry dlist;
+static struct dentry *dhashtab[DCACHE_HASHSIZE];
+static int dlist_len;
+static int dcache_timeout = DCACHE_DEFAULT_TIMEOUT;
+static int dcache_gen;
+
+static avtime_t dcache_now()
+{
+    struct timespec ts;
+
+    if(clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+        return 0;
+
+    return (avtime_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void dentry_destroy(struct dentry *de)
+{
+    av_free_ventry(de->ve);
+    av_free(de->prevseg);
+    av_free(de->key);
+}
+
+static void dentry_remove(struct dentry *de)
+{
+    struct dentry **dp;
+
+    de->prev->next = de->next;
+    de->next->prev = de->prev;
+
+    for(dp = &dhashtab[de->hash % DCACHE_HASHSIZE]; *dp != NULL;
+        dp = &(*dp)->hnext) {
+        if(*dp == de) {
+            *dp = de->hnext;
+            break;
+        }
+    }
+
+    dlist_len--;
+}
+
+static void dentry_insert(struct dentry *de)
+{
+    struct dentry **bucket = &dhashtab[de->hash % DCACHE_HASHSIZE];
+
+    de->next = dlist.next;
+    de->prev = &dlist;
+    dlist.next->prev = de;
+    dlist.next = de;
+
+    de->hnext = *bucket;
+    *bucket = de;
+
+    dlist_len++;
+}
+
+static struct dentry *dcache_find(const char *key, unsigned int hash)
+{
+    struct dentry *de;
+
+    for(de = dhashtab[hash % DCACHE_HASHSIZE]; de != NULL; de = de->hnext) {
+        if(de->hash == hash && strcmp(de->key, key) == 0)
+            return de;
+    }
+
+    return NULL;
+}
+
+/* Look up a valid entry and take a reference to it.  An expired entry
+   is removed and returned in *oldp, to be freed without the lock. */
+static struct dentry *dcache_get(const char *key, struct dentry **oldp)
+{
+    struct dentry *de;
+    unsigned int hash = av_strhash(key);
+
+    *oldp = NULL;
+
+    AV_LOCK(dcachelock);
+    de = dcache_find(key, hash);
+    if(de != NULL) {
+        if(dcache_timeout == 0 || dcache_now() >= de->expire) {
+            dentry_remove(de);
+            *oldp = de;
+            de = NULL;
+        }
+        else {
+            de->prev->next = de->next;
+            de->next->prev = de->prev;
+            de->next = dlist.next;
+            de->prev = &dlist;
+            dlist.next->prev = de;
+            dlist.next = de;
+            av_ref_obj(de);
+        }
+    }
+    AV_UNLOCK(dcachelock);
+
+    return de;
+}
+
+/* Insert the entry unless the cache was invalidated since gen, and
+   drop entries over the size limit */
+static void dcache_put(struct dentry *de, int gen)
+{
+    struct dentry *old;
+    struct dentry *evicted = NULL;
+
+    de->hash = av_strhash(de->key);
+
+    AV_LOCK(dcachelock);
+    if(gen == dcache_gen && dcache_timeout > 0) {
+        de->expire = dcache_now() + dcache_timeout;
+
+        old = dcache_find(de->key, de->hash);
+        if(old != NULL) {
+            dentry_remove(old);
+            old->hnext = evicted;
+            evicted = old;
+        }
+        dentry_insert(de);
+        de = NULL;
+
+        while(dlist_len > DCACHE_MAX_SIZE) {
+            old = dlist.prev;
+            dentry_remove(old);
+            old->hnext = evicted;
+            evicted = old;
+        }
+    }
+    AV_UNLOCK(dcachelock);
+
+    /* entries hold ventries, so they are freed without the lock */
+    av_unref_obj(de);
+    while(evicted != NULL) {
+        old = evicted;
+        evicted = old->hnext;
+        av_unref_obj(old);
+    }
+}
+
+static char *dcache_prefix_key(const char *path, int len)
+{
+    char *key = av_malloc(len + 2);
+
+    key[0] = 'P';
+    strncpy(key + 1, path, len);
+    key[len + 1] = '\0';
+
+    return key;
+}
+
+static char *dcache_negative_key(const char *path, int resolvelast)
+{
+    return av_stradd(NULL, resolvelast ? "N1" : "N0", path, NULL);
+}
+
+int av_dcache_generation()
+{
+    int gen;
+
+    AV_LOCK(dcachelock);
+    gen = dcache_gen;
+    AV_UNLOCK(dcachelock);
+
+    return gen;
+}
+
+void av_dcache_invalidate()
+{
+    struct dentry *de;
+    struct dentry *next;
+    struct dentry *first;
+
+    AV_LOCK(dcachelock);
+    dcache_gen++;
+    first = dlist.next;
+    dlist.prev->next = NULL;
+    dlist.next = &dlist;
+    dlist.prev = &dlist;
+    memset(dhashtab, 0, sizeof(dhashtab));
+    dlist_len = 0;
+    AV_UNLOCK(dcachelock);
+
+    for(de = first; de != NULL && de != &dlist; de = next) {
+        next = de->next;
+        av_unref_obj(de);
+    }
+}
+
+int av_dcache_get_prefix(const char *path, int len, ventry **vep,
+                         char **prevsegp, int *first_segp)
+{
+    int res;
+    char *key;
+    struct dentry *de;
+    struct dentry *old;
+
+    key = dcache_prefix_key(path, len);
+    de = dcache_get(key, &old);
+    av_free(key);
+    av_unref_obj(old);
+
+    if(de == NULL)
+        return 0;
+
+    res = av_copy_ventry(de->ve, vep);
+    if(res == 0) {
+        *prevsegp = av_strdup(de->prevseg);
+        *first_segp = de->first_seg;
+    }
+    av_unref_obj(de);
+
+    return res == 0 ? 1 : 0;
+}
+
+void av_dcache_set_prefix(const char *path, int len, ventry *ve,
+                          const char *prevseg, int first_seg, int gen)
+{
+    struct dentry *de;
+    struct dentry *old;
+    char *key;
+
+    key = dcache_prefix_key(path, len);
+    de = dcache_get(key, &old);
+    av_unref_obj(old);
+    if(de != NULL) {
+        /* already cached */
+        av_unref_obj(de);
+        av_free(key);
+        return;
+    }
+
+    AV_NEW_OBJ(de, dentry_destroy);
+    de->key = key;
+    de->prevseg = av_strdup(prevseg);
+    de->first_seg = first_seg;
+    if(av_copy_ventry(ve, &de->ve) < 0) {
+        de->ve = NULL;
+        av_unref_obj(de);
+        return;
+    }
+
+    dcache_put(de, gen);
+}
+
+int av_dcache_get_negative(const char *path, int resolvelast)
+{
+    int res = 0;
+    char *key;
+    struct dentry *de;
+    struct dentry *old;
+
+    key = dcache_negative_key(path, resolvelast);
+    de = dcache_get(key, &old);
+    av_free(key);
+    av_unref_obj(old);
+
+    if(de != NULL) {
+        res = de->err;
+        av_unref_obj(de);
+    }
+
+    return res;
+}
+
+void av_dcache_set_negative(const char *path, int resolvelast, int err,
+                            int gen)
+{
+    struct dentry *de;
+
+    /* Other errors may well be transient */
+    if(err != -ENOENT && err != -ENOTDIR)
+        return;
+
+    AV_NEW_OBJ(de, dentry_destroy);
+    de->key = dcache_negative_key(path, resolvelast);
+    de->err = err;
+
+    dcache_put(de, gen);
+}
+
+static int dcache_timeout_get(struct entry *ent, const char *param,
+                              char **retp)
+{
+    char buf[32];
+
+    AV_LOCK(dcachelock);
+    sprintf(buf, "%d\n", dcache_timeout);
+    AV_UNLOCK(dcachelock);
+
+    *retp = av_strdup(buf);
+    return 0;
+}
+
+static int dcache_timeout_set(struct entry *ent, const char *param,
+                              const char *val)
+{
+    int timeout;
+    char *end;
+
+    timeout = strtol(val, &end, 0);
+    if(end == val || timeout < 0)
+        return -EINVAL;
+    if(*end == '\n')
+        end++;
+    if(*end != '\0')
+        return -EINVAL;
+
+    /* Entries are dropped when the file is closed, this is called with
+       the state filesystem locked and freeing its ventries would
+       deadlock */
+    AV_LOCK(dcachelock);
+    dcache_timeout = timeout;
+    AV_UNLOCK(dcachelock);
+
+    return 0;
+}
+
+void av_init_dcache()
+{
+    struct statefile statf;
+
+    dlist.next = &dlist;
+    dlist.prev = &dlist;
+    dlist_len = 0;
+
+    statf.data = NULL;
+    statf.get = dcache_timeout_get;
+    statf.set = dcache_timeout_set;
+    av_avfsstat_register("dcache/timeout", &statf);
+
+    av_add_exithandler(av_dcache_invalidate);
+}
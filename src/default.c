@@ -71,6 +71,12 @@ static int default_readlink(ventry *ve, char **bufp)
     return -EINVAL;
 }
 
+static int default_statent(ventry *ve, struct avstat *buf, int attrmask,
+                           int flags)
+{
+    return -ENOSYS;
+}
+
 static int default_symlink(const char *path, ventry *newve)
 {
     return -ENOSYS;
@@ -204,6 +210,7 @@ void av_default_avfs(struct avfs *avfs)
 
     avfs->access     = default_access;
     avfs->readlink   = default_readlink;
+    avfs->statent    = default_statent;
     avfs->symlink    = default_symlink;
     avfs->unlink     = default_unlink;
     avfs->rmdir      = default_rmdir;
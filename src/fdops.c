@@ -156,6 +156,45 @@ avssize_t av_fd_write(int fd, const char *buf, avsize_t nbyte)
     return res;
 }
 
+/* read at offset without changing the file position */
+avssize_t av_fd_pread(int fd, void *buf, avsize_t nbyte, avoff_t offset)
+{
+    avssize_t res;
+    vfile *vf;
+
+    res = get_file(fd, &vf);
+    if(res == 0) {
+        avoff_t oldptr = vf->ptr;
+
+        res = av_file_pread(vf, buf, nbyte, offset);
+        if(vf->ptr != oldptr)
+            av_file_lseek(vf, oldptr, AVSEEK_SET);
+        put_file(vf);
+    }
+
+    return res;
+}
+
+/* write at offset without changing the file position */
+avssize_t av_fd_pwrite(int fd, const char *buf, avsize_t nbyte,
+                       avoff_t offset)
+{
+    avssize_t res;
+    vfile *vf;
+
+    res = get_file(fd, &vf);
+    if(res == 0) {
+        avoff_t oldptr = vf->ptr;
+
+        res = av_file_pwrite(vf, buf, nbyte, offset);
+        if(vf->ptr != oldptr)
+            av_file_lseek(vf, oldptr, AVSEEK_SET);
+        put_file(vf);
+    }
+
+    return res;
+}
+
 static avoff_t dir_lseek(vfile *vf, avoff_t offset, int whence)
 {
     switch(whence) {
@@ -16,43 +16,80 @@
 // and remove any additional elements if they are older than this number of seconds
 #define FILECACHE_MAX_AGE ( 10 * 60 )
 
+// the cache is split into shards with their own lock, LRU list and hash table
+#define FILECACHE_SHARDS 16
+#define FILECACHE_HASHSIZE 61
+
 struct filecache {
     struct filecache *next;
     struct filecache *prev;
+    struct filecache *hnext;
     
     char *key;
+    unsigned int hash;
     void *obj;
 
     time_t last_access;
 };
 
-static struct filecache fclist;
+struct fcshard {
+    avmutex lock;
+    struct filecache list;
+    struct filecache *hashtab[FILECACHE_HASHSIZE];
+};
+
+static struct fcshard fcshards[FILECACHE_SHARDS];
 static int fclist_len;
-static AV_LOCK_DECL(fclock);
+static AV_LOCK_DECL(fclenlock);
+
+static struct fcshard *filecache_shard(unsigned int hash)
+{
+    return &fcshards[hash % FILECACHE_SHARDS];
+}
 
-static void filecache_remove(struct filecache *fc)
+static struct filecache **filecache_bucket(struct fcshard *sh,
+                                           unsigned int hash)
+{
+    return &sh->hashtab[(hash / FILECACHE_SHARDS) % FILECACHE_HASHSIZE];
+}
+
+static void filecache_add_len(int diff)
+{
+    AV_LOCK(fclenlock);
+    fclist_len += diff;
+    AV_UNLOCK(fclenlock);
+}
+
+static int filecache_get_len(void)
+{
+    int len;
+
+    AV_LOCK(fclenlock);
+    len = fclist_len;
+    AV_UNLOCK(fclenlock);
+
+    return len;
+}
+
+static void filecache_lru_remove(struct filecache *fc)
 {
     struct filecache *prev = fc->prev;
     struct filecache *next = fc->next;
 
     prev->next = next;
     next->prev = prev;
-
-    fclist_len--;
 }
 
-static void filecache_insert(struct filecache *fc)
+static void filecache_lru_insert(struct fcshard *sh, struct filecache *fc)
 {
-    struct filecache *prev = &fclist;
-    struct filecache *next = fclist.next;
+    struct filecache *prev = &sh->list;
+    struct filecache *next = sh->list.next;
     
     prev->next = fc;
     next->prev = fc;
     fc->prev = prev;
     fc->next = next;
 
-    fclist_len++;
-
     struct timespec tv;
     if ( clock_gettime( CLOCK_MONOTONIC, &tv ) == 0 ) {
         fc->last_access = tv.tv_sec;
@@ -61,49 +98,76 @@ static void filecache_insert(struct filecache *fc)
     }
 }
 
-static void filecache_delete(struct filecache *fc)
+static void filecache_remove(struct fcshard *sh, struct filecache *fc)
+{
+    struct filecache **fcp;
+
+    filecache_lru_remove(fc);
+
+    for(fcp = filecache_bucket(sh, fc->hash); *fcp != NULL;
+        fcp = &(*fcp)->hnext) {
+        if(*fcp == fc) {
+            *fcp = fc->hnext;
+            break;
+        }
+    }
+
+    filecache_add_len(-1);
+}
+
+static void filecache_insert(struct fcshard *sh, struct filecache *fc)
+{
+    struct filecache **bucket = filecache_bucket(sh, fc->hash);
+
+    filecache_lru_insert(sh, fc);
+
+    fc->hnext = *bucket;
+    *bucket = fc;
+
+    filecache_add_len(1);
+}
+
+static void filecache_delete(struct fcshard *sh, struct filecache *fc)
 {
     av_log(AVLOG_DEBUG, "FILECACHE: delete <%s>", fc->key);
-    filecache_remove(fc);
+    filecache_remove(sh, fc);
 
     av_unref_obj(fc->obj);
     av_free(fc->key);
     av_free(fc);
 }
 
-static void filecache_check_limits(void)
+/* Only the shard being modified is pruned, so old entries in other
+   shards are removed when something is inserted there */
+static void filecache_check_limits(struct fcshard *sh)
 {
     struct timespec now;
     if ( clock_gettime( CLOCK_MONOTONIC, &now ) != 0 ) {
         now.tv_sec = 0;
     }
 
-    while (fclist_len > FILECACHE_MAX_SIZE &&
-           fclist.prev != &fclist) {
+    while (filecache_get_len() > FILECACHE_MAX_SIZE &&
+           sh->list.prev != &sh->list) {
 
         if (now.tv_sec == 0 ||
-            (now.tv_sec != 0 && (int)(now.tv_sec - fclist.prev->last_access) > FILECACHE_MAX_AGE)) {
-            filecache_delete(fclist.prev);
+            (now.tv_sec != 0 && (int)(now.tv_sec - sh->list.prev->last_access) > FILECACHE_MAX_AGE)) {
+            filecache_delete(sh, sh->list.prev);
         } else {
             break;
         }
     }
 }
 
-static struct filecache *filecache_find(const char *key)
+static struct filecache *filecache_find(struct fcshard *sh, const char *key,
+                                        unsigned int hash)
 {
     struct filecache *fc;
 
-    filecache_check_limits();
-
-    for(fc = fclist.next; fc != &fclist; fc = fc->next) {
-        if(strcmp(fc->key, key) == 0)
+    for(fc = *filecache_bucket(sh, hash); fc != NULL; fc = fc->hnext) {
+        if(fc->hash == hash && strcmp(fc->key, key) == 0)
             break;
     }
 
-    if(fc->obj == NULL)
-        return NULL;
-
     return fc;
 }
 
@@ -111,16 +175,18 @@ void *av_filecache_get(const char *key)
 {
     struct filecache *fc;
     void *obj = NULL;
+    unsigned int hash = av_strhash(key);
+    struct fcshard *sh = filecache_shard(hash);
     
-    AV_LOCK(fclock);
-    fc = filecache_find(key);
+    AV_LOCK(sh->lock);
+    fc = filecache_find(sh, key, hash);
     if(fc != NULL) {
-        filecache_remove(fc);
-        filecache_insert(fc);
+        filecache_lru_remove(fc);
+        filecache_lru_insert(sh, fc);
         obj = fc->obj;
         av_ref_obj(obj);
     }
-    AV_UNLOCK(fclock);
+    AV_UNLOCK(sh->lock);
 
     return obj;
 }
@@ -129,41 +195,58 @@ void av_filecache_set(const char *key, void *obj)
 {
     struct filecache *oldfc;
     struct filecache *fc;
+    unsigned int hash = av_strhash(key);
+    struct fcshard *sh = filecache_shard(hash);
 
     if(obj != NULL) {
         AV_NEW(fc);
         fc->key = av_strdup(key);
+        fc->hash = hash;
         fc->obj = obj;
         av_ref_obj(obj);
     }
     else
         fc = NULL;
 
-    AV_LOCK(fclock);
-    oldfc = filecache_find(key);
+    AV_LOCK(sh->lock);
+    oldfc = filecache_find(sh, key, hash);
     if(oldfc != NULL)
-        filecache_delete(oldfc);
+        filecache_delete(sh, oldfc);
     if(fc != NULL) {
         av_log(AVLOG_DEBUG, "FILECACHE: insert <%s>", key);
-        filecache_insert(fc);
+        filecache_insert(sh, fc);
     }
-    AV_UNLOCK(fclock);
+    filecache_check_limits(sh);
+    AV_UNLOCK(sh->lock);
 }
 
 static void destroy_filecache()
 {
-    AV_LOCK(fclock);
-    while(fclist.next != &fclist)
-        filecache_delete(fclist.next);
-    AV_UNLOCK(fclock);
+    int i;
+
+    for(i = 0; i < FILECACHE_SHARDS; i++) {
+        struct fcshard *sh = &fcshards[i];
+
+        AV_LOCK(sh->lock);
+        while(sh->list.next != &sh->list)
+            filecache_delete(sh, sh->list.next);
+        AV_UNLOCK(sh->lock);
+    }
 }
 
 void av_init_filecache()
 {
-    fclist.next = &fclist;
-    fclist.prev = &fclist;
-    fclist.obj = NULL;
-    fclist.key = NULL;
+    int i;
+
+    for(i = 0; i < FILECACHE_SHARDS; i++) {
+        struct fcshard *sh = &fcshards[i];
+
+        AV_INITLOCK(sh->lock);
+        sh->list.next = &sh->list;
+        sh->list.prev = &sh->list;
+        sh->list.obj = NULL;
+        sh->list.key = NULL;
+    }
 
     fclist_len = 0;
     
@@ -335,7 +335,9 @@ struct sfile *av_filtprog_new(vfile *vf, struct filtdata *filtdat)
         filtprog_read,
         filtprog_startput,
         filtprog_write,
-        filtprog_endput
+        filtprog_endput,
+        NULL,
+        NULL
     };
 
     AV_NEW_OBJ(fp, NULL);
@@ -231,6 +231,25 @@ static int local_getattr(vfile *vf, struct avstat *buf, int attrmask)
     return 0;
 }
 
+static int local_statent(ventry *ve, struct avstat *buf, int attrmask,
+                         int flags)
+{
+    int res;
+    struct stat stbuf;
+    const char *path = (char *) ve->data;
+
+    if((flags & AVO_NOFOLLOW) != 0)
+        res = lstat(path, &stbuf);
+    else
+        res = stat(path, &stbuf);
+
+    if(res == -1)
+        return -errno;
+
+    stat_to_avstat(buf, &stbuf);
+    return 0;
+}
+
 static int local_set_time(struct localfile *fi, const struct avstat *buf,
                           int attrmask)
 {
@@ -467,6 +486,7 @@ int av_init_module_local()
     avfs->readdir    = local_readdir;
     avfs->access     = local_access;
     avfs->getattr    = local_getattr;
+    avfs->statent    = local_statent;
     avfs->setattr    = local_setattr;
     avfs->readlink   = local_readlink;
     avfs->unlink     = local_unlink;
@@ -12,6 +12,9 @@
 #include "lzipfile.h"
 #include "oper.h"
 #include "exit.h"
+#include "seekindex.h"
+#include "streamcache.h"
+#include "pagecache.h"
 
 #include <stdlib.h>
 #include <inttypes.h>
@@ -31,14 +34,14 @@ static AV_LOCK_DECL(lzipread_lock);
 struct lzipindex {
     avoff_t o_offset;          /* The number of output bytes */
     avoff_t i_offset;        /* The offset within the input file where the member begins */
-    struct lzipindex *next;
 };
 
 struct lzipcache {
+    int id;
     avoff_t cachesize;  // size of cache used to decide for cleanup
     avoff_t nextindex;  // min position when next index should happen
     avoff_t size;       // output file size
-    struct lzipindex *indexes;
+    struct seekindex indexes;
 };
 
 struct lzipfile {
@@ -95,37 +98,22 @@ static int lzipfile_save_index(struct lzipfile *fil, struct lzipcache *zc,
                                avoff_t o_offset,
                                avoff_t i_offset)
 {
-    struct lzipindex **zp;
     struct lzipindex *zi;
 
-    for(zp = &zc->indexes; *zp != NULL; zp = &(*zp)->next);
-
-    AV_NEW(zi);
-    zi->o_offset = o_offset;
-    zi->i_offset = i_offset;
-    zi->next = NULL;
-    
-    *zp = zi;
+    zi = av_seekindex_add(&zc->indexes, o_offset);
+    if(zi != NULL) {
+        zi->i_offset = i_offset;
+        zc->cachesize += sizeof(*zi);
+    }
 
     zc->nextindex += INDEXDISTANCE;
-    zc->cachesize += sizeof(*zi);
     
     return 0;
 }
 
 static struct lzipindex *lzipcache_find_index(struct lzipcache *c, avoff_t offset)
 {
-    struct lzipindex *prevzi;
-    struct lzipindex *zi;
-    
-    prevzi = NULL;
-    for(zi = c->indexes; zi != NULL; zi = zi->next) {
-        if(zi->o_offset > offset)
-            break;
-        prevzi = zi;
-    }
-
-    return prevzi;
+    return (struct lzipindex *) av_seekindex_find(&c->indexes, offset);
 }
 
 static int lzipfile_fill_inbuf(struct lzipfile *fil)
@@ -333,8 +321,8 @@ static avssize_t av_lzipfile_do_pread(struct lzipfile *fil, struct lzipcache *zc
     return res;
 }
 
-avssize_t av_lzipfile_pread(struct lzipfile *fil, struct lzipcache *zc, char *buf,
-                            avsize_t nbyte, avoff_t offset)
+static avssize_t lzipfile_pread(struct lzipfile *fil, struct lzipcache *zc,
+                                char *buf, avsize_t nbyte, avoff_t offset)
 {
     avssize_t res;
 
@@ -348,6 +336,20 @@ avssize_t av_lzipfile_pread(struct lzipfile *fil, struct lzipcache *zc, char *bu
     return res;
 }
 
+static avssize_t lzipfile_page_read(void *fil, void *zc, char *buf,
+                                    avsize_t nbyte, avoff_t offset)
+{
+    return lzipfile_pread((struct lzipfile *) fil, (struct lzipcache *) zc,
+                          buf, nbyte, offset);
+}
+
+avssize_t av_lzipfile_pread(struct lzipfile *fil, struct lzipcache *zc, char *buf,
+                            avsize_t nbyte, avoff_t offset)
+{
+    return av_pagecache_pread(zc->id, lzipfile_page_read, fil, zc, buf, nbyte,
+                              offset);
+}
+
 int av_lzipfile_size(struct lzipfile *fil, struct lzipcache *zc, avoff_t *sizep)
 {
     int res;
@@ -409,13 +411,8 @@ struct lzipfile *av_lzipfile_new(vfile *vf)
 
 static void lzipcache_destroy(struct lzipcache *zc)
 {
-    struct lzipindex *zi;
-    struct lzipindex *nextzi;
-
-    for(zi = zc->indexes; zi != NULL; zi = nextzi) {
-        nextzi = zi->next;
-        av_free(zi);
-    }
+    av_pagecache_forget(zc->id);
+    av_seekindex_free(&zc->indexes);
 }
 
 struct lzipcache *av_lzipcache_new()
@@ -425,8 +422,9 @@ struct lzipcache *av_lzipcache_new()
     AV_NEW_OBJ(zc, lzipcache_destroy);
     zc->size = -1;
     zc->cachesize = 0;
-    zc->indexes = NULL;
+    av_seekindex_init(&zc->indexes, sizeof(struct lzipindex));
     zc->nextindex = INDEXDISTANCE;
+    zc->id = av_streamcache_newid();
 
     return zc;
 }
@@ -36,10 +36,19 @@ struct list_head {
     struct list_head *prev;
 };
 
+/* Array of the children in list order, built when a directory is first
+   listed by position, and kept up to date on addition */
+struct childindex {
+    struct entry **ents;
+    unsigned int num;
+    unsigned int alloc;
+};
+
 struct entry {
     char *name;
     int flags;
     struct list_head subdir;
+    struct childindex index;
     struct list_head child;
     struct list_head hash;
     struct entry *parent;
@@ -49,6 +58,7 @@ struct entry {
 
 struct namespace {
     struct list_head root;
+    struct childindex rootindex;
     unsigned int hashsize;
     unsigned int numentries;
     struct list_head *hashtab;
@@ -79,6 +89,49 @@ static void list_add(struct list_head *entry, struct list_head *head)
     next->prev = entry;
 }
 
+static void index_add(struct childindex *idx, struct entry *ent)
+{
+    if(idx->ents == NULL)
+        return;
+
+    if(idx->num == idx->alloc) {
+        idx->alloc *= 2;
+        idx->ents = av_realloc(idx->ents, sizeof(*idx->ents) * idx->alloc);
+    }
+    idx->ents[idx->num++] = ent;
+}
+
+static void index_remove(struct childindex *idx, struct entry *ent)
+{
+    if(idx->ents == NULL)
+        return;
+
+    /* Entries created by a failed lookup are removed from the end
+       right away, anything else needs a rebuild */
+    if(idx->num != 0 && idx->ents[idx->num - 1] == ent)
+        idx->num--;
+    else {
+        av_free(idx->ents);
+        idx->ents = NULL;
+        idx->num = 0;
+        idx->alloc = 0;
+    }
+}
+
+static void index_build(struct childindex *idx, struct list_head *head)
+{
+    struct list_head *ptr;
+
+    idx->num = 0;
+    idx->alloc = 16;
+    for(ptr = head->next; ptr != head; ptr = ptr->next)
+        idx->alloc++;
+
+    idx->ents = av_malloc(sizeof(*idx->ents) * idx->alloc);
+    for(ptr = head->next; ptr != head; ptr = ptr->next)
+        idx->ents[idx->num++] = list_entry(ptr, struct entry, child);
+}
+
 static unsigned int spaced_primes_closest (unsigned int num)
 {
     static const unsigned int primes[] = { 
@@ -161,6 +214,7 @@ static void resize_hashtable(struct namespace *ns)
 
 static void namespace_delete(struct namespace *ns)
 {
+    av_free(ns->rootindex.ents);
     av_free(ns->hashtab);
 }
 
@@ -172,6 +226,9 @@ struct namespace *av_namespace_new()
 
     AV_NEW_OBJ(ns, namespace_delete);
     init_list_head(&ns->root);
+    ns->rootindex.ents = NULL;
+    ns->rootindex.num = 0;
+    ns->rootindex.alloc = 0;
     ns->numentries = 0;
     ns->hashsize = HASH_TABLE_MIN_SIZE;
     ns->hashtab = alloc_hash_table(ns->hashsize);
@@ -179,10 +236,20 @@ struct namespace *av_namespace_new()
     return ns;
 }
 
+static struct childindex *subdir_index(struct namespace *ns,
+                                       struct entry *ent)
+{
+    if(ent != NULL)
+	return &ent->index;
+    else
+	return &ns->rootindex;
+}
+
 /* remove the entry from internal list while holding the locked
  * so it cannot be looked up by a different thread */
 static void free_entry_locked(struct entry *ent)
 {
+    index_remove(subdir_index(ent->ns, ent->parent), ent);
     list_del(&ent->child);
     list_del(&ent->hash);
     ent->ns->numentries --;
@@ -192,6 +259,7 @@ static void free_entry_locked(struct entry *ent)
 /* this is the regular destructor called outside the lock */
 static void free_entry(struct entry *ent)
 {
+    av_free(ent->index.ents);
     av_free(ent->name);
     av_unref_obj(ent->parent);
     av_unref_obj(ent->ns);
@@ -236,7 +304,11 @@ static struct entry *lookup_name(struct namespace *ns, struct entry *parent,
     av_obj_set_destr_locked(ent,(void (*)(void *))  free_entry_locked);
 
     init_list_head(&ent->subdir);
+    ent->index.ents = NULL;
+    ent->index.num = 0;
+    ent->index.alloc = 0;
     list_add(&ent->child, subdir_head(ns, parent));
+    index_add(subdir_index(ns, parent), ent);
     list_add(&ent->hash, hashlist);
     ent->ns = ns;
     av_ref_obj(ent->ns);
@@ -402,22 +474,24 @@ struct entry *av_namespace_parent(struct entry *ent)
     return parent;
 }
 
+/* Constant time apart from the first call for a directory, so that
+   readdir can resume at any offset */
 struct entry *av_namespace_nth(struct namespace *ns, struct entry *parent,
 			       unsigned int n)
 {
-    struct list_head *ptr;
-    struct list_head *head;
+    struct childindex *idx;
     struct entry *ent = NULL;
 
+    if(parent != NULL)
+        ns = parent->ns;
+
     AV_LOCK(namespace_lock);
-    head = subdir_head(ns, parent);
-    for(ptr = head->next; ptr != head; ptr = ptr->next) {
-	if(n == 0) {
-	    ent = list_entry(ptr, struct entry, child);
-	    av_ref_obj(ent);
-	    break;
-	}
-	n--;
+    idx = subdir_index(ns, parent);
+    if(idx->ents == NULL)
+        index_build(idx, subdir_head(ns, parent));
+    if(n < idx->num) {
+        ent = idx->ents[n];
+        av_ref_obj(ent);
     }
     AV_UNLOCK(namespace_lock);
 
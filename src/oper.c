@@ -55,6 +55,10 @@ int av_file_open(vfile *vf, ventry *ve, int flags, avmode_t mode)
     vf->ptr = 0;
     vf->flags = flags;
 
+    /* a new file, or a changed archive, may resolve differently */
+    if((flags & AVO_CREAT) != 0)
+        av_dcache_invalidate();
+
     return 0;
 }
 
@@ -70,6 +74,9 @@ int av_file_close(vfile *vf)
     av_free_vmount(vf->mnt);
     vf->mnt = NULL;
 
+    if(AV_ISWRITE(vf->flags))
+        av_dcache_invalidate();
+
     return res;
 }
 
@@ -338,6 +345,14 @@ int av_getattr(ventry *ve, struct avstat *buf, int attrmask, int flags)
 {
     int res;
     vfile vf;
+    struct avfs *avfs = ve->mnt->avfs;
+
+    /* the module may know the attributes without opening the file */
+    AVFS_LOCK(avfs);
+    res = avfs->statent(ve, buf, attrmask, flags);
+    AVFS_UNLOCK(avfs);
+    if(res != -ENOSYS)
+        return res;
 
     res = av_file_open(&vf, ve, AVO_NOPERM | flags, 0);
     if(res == 0) {
@@ -478,6 +493,8 @@ int av_unlink(ventry *ve)
     res = avfs->unlink(ve);
     AVFS_UNLOCK(avfs);
 
+    av_dcache_invalidate();
+
     return res;
 }
 
@@ -489,6 +506,8 @@ int av_rmdir(ventry *ve)
     AVFS_LOCK(avfs);
     res = avfs->rmdir(ve);
     AVFS_UNLOCK(avfs);
+
+    av_dcache_invalidate();
     
     return res;
 }
@@ -501,6 +520,8 @@ int av_mkdir(ventry *ve, avmode_t mode)
     AVFS_LOCK(avfs);
     res = avfs->mkdir(ve, (mode & 07777));
     AVFS_UNLOCK(avfs);
+
+    av_dcache_invalidate();
     
     return res;
 }
@@ -513,6 +534,8 @@ int av_mknod(ventry *ve, avmode_t mode, avdev_t dev)
     AVFS_LOCK(avfs);
     res = avfs->mknod(ve, mode, dev);
     AVFS_UNLOCK(avfs);
+
+    av_dcache_invalidate();
     
     return res;
 }
@@ -525,6 +548,8 @@ int av_symlink(const char *path, ventry *newve)
     AVFS_LOCK(avfs);
     res = avfs->symlink(path, newve);
     AVFS_UNLOCK(avfs);
+
+    av_dcache_invalidate();
     
     return res;
 }
@@ -569,6 +594,7 @@ int av_rename(ventry *ve, ventry *newve)
         res = avfs->rename(ve, newve);
         AVFS_UNLOCK(avfs);
     }
+    av_dcache_invalidate();
     
     return res;
 }
@@ -585,6 +611,7 @@ int av_link(ventry *ve, ventry *newve)
         res = avfs->link(ve, newve);
         AVFS_UNLOCK(avfs);
     }
+    av_dcache_invalidate();
     
     return res;
 }
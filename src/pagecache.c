@@ -0,0 +1,365 @@
+/*
+    AVFS: A Virtual File System Library
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+/* pagecache.c
+
+   Cache of decompressed data for the compressed file readers.  Reads
+   go through fixed size pages, so small and overlapping reads of the
+   same region only run the decompressor once.  The pages are in one
+   LRU list, their memory counts towards the cache/limit of the disk
+   cache, and they have a limit of their own in cache/page_limit.
+*/
+
+#include "pagecache.h"
+#include "cache.h"
+#include "internal.h"
+#include "exit.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define PAGESIZE AV_PAGECACHE_PAGESIZE
+#define PAGECACHE_HASHSIZE 4093
+#define PAGECACHE_DEFAULT_LIMIT (64 * 1024 * 1024)
+
+struct page {
+    struct page *next;
+    struct page *prev;
+    struct page *hnext;
+
+    int id;
+    avoff_t offset;
+    avsize_t len;               /* less than PAGESIZE only at the end */
+    char *data;
+};
+
+static AV_LOCK_DECL(pagecache_lock);
+static struct page pagelist;
+static struct page *pagehash[PAGECACHE_HASHSIZE];
+static avoff_t pagecache_usage;
+static avoff_t pagecache_limit = PAGECACHE_DEFAULT_LIMIT;
+
+static unsigned int page_hash(int id, avoff_t offset)
+{
+    avuquad key = ((avuquad) id << 40) ^ (avuquad) (offset / PAGESIZE);
+
+    return (unsigned int) ((key * 0x9E3779B97F4A7C15ULL) >> 32) %
+        PAGECACHE_HASHSIZE;
+}
+
+static avoff_t page_cost(struct page *pg)
+{
+    return sizeof(*pg) + pg->len;
+}
+
+static struct page *page_find(int id, avoff_t offset)
+{
+    struct page *pg;
+
+    for(pg = pagehash[page_hash(id, offset)]; pg != NULL; pg = pg->hnext) {
+        if(pg->id == id && pg->offset == offset)
+            return pg;
+    }
+
+    return NULL;
+}
+
+static void page_insert(struct page *pg)
+{
+    struct page **bucket = &pagehash[page_hash(pg->id, pg->offset)];
+
+    pg->next = pagelist.next;
+    pg->prev = &pagelist;
+    pagelist.next->prev = pg;
+    pagelist.next = pg;
+
+    pg->hnext = *bucket;
+    *bucket = pg;
+
+    pagecache_usage += page_cost(pg);
+}
+
+static void page_remove(struct page *pg)
+{
+    struct page **pp;
+
+    pg->prev->next = pg->next;
+    pg->next->prev = pg->prev;
+
+    for(pp = &pagehash[page_hash(pg->id, pg->offset)]; *pp != NULL;
+        pp = &(*pp)->hnext) {
+        if(*pp == pg) {
+            *pp = pg->hnext;
+            break;
+        }
+    }
+
+    pagecache_usage -= page_cost(pg);
+}
+
+/* Free a list of removed pages linked through hnext */
+static void page_free_list(struct page *pg)
+{
+    avoff_t freed = 0;
+
+    while(pg != NULL) {
+        struct page *next = pg->hnext;
+
+        freed += page_cost(pg);
+        av_free(pg->data);
+        av_free(pg);
+        pg = next;
+    }
+
+    if(freed != 0)
+        av_cache_add_usage(-freed);
+}
+
+static int pagecache_shrink()
+{
+    struct page *pg = NULL;
+
+    AV_LOCK(pagecache_lock);
+    if(pagelist.prev != &pagelist) {
+        pg = pagelist.prev;
+        page_remove(pg);
+        pg->hnext = NULL;
+    }
+    AV_UNLOCK(pagecache_lock);
+
+    if(pg == NULL)
+        return 0;
+
+    page_free_list(pg);
+    return 1;
+}
+
+/* Copy from a cached page, returns -1 if the page is not cached */
+static avssize_t pagecache_copy(int id, avoff_t pageoff, char *buf,
+                                avsize_t nbyte, avsize_t pagepos,
+                                int *eofp)
+{
+    struct page *pg;
+    avssize_t res = -1;
+
+    AV_LOCK(pagecache_lock);
+    pg = page_find(id, pageoff);
+    if(pg != NULL) {
+        res = 0;
+        if(pagepos < pg->len) {
+            res = AV_MIN(nbyte, pg->len - pagepos);
+            memcpy(buf, pg->data + pagepos, res);
+        }
+        *eofp = (pg->len < PAGESIZE);
+
+        pg->prev->next = pg->next;
+        pg->next->prev = pg->prev;
+        pg->next = pagelist.next;
+        pg->prev = &pagelist;
+        pagelist.next->prev = pg;
+        pagelist.next = pg;
+    }
+    AV_UNLOCK(pagecache_lock);
+
+    return res;
+}
+
+static void pagecache_add(struct page *pg)
+{
+    struct page *evicted = NULL;
+    struct page *old;
+    avoff_t added = 0;
+
+    AV_LOCK(pagecache_lock);
+    if(page_find(pg->id, pg->offset) == NULL) {
+        page_insert(pg);
+        added = page_cost(pg);
+        pg = NULL;
+
+        while(pagecache_usage > pagecache_limit &&
+              pagelist.prev != pagelist.next) {
+            old = pagelist.prev;
+            page_remove(old);
+            old->hnext = evicted;
+            evicted = old;
+        }
+    }
+    AV_UNLOCK(pagecache_lock);
+
+    if(pg != NULL) {
+        /* already cached by someone else */
+        av_free(pg->data);
+        av_free(pg);
+    }
+    page_free_list(evicted);
+
+    if(added != 0)
+        av_cache_add_usage(added);
+}
+
+/* Decompress a page, and copy the wanted part of it */
+static avssize_t pagecache_fill(int id, pagecache_read_func readfn,
+                                void *fil, void *cache, avoff_t pageoff,
+                                char *buf, avsize_t nbyte, avsize_t pagepos,
+                                int *eofp)
+{
+    avssize_t res;
+    struct page *pg;
+    char *data;
+    avsize_t len = 0;
+
+    data = av_malloc(PAGESIZE);
+    while(len < PAGESIZE) {
+        res = readfn(fil, cache, data + len, PAGESIZE - len, pageoff + len);
+        if(res < 0) {
+            av_free(data);
+            return res;
+        }
+        if(res == 0)
+            break;
+        len += res;
+    }
+
+    *eofp = (len < PAGESIZE);
+    res = 0;
+    if(pagepos < len) {
+        res = AV_MIN(nbyte, len - pagepos);
+        memcpy(buf, data + pagepos, res);
+    }
+
+    if(len == 0) {
+        av_free(data);
+        return res;
+    }
+    if(len < PAGESIZE)
+        data = av_realloc(data, len);
+
+    AV_NEW(pg);
+    pg->id = id;
+    pg->offset = pageoff;
+    pg->len = len;
+    pg->data = data;
+    pagecache_add(pg);
+
+    return res;
+}
+
+avssize_t av_pagecache_pread(int id, pagecache_read_func readfn, void *fil,
+                             void *cache, char *buf, avsize_t nbyte,
+                             avoff_t offset)
+{
+    avssize_t res;
+    avsize_t nread = 0;
+
+    while(nread < nbyte) {
+        avoff_t curr = offset + nread;
+        avoff_t pageoff = curr - curr % PAGESIZE;
+        avsize_t pagepos = curr - pageoff;
+        int eof = 0;
+
+        res = pagecache_copy(id, pageoff, buf + nread, nbyte - nread,
+                             pagepos, &eof);
+        if(res < 0)
+            res = pagecache_fill(id, readfn, fil, cache, pageoff,
+                                 buf + nread, nbyte - nread, pagepos, &eof);
+        if(res < 0)
+            return res;
+
+        nread += res;
+        if(eof || res == 0)
+            break;
+    }
+
+    return nread;
+}
+
+void av_pagecache_forget(int id)
+{
+    struct page *pg;
+    struct page *next;
+    struct page *removed = NULL;
+
+    AV_LOCK(pagecache_lock);
+    for(pg = pagelist.next; pg != &pagelist; pg = next) {
+        next = pg->next;
+        if(pg->id == id) {
+            page_remove(pg);
+            pg->hnext = removed;
+            removed = pg;
+        }
+    }
+    AV_UNLOCK(pagecache_lock);
+
+    page_free_list(removed);
+}
+
+static int pagecache_over_limit()
+{
+    int over;
+
+    AV_LOCK(pagecache_lock);
+    over = (pagecache_usage > pagecache_limit);
+    AV_UNLOCK(pagecache_lock);
+
+    return over;
+}
+
+static void pagecache_destroy()
+{
+    while(pagecache_shrink());
+}
+
+static int pagecache_limit_get(struct entry *ent, const char *param,
+                               char **retp)
+{
+    char buf[64];
+
+    AV_LOCK(pagecache_lock);
+    sprintf(buf, "%lli\n", pagecache_limit);
+    AV_UNLOCK(pagecache_lock);
+
+    *retp = av_strdup(buf);
+    return 0;
+}
+
+static int pagecache_limit_set(struct entry *ent, const char *param,
+                               const char *val)
+{
+    avoff_t limit;
+    char *end;
+
+    limit = strtoll(val, &end, 0);
+    if(end == val || limit < 0)
+        return -EINVAL;
+    if(*end == '\n')
+        end++;
+    if(*end != '\0')
+        return -EINVAL;
+
+    AV_LOCK(pagecache_lock);
+    pagecache_limit = limit;
+    AV_UNLOCK(pagecache_lock);
+
+    while(pagecache_over_limit() && pagecache_shrink());
+
+    return 0;
+}
+
+void av_init_pagecache()
+{
+    struct statefile statf;
+
+    pagelist.next = &pagelist;
+    pagelist.prev = &pagelist;
+
+    statf.data = NULL;
+    statf.get = pagecache_limit_get;
+    statf.set = pagecache_limit_set;
+    av_avfsstat_register("cache/page_limit", &statf);
+
+    av_cache_add_shrinker(pagecache_shrink);
+    av_add_exithandler(pagecache_destroy);
+}
@@ -45,6 +45,8 @@ struct parse_state {
     int nextseg;
     int linkctr;
     int first_seg;  /* true if no segment was analysed, see segment_len() comment */
+    char *cachebase; /* start of the path if prefixes may be cached */
+    int cachegen;
 };
 
 static int copyrightstat_get(struct entry *ent, const char *param, char **retp)
@@ -232,7 +234,9 @@ static int init()
             av_init_logstat();
             init_stats();
             av_init_cache();
+            av_init_pagecache();
             av_init_filecache();
+            av_init_dcache();
             atexit(destroy);
             inited = 1;
             av_log(AVLOG_DEBUG, "INIT successful");
@@ -272,6 +276,7 @@ static int av_copy_parsestate(struct parse_state *ps, struct parse_state *destps
       destps->path = NULL;
 
     destps->first_seg = ps->first_seg;
+    destps->cachebase = NULL;
 
     if(ps->prevseg)
       destps->prevseg = av_strdup(ps->prevseg);
@@ -324,7 +329,7 @@ static struct avmount *new_mount(ventry *base, struct avfs *avfs,
 {
     struct avmount *mnt;
 
-    AV_NEW(mnt);
+    AV_NEW_FIXED(mnt);
 
     mnt->base = base;
     mnt->avfs = avfs;
@@ -369,7 +374,7 @@ static int enter_mount(struct parse_state *ps, struct avfs *avfs,
     int res;
     ventry *newve;
     
-    AV_NEW(newve);
+    AV_NEW_FIXED(newve);
 
     newve->mnt = new_mount(ps->ve, avfs, opts);
     newve->data = NULL;
@@ -728,6 +733,7 @@ static int follow_link(struct parse_state *ps)
     linkps.path = buf;
     linkps.resolvelast = 1;
     linkps.linkctr = ps->linkctr - 1;
+    linkps.cachebase = NULL;
 
     if(buf[0] != AV_DIR_SEP_CHAR) {
         linkps.ve = ps->ve;
@@ -739,7 +745,7 @@ static int follow_link(struct parse_state *ps)
     else {
         av_free_ventry(ps->ve);
 
-        AV_NEW(linkps.ve);
+        AV_NEW_FIXED(linkps.ve);
         linkps.ve->mnt = new_mount(NULL, get_local_avfs(), NULL);
         linkps.ve->data = av_strdup("");
 
@@ -753,13 +759,11 @@ static int follow_link(struct parse_state *ps)
     return res;
 }
 
-static int parse_path(struct parse_state *ps, int force_localfile)
+static int parse_segments(struct parse_state *ps, int force_localfile)
 {
     int res = 0;
     int numseg = 0;
 
-    ps->prevseg = av_strdup("");
-    ps->first_seg = 1;
     while(ps->path[0]) {
         unsigned int seglen;
         int lastseg;
@@ -768,6 +772,15 @@ static int parse_path(struct parse_state *ps, int force_localfile)
 	seglen = segment_len(ps, force_localfile);
 	
         lastseg = is_last(ps, seglen);
+
+        /* remember where the last segment starts, so lookups of its
+           siblings can continue from here */
+        if(lastseg && ps->cachebase != NULL && !force_localfile &&
+           ps->path[0] == AV_DIR_SEP_CHAR && ps->path != ps->cachebase)
+            av_dcache_set_prefix(ps->cachebase, ps->path - ps->cachebase,
+                                 ps->ve, ps->prevseg, ps->first_seg,
+                                 ps->cachegen);
+
         ps->nextseg = seglen;
         c = ps->path[seglen];
         ps->path[seglen] = '\0';
@@ -798,11 +811,47 @@ static int parse_path(struct parse_state *ps, int force_localfile)
     return res;
 }
 
+static int parse_path(struct parse_state *ps, int force_localfile)
+{
+    ps->prevseg = av_strdup("");
+    ps->first_seg = 1;
+
+    return parse_segments(ps, force_localfile);
+}
+
+/* Continue from the cached state of the path up to its last segment */
+static int parse_cached_prefix(struct parse_state *ps, int *resp)
+{
+    char *path = ps->path;
+    int len;
+
+    if(path[0] != AV_DIR_SEP_CHAR)
+        return 0;
+
+    for(len = strlen(path); len > 0 && path[len - 1] == AV_DIR_SEP_CHAR;
+        len--);
+    for(; len > 0 && path[len - 1] != AV_DIR_SEP_CHAR; len--);
+    len--;
+    if(len <= 0)
+        return 0;
+
+    if(!av_dcache_get_prefix(path, len, &ps->ve, &ps->prevseg,
+                             &ps->first_seg))
+        return 0;
+
+    ps->path += len;
+    *resp = parse_segments(ps, 0);
+
+    return 1;
+}
+
 int av_get_ventry(const char *path, int resolvelast, ventry **resp)
 {
     int res;
     struct parse_state ps;
     char *copypath;
+    int cacheable;
+    int gen = 0;
 
     res = init();
     if(res < 0)
@@ -811,16 +860,31 @@ int av_get_ventry(const char *path, int resolvelast, ventry **resp)
     if(path == NULL)
         return -ENOENT;
 
+    /* relative paths depend on the working directory */
+    cacheable = (path[0] == AV_DIR_SEP_CHAR);
+    if(cacheable) {
+        gen = av_dcache_generation();
+        res = av_dcache_get_negative(path, resolvelast);
+        if(res < 0) {
+            *resp = NULL;
+            return res;
+        }
+    }
+
     copypath = av_strdup(path);
     ps.path = copypath;
     ps.resolvelast = resolvelast;
     ps.linkctr = 10;
+    ps.cachebase = cacheable ? copypath : NULL;
+    ps.cachegen = gen;
 
-    AV_NEW(ps.ve);
-    ps.ve->mnt = new_mount(NULL, get_local_avfs(), NULL);
-    ps.ve->data = av_strdup("");
+    if(!cacheable || !parse_cached_prefix(&ps, &res)) {
+        AV_NEW_FIXED(ps.ve);
+        ps.ve->mnt = new_mount(NULL, get_local_avfs(), NULL);
+        ps.ve->data = av_strdup("");
 
-    res = parse_path(&ps, 0);
+        res = parse_path(&ps, 0);
+    }
 
     /* no ventry so force localfile to be able to create files with
        the magic character inside filename */
@@ -831,7 +895,8 @@ int av_get_ventry(const char *path, int resolvelast, ventry **resp)
         ps.path = copypath;
         ps.resolvelast = resolvelast;
         ps.linkctr = 10;
-        AV_NEW(ps.ve);
+        ps.cachebase = NULL;
+        AV_NEW_FIXED(ps.ve);
         ps.ve->mnt = new_mount(NULL, get_local_avfs(), NULL);
         ps.ve->data = av_strdup("");
         res = parse_path(&ps, 1);
@@ -840,6 +905,8 @@ int av_get_ventry(const char *path, int resolvelast, ventry **resp)
     if(res < 0) {
         av_free_ventry(ps.ve);
         *resp = NULL;
+        if(cacheable)
+            av_dcache_set_negative(path, resolvelast, res, gen);
     }
     else
         *resp = ps.ve;
@@ -891,7 +958,7 @@ int av_copy_ventry(ventry *ve, ventry **resp)
     else
 	newdata = NULL;
     
-    AV_NEW(newve);
+    AV_NEW_FIXED(newve);
     
     newve->data = newdata;
     newve->mnt = newmnt;
@@ -907,7 +974,7 @@ void av_free_vmount(struct avmount *mnt)
 
     av_free(mnt->opts);
     av_free_ventry(mnt->base);
-    av_free(mnt);
+    AV_FREE_FIXED(mnt);
 }
 
 void av_free_ventry(ventry *ve)
@@ -922,7 +989,7 @@ void av_free_ventry(ventry *ve)
         }
 
         av_free_vmount(ve->mnt);
-        av_free(ve);
+        AV_FREE_FIXED(ve);
     }
 }
 
@@ -9,12 +9,21 @@
 #include "realfile.h"
 #include "oper.h"
 #include "cache.h"
+#include "tmpfile.h"
 
 #include <unistd.h>
 #include <fcntl.h>
 
 #define COPY_BUFSIZE 16384
 
+/* Copies of virtual files are kept in the cache under their path, and
+   are used as long as the attributes of the file match. */
+
+struct realfilecopy {
+    struct avstat sig;
+    struct realfile *rf;
+};
+
 static int copy_file(ventry *ve, const char *destpath)
 {
     int res;
@@ -78,7 +87,22 @@ static void realfile_delete(struct realfile *rf)
         av_del_tmpfile(rf->name);
 }
 
-int av_get_realfile(ventry *ve, struct realfile **resp)
+static void realfilecopy_delete(struct realfilecopy *rc)
+{
+    av_unref_obj(rc->rf);
+}
+
+int av_realfile_same(struct avstat *sig, struct avstat *stbuf)
+{
+    if(sig->ino == stbuf->ino &&
+       sig->dev == stbuf->dev &&
+       AV_TIME_EQ(sig->mtime, stbuf->mtime))
+        return 1;
+    else
+        return 0;
+}
+
+static int realfile_copy(ventry *ve, struct realfile **resp)
 {
     int res;
     struct realfile *rf;
@@ -87,14 +111,6 @@ int av_get_realfile(ventry *ve, struct realfile **resp)
     rf->is_tmp = 0;
     rf->name = NULL;
 
-    if(ve->mnt->base == NULL) {
-        rf->name = av_strdup((char *) ve->data);
-        rf->is_tmp = 0;
-
-        *resp = rf;
-        return 0;
-    }
-
     res = av_get_tmpfile(&rf->name);
     if(res < 0) {
         av_unref_obj(rf);
@@ -113,3 +129,70 @@ int av_get_realfile(ventry *ve, struct realfile **resp)
     return 0;
 }
 
+int av_get_realfile(ventry *ve, struct realfile **resp)
+{
+    int res;
+    struct realfile *rf;
+    struct realfilecopy *rc;
+    struct avstat sig;
+    avoff_t size;
+    char *key;
+
+    if(ve->mnt->base == NULL) {
+        AV_NEW_OBJ(rf, realfile_delete);
+        rf->name = av_strdup((char *) ve->data);
+        rf->is_tmp = 0;
+
+        *resp = rf;
+        return 0;
+    }
+
+    res = av_getattr(ve, &sig, REALFILE_SIGMASK, 0);
+    if(res < 0)
+        return res;
+
+    res = av_generate_path(ve, &key);
+    if(res < 0)
+        return res;
+
+    key = av_stradd(key, "(realfile)", NULL);
+
+    rc = (struct realfilecopy *) av_cache2_get(key);
+    if(rc != NULL && !av_realfile_same(&rc->sig, &sig)) {
+        av_unref_obj(rc);
+        rc = NULL;
+    }
+
+    if(rc == NULL) {
+        res = realfile_copy(ve, &rf);
+        if(res < 0) {
+            av_free(key);
+            return res;
+        }
+
+        /* A copy taking more than half of the cache would only push
+           everything else out of it, and then itself */
+        size = av_tmpfile_blksize(rf->name);
+        if(size > av_cache_limit() / 2) {
+            av_free(key);
+            *resp = rf;
+            return 0;
+        }
+
+        AV_NEW_OBJ(rc, realfilecopy_delete);
+        rc->sig = sig;
+        rc->rf = rf;
+
+        av_cache2_set(rc, key);
+        if(size > 0)
+            av_cache2_setsize(key, size);
+    }
+    av_free(key);
+
+    *resp = rc->rf;
+    av_ref_obj(rc->rf);
+    av_unref_obj(rc);
+
+    return 0;
+}
+
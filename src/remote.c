@@ -13,11 +13,22 @@
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/stat.h>
 
 #define REM_ST_VALID 20
 #define REM_DIR_VALID 10
 
+/* Transfers are driven by a thread of their own, which keeps up to
+   REM_READAHEAD bytes ahead of the readers, pulling REM_XFER_CHUNK at
+   a time.  It stops when the readers don't move on for REM_XFER_IDLE
+   seconds, and there are at most REM_HOST_XFERS threads per host. */
+#define REM_READAHEAD (16 * 1024 * 1024)
+#define REM_XFER_CHUNK (256 * 1024)
+#define REM_XFER_IDLE 30
+#define REM_HOST_XFERS 4
+
 struct remsig {
     avtimestruc_t modif;
     avoff_t size;
@@ -26,12 +37,15 @@ struct remsig {
 struct rementry {
     char *name;
     int type;
-    struct rementry *next;
 };
 
+/* The entries are kept in an array, so that readdir can continue from
+   any offset without walking the list */
 struct remdir {
     avtime_t valid;
-    struct rementry *dirlist;
+    struct rementry *ents;
+    int num;
+    int alloc;
 };
 
 struct remattr {
@@ -41,10 +55,27 @@ struct remattr {
     char *linkname;
 };
 
+/* While the file is downloaded, data is the remote's transfer state,
+   avail is the size known to be in the local file and want is how far
+   the readers need it.  These are protected by the xferlock of the
+   filesystem, waitlock is held while waiting for the transfer. */
 struct remfile {
     struct remsig sig;
     char *localname;
+    char *host;
+    int fd;
+    avmutex waitlock;
+    avoff_t avail;
+    avoff_t want;
+    int error;
     void *data;
+
+    /* while a transfer thread runs */
+    int thread;
+    struct remfs *fs;
+    struct remnode *nod;
+    struct remfile *xnext;
+    struct remfile *xprev;
 };
 
 struct remnode {
@@ -64,19 +95,27 @@ struct remfs {
     struct remnode list;
     struct remote *rem;
     struct avfs *avfs;
+
+    avmutex xferlock;
+    pthread_cond_t xfercond;
+    struct remfile xfers;
+    int numthreads;
+    int stopping;
 };
 
 static AV_LOCK_DECL(rem_lock);
 
 static void rem_free_dir(struct remdir *dir)
 {
-    struct rementry *re;
-    
-    while((re = dir->dirlist) != NULL) {
-        dir->dirlist = re->next;
-        av_free(re->name);
-        av_free(re);
-    }
+    int i;
+
+    for(i = 0; i < dir->num; i++)
+        av_free(dir->ents[i].name);
+
+    av_free(dir->ents);
+    dir->ents = NULL;
+    dir->num = 0;
+    dir->alloc = 0;
 }
 
 static void rem_free_node(struct remnode *nod)
@@ -102,6 +141,9 @@ static struct remnode *rem_new_node(struct remfs *fs)
     nod->attr.valid = 0;
     nod->attr.linkname = NULL;
     nod->dir.valid = 0;
+    nod->dir.ents = NULL;
+    nod->dir.num = 0;
+    nod->dir.alloc = 0;
     nod->file = NULL;
 
     return nod;
@@ -253,31 +295,34 @@ static int rem_list_single(struct remfs *fs, struct remnode *nod,
     return -ENOENT;
 }
 
+static struct rementry *rem_dir_grow(struct remdir *dir)
+{
+    if(dir->num == dir->alloc) {
+        dir->alloc = dir->alloc ? dir->alloc * 2 : 16;
+        dir->ents = av_realloc(dir->ents,
+                               sizeof(*dir->ents) * dir->alloc);
+    }
+
+    return &dir->ents[dir->num++];
+}
+
 static void rem_dir_add(struct remdir *dir, struct remdirent *de)
 {
-    struct rementry **rep;
-    struct rementry *re;
-    
-    for(rep = &dir->dirlist; *rep != NULL; rep = &(*rep)->next);
-    
-    AV_NEW(re);
+    struct rementry *re = rem_dir_grow(dir);
+
     re->name = av_strdup(de->name);
     re->type = AV_TYPE(de->attr.mode);
-    re->next = NULL;
-    
-    *rep = re;
 }
 
 static void rem_dir_add_beg(struct remdir *dir, const char *name, int type)
 {
     struct rementry *re;
 
-    AV_NEW(re);
+    rem_dir_grow(dir);
+    re = dir->ents;
+    memmove(re + 1, re, sizeof(*re) * (dir->num - 1));
     re->name = av_strdup(name);
     re->type = type;
-    re->next = dir->dirlist;
-
-    dir->dirlist = re;
 }
 
 static int rem_list_dir(struct remfs *fs, struct remnode *nod,
@@ -638,16 +683,12 @@ static struct entry *rem_dirent_lookup(struct namespace *ns,
     return ent;
 }
 
-static struct rementry *rem_nth_entry(struct remdir *dir, int n)
+static struct rementry *rem_nth_entry(struct remdir *dir, avoff_t n)
 {
-    struct rementry *re;
-    int i;
+    if(n < 0 || n >= dir->num)
+        return NULL;
 
-    re = dir->dirlist;
-    for(i = 0; i < n && re != NULL; i++)
-        re = re->next;
-    
-    return re;
+    return &dir->ents[n];
 }
 
 static int rem_get_direntry(struct remfs *fs, struct remnode *nod,
@@ -722,8 +763,12 @@ static void rem_get_signature(struct remfs *fs, struct entry *ent,
 
 static void rem_delete_file(struct remfile *fil)
 {
+    if(fil->fd != -1)
+        close(fil->fd);
     av_del_tmpfile(fil->localname);
     av_unref_obj(fil->data);
+    av_free(fil->host);
+    AV_FREELOCK(fil->waitlock);
 }
 
 static avoff_t rem_local_size(const char *localname)
@@ -744,6 +789,195 @@ static avoff_t rem_local_size(const char *localname)
     
 }
 
+/* Refresh avail from the local file, the transfer appends to it */
+static int rem_data_ready(struct remfile *fil, avoff_t end)
+{
+    struct stat stbuf;
+
+    if(fil->data == NULL || end <= fil->avail)
+        return 1;
+
+    if(fstat(fil->fd, &stbuf) == 0)
+        fil->avail = AV_MAX(fil->avail, stbuf.st_size);
+
+    return end <= fil->avail;
+}
+
+/* Account the size of the local copy, if the node still has this file */
+static void rem_set_file_size(struct remnode *nod, struct remfile *fil)
+{
+    struct remfile *cur;
+
+    AV_LOCK(nod->filelock);
+    cur = (struct remfile *) av_cacheobj_get(nod->file);
+    if(cur == fil)
+        av_cacheobj_setsize(nod->file, rem_local_size(fil->localname));
+    av_unref_obj(cur);
+    AV_UNLOCK(nod->filelock);
+}
+
+/* Let the transfer continue until end, returns 0 if it is finished */
+static int rem_pull_data(struct remfs *fs, struct remfile *fil, avoff_t end)
+{
+    int res;
+    void *data;
+    void *done = NULL;
+    struct remote *rem = fs->rem;
+
+    AV_LOCK(fil->waitlock);
+    AV_LOCK(fs->xferlock);
+    data = fil->data;
+    res = fil->error;
+    AV_UNLOCK(fs->xferlock);
+
+    if(res == 0 && data != NULL) {
+        res = rem->wait(rem, data, end);
+
+        AV_LOCK(fs->xferlock);
+        if(res < 0)
+            fil->error = res;
+        else if(res == 0) {
+            done = fil->data;
+            fil->data = NULL;
+        }
+        rem_data_ready(fil, end);
+        pthread_cond_broadcast(&fs->xfercond);
+        AV_UNLOCK(fs->xferlock);
+    }
+    AV_UNLOCK(fil->waitlock);
+
+    av_unref_obj(done);
+
+    return res;
+}
+
+static void *rem_xfer_thread(void *arg)
+{
+    int res = 1;
+    struct remfile *fil = (struct remfile *) arg;
+    struct remfs *fs = fil->fs;
+    struct remnode *nod = fil->nod;
+    struct timespec deadline;
+    avoff_t end;
+
+    AV_LOCK(fs->xferlock);
+    while(res > 0 && !fs->stopping) {
+        if(fil->avail < fil->want + REM_READAHEAD) {
+            end = fil->avail + REM_XFER_CHUNK;
+            AV_UNLOCK(fs->xferlock);
+            res = rem_pull_data(fs, fil, end);
+            AV_LOCK(fs->xferlock);
+            continue;
+        }
+
+        /* the window is full, wait for the readers to move on */
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += REM_XFER_IDLE;
+        res = pthread_cond_timedwait(&fs->xfercond, &fs->xferlock, &deadline);
+        res = (res == ETIMEDOUT && fil->avail >= fil->want + REM_READAHEAD) ?
+            -ETIMEDOUT : 1;
+    }
+    fil->thread = 0;
+    fil->xnext->xprev = fil->xprev;
+    fil->xprev->xnext = fil->xnext;
+    pthread_cond_broadcast(&fs->xfercond);
+    AV_UNLOCK(fs->xferlock);
+
+    if(res == 0)
+        rem_set_file_size(nod, fil);
+    av_unref_obj(fil);
+    av_unref_obj(nod);
+
+    AV_LOCK(fs->xferlock);
+    fs->numthreads--;
+    pthread_cond_broadcast(&fs->xfercond);
+    AV_UNLOCK(fs->xferlock);
+
+    return NULL;
+}
+
+/* Start a thread driving the transfer of the file, unless there are
+   already enough of them for the host.  Called with xferlock held. */
+static void rem_start_xfer(struct remfs *fs, struct remnode *nod,
+                           struct remfile *fil)
+{
+    int num = 0;
+    struct remfile *f;
+    pthread_t thread;
+    pthread_attr_t attr;
+
+    if(fil->thread || fil->data == NULL || fil->error || fs->stopping)
+        return;
+
+    for(f = fs->xfers.xnext; f != &fs->xfers; f = f->xnext) {
+        if(strcmp(f->host, fil->host) == 0)
+            num++;
+    }
+    if(num >= REM_HOST_XFERS)
+        return;
+
+    fil->fs = fs;
+    fil->nod = nod;
+    av_ref_obj(fil);
+    av_ref_obj(nod);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if(pthread_create(&thread, &attr, rem_xfer_thread, fil) != 0) {
+        av_log(AVLOG_WARNING, "%s: could not start transfer thread",
+               fs->rem->name);
+        pthread_attr_destroy(&attr);
+        av_unref_obj(fil);
+        av_unref_obj(nod);
+        return;
+    }
+    pthread_attr_destroy(&attr);
+
+    fil->thread = 1;
+    fil->xnext = &fs->xfers;
+    fil->xprev = fs->xfers.xprev;
+    fs->xfers.xprev->xnext = fil;
+    fs->xfers.xprev = fil;
+    fs->numthreads++;
+}
+
+/* Wait until the file has data up to end.  If a thread drives the
+   transfer, only tell it how far to go, otherwise drive it here. */
+static int rem_wait_data(struct remfs *fs, struct remnode *nod,
+                         struct remfile *fil, avoff_t end)
+{
+    int res = 0;
+
+    AV_LOCK(fs->xferlock);
+    while(!rem_data_ready(fil, end)) {
+        res = fil->error;
+        if(res < 0)
+            break;
+
+        rem_start_xfer(fs, nod, fil);
+        if(fil->thread) {
+            if(end > fil->want) {
+                fil->want = end;
+                pthread_cond_broadcast(&fs->xfercond);
+            }
+            pthread_cond_wait(&fs->xfercond, &fs->xferlock);
+            continue;
+        }
+
+        AV_UNLOCK(fs->xferlock);
+        res = rem_pull_data(fs, fil, end);
+        if(res == 0)
+            rem_set_file_size(nod, fil);
+        AV_LOCK(fs->xferlock);
+        if(res < 0)
+            break;
+        res = 0;
+    }
+    AV_UNLOCK(fs->xferlock);
+
+    return res;
+}
+
 static int rem_get_file(struct remfs *fs, struct remnode *nod,
                         struct remfile **resp)
 {
@@ -767,17 +1001,33 @@ static int rem_get_file(struct remfs *fs, struct remnode *nod,
         res = rem->get(rem, &gp);
     else
         res = -ENOENT;
-    av_free(gp.hostpath.host);
     av_free(gp.hostpath.path);
 
     if(res < 0) {
+        av_free(gp.hostpath.host);
         av_free(objname);
         return res;
     }
 
     AV_NEW_OBJ(fil, rem_delete_file);
+    AV_INITLOCK(fil->waitlock);
     fil->localname = gp.localname;
+    fil->host = gp.hostpath.host;
     fil->data = gp.data;
+    fil->avail = 0;
+    fil->want = 0;
+    fil->error = 0;
+    fil->thread = 0;
+    fil->fd = open(fil->localname, O_RDONLY);
+    if(fil->fd == -1) {
+        res = -errno;
+        av_log(AVLOG_ERROR, "Error opening file %s: %s", fil->localname,
+               strerror(errno));
+        av_unref_obj(fil);
+        av_free(objname);
+        return res;
+    }
+    av_registerfd(fil->fd);
     rem_get_signature(fs, nod->ent, &fil->sig);
 
     av_unref_obj(nod->file);
@@ -787,55 +1037,41 @@ static int rem_get_file(struct remfs *fs, struct remnode *nod,
     if(res == 0)
         av_cacheobj_setsize(nod->file, rem_local_size(fil->localname));
 
+    AV_LOCK(fs->xferlock);
+    rem_start_xfer(fs, nod, fil);
+    AV_UNLOCK(fs->xferlock);
+
     *resp = fil;
 
     return 0;
 }
 
-static int rem_wait_data(struct remfs *fs, struct remnode *nod,
-                         struct remfile *fil, avoff_t end)
+/* Forget the file after an error, unless another reader has already
+   replaced it */
+static void rem_drop_file(struct remnode *nod, struct remfile *fil)
 {
-    int res;
-    struct remote *rem = fs->rem;
-    
-    if(fil->data == NULL)
-        return 0;
-
-    res = rem->wait(rem, fil->data, end);
-    if(res < 0)
-        return res;
+    struct remfile *cur;
 
-    if(res == 0) {
-        av_unref_obj(fil->data);
-        fil->data = NULL;
-        av_cacheobj_setsize(nod->file, rem_local_size(fil->localname));
+    AV_LOCK(nod->filelock);
+    cur = (struct remfile *) av_cacheobj_get(nod->file);
+    if(cur == fil) {
+        av_unref_obj(nod->file);
+        nod->file = NULL;
     }
-
-    return 0;
+    av_unref_obj(cur);
+    AV_UNLOCK(nod->filelock);
 }
 
 static avssize_t rem_real_read(struct remfile *fil, vfile *vf, char *buf,
                                avsize_t nbyte)
 {
     avssize_t res;
-    avoff_t sres;
-    int fd;
 
-    fd = open(fil->localname, O_RDONLY);
-    if(fd == -1)
+    res = pread(fil->fd, buf, nbyte, vf->ptr);
+    if(res == -1)
         return -errno;
-    
-    sres = lseek(fd, vf->ptr, SEEK_SET);
-    if(sres == -1)
-        res = -errno;
-    else {
-	res = read(fd, buf, nbyte);
-        if(res == -1)
-            res = -errno;
-        else 
-            vf->ptr += res;
-    }
-    close(fd);
+
+    vf->ptr += res;
 
     return res;
 }
@@ -851,18 +1087,18 @@ static avssize_t rem_read(vfile *vf, char *buf, avsize_t nbyte)
     nod = rem_get_node(fs, ent);
     AV_LOCK(nod->filelock);
     res = rem_get_file(fs, nod, &fil);
+    AV_UNLOCK(nod->filelock);
     if(res == 0) {
+        /* the file lock is not held while waiting for the network, so
+           readers of the part already downloaded need not wait */
         res = rem_wait_data(fs, nod, fil, vf->ptr + nbyte);
         if(res == 0)
             res = rem_real_read(fil, vf, buf, nbyte);
 
-        if(res < 0) {
-            av_unref_obj(nod->file);
-            nod->file = NULL;
-        }
+        if(res < 0)
+            rem_drop_file(nod, fil);
         av_unref_obj(fil);
     }
-    AV_UNLOCK(nod->filelock);
     av_unref_obj(nod);
 
     return res;
@@ -947,6 +1183,13 @@ static void rem_destroy(struct avfs *avfs)
     struct remnode *nod;
     struct entry *root;
 
+    AV_LOCK(fs->xferlock);
+    fs->stopping = 1;
+    pthread_cond_broadcast(&fs->xfercond);
+    while(fs->numthreads > 0)
+        pthread_cond_wait(&fs->xfercond, &fs->xferlock);
+    AV_UNLOCK(fs->xferlock);
+
     AV_LOCK(rem_lock);
     nod = fs->list.next;
     while(nod != &fs->list) {
@@ -965,6 +1208,8 @@ static void rem_destroy(struct avfs *avfs)
     av_unref_obj(fs->ns);
 
     rem->destroy(rem);
+    AV_FREELOCK(fs->xferlock);
+    pthread_cond_destroy(&fs->xfercond);
     av_free(fs);
 }
 
@@ -1002,6 +1247,11 @@ int av_remote_init(struct vmodule *module, struct remote *rem,
     fs->list.next = fs->list.prev = &fs->list;
     fs->rem = rem;
     fs->avfs = avfs;
+    AV_INITLOCK(fs->xferlock);
+    pthread_cond_init(&fs->xfercond, NULL);
+    fs->xfers.xnext = fs->xfers.xprev = &fs->xfers;
+    fs->numthreads = 0;
+    fs->stopping = 0;
 
     avfs->data = fs;
     avfs->destroy = rem_destroy;
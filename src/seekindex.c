@@ -0,0 +1,117 @@
+/*
+    AVFS: A Virtual File System Library
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+/* seekindex.c
+
+   Sorted checkpoint tables for the compressed file readers.  Lookups
+   are binary searches, and as checkpoints are normally added in
+   increasing order, adding one is an append to a geometrically grown
+   array.
+*/
+
+#include "seekindex.h"
+
+#define SEEKINDEX_MIN_ALLOC 16
+
+static avoff_t seekindex_key(struct seekindex *si, unsigned int n)
+{
+    return *(avoff_t *) (si->ents + n * si->entsize);
+}
+
+void av_seekindex_init(struct seekindex *si, avsize_t entsize)
+{
+    si->ents = NULL;
+    si->entsize = entsize;
+    si->num = 0;
+    si->alloc = 0;
+}
+
+void av_seekindex_free(struct seekindex *si)
+{
+    av_free(si->ents);
+    si->ents = NULL;
+    si->num = 0;
+    si->alloc = 0;
+}
+
+void *av_seekindex_get(struct seekindex *si, unsigned int n)
+{
+    if(n >= si->num)
+        return NULL;
+
+    return si->ents + n * si->entsize;
+}
+
+/* Position of the last entry at or before offset, or -1 */
+int av_seekindex_lookup(struct seekindex *si, avoff_t offset)
+{
+    unsigned int lo = 0;
+    unsigned int hi = si->num;
+
+    /* first entry after offset */
+    while(lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+
+        if(seekindex_key(si, mid) <= offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return (int) lo - 1;
+}
+
+void *av_seekindex_find(struct seekindex *si, avoff_t offset)
+{
+    int n = av_seekindex_lookup(si, offset);
+
+    if(n < 0)
+        return NULL;
+
+    return si->ents + n * si->entsize;
+}
+
+/* Add a zeroed entry for offset and return it, or NULL if there is
+   already one */
+void *av_seekindex_add(struct seekindex *si, avoff_t offset)
+{
+    int n;
+    char *ent;
+
+    if(si->num == 0 || seekindex_key(si, si->num - 1) < offset)
+        n = si->num;
+    else {
+        n = av_seekindex_lookup(si, offset);
+        if(n >= 0 && seekindex_key(si, n) == offset)
+            return NULL;
+        n++;
+    }
+
+    if(si->num == si->alloc) {
+        si->alloc = si->alloc ? si->alloc * 2 : SEEKINDEX_MIN_ALLOC;
+        si->ents = av_realloc(si->ents, si->alloc * si->entsize);
+    }
+
+    ent = si->ents + n * si->entsize;
+    memmove(ent + si->entsize, ent, (si->num - n) * si->entsize);
+    memset(ent, 0, si->entsize);
+    *(avoff_t *) ent = offset;
+    si->num++;
+
+    return ent;
+}
+
+void av_seekindex_del(struct seekindex *si, unsigned int n)
+{
+    char *ent;
+
+    if(n >= si->num)
+        return;
+
+    ent = si->ents + n * si->entsize;
+    memmove(ent, ent + si->entsize, (si->num - n - 1) * si->entsize);
+    si->num--;
+}
@@ -12,12 +12,27 @@
 #endif
 
 #include "serialfile.h"
+#include "seekindex.h"
 #include "cache.h"
 
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
 
+/* Serial sources skip to the offset read in chunks of this size */
+#define SFILE_SKIPSIZE (128 * 1024)
+
+/* Sources with a fetch function are read in aligned chunks of at least
+   SFILE_FETCHSIZE, and sequential reads fetch SFILE_READAHEAD at once */
+#define SFILE_FETCHSIZE (64 * 1024)
+#define SFILE_READAHEAD (1024 * 1024)
+
+/* A cached range of a fetched file */
+struct sfextent {
+    avoff_t start;
+    avoff_t end;
+};
+
 struct sfile {
     const struct sfilefuncs *func;
     void *data;
@@ -28,6 +43,10 @@ struct sfile {
     int fd;
     int dirty;
     enum { SF_BEGIN, SF_READ, SF_FINI } state;
+    int fetch;
+    avoff_t size;
+    avoff_t nextoff;
+    struct seekindex extents;
 };
 
 static void sfile_init(struct sfile *fil)
@@ -38,6 +57,10 @@ static void sfile_init(struct sfile *fil)
     fil->fd = -1;
     fil->state = SF_BEGIN;
     fil->dirty = 0;
+    fil->fetch = 0;
+    fil->size = -1;
+    fil->nextoff = -1;
+    av_seekindex_init(&fil->extents, sizeof(struct sfextent));
 }
 
 static void sfile_end(struct sfile *fil)
@@ -45,6 +68,7 @@ static void sfile_end(struct sfile *fil)
     close(fil->fd);
     av_del_tmpfile(fil->localfile);
     av_unref_obj(fil->conndata);
+    av_seekindex_free(&fil->extents);
 }
 
 static void sfile_reset(struct sfile *fil)
@@ -103,12 +127,25 @@ static int sfile_open_localfile(struct sfile *fil)
 static int sfile_startget(struct sfile *fil)
 {
     int res;
+    avoff_t size;
 
     if(!(fil->flags & SFILE_NOCACHE)) {
         res = sfile_open_localfile(fil);
         if(res < 0)
             return res;
     }
+
+    if(fil->func->fetch != NULL) {
+        size = fil->func->size(fil->data);
+        if(size >= 0) {
+            fil->fetch = 1;
+            fil->size = size;
+            fil->state = SF_READ;
+            return 0;
+        }
+        if(size != -ENOSYS)
+            return size;
+    }
     
     res = fil->func->startget(fil->data, &fil->conndata);
     if(res < 0)
@@ -193,19 +230,17 @@ static avssize_t sfile_read(struct sfile *fil, char *buf, avssize_t nbyte)
     return res;
 }
 
-static int sfile_dummy_read(struct sfile *fil, avoff_t offset)
+/* Read up to offset, or one chunk further if offset is already
+   reached */
+static int sfile_dummy_read(struct sfile *fil, char *tmpbuf, avoff_t offset)
 {
     avssize_t res;
-    //avsize_t nact;
-    const int tmpbufsize = 8192;
-    char tmpbuf[tmpbufsize];
+    avsize_t nact = SFILE_SKIPSIZE;
 
-    //if((fil->flags & SFILE_NOCACHE) != 0)
-    //    nact = AV_MIN(tmpbufsize, offset - fil->numbytes);
-    //else
-    //    nact = tmpbufsize;
+    if(offset > fil->numbytes)
+        nact = AV_MIN(nact, offset - fil->numbytes);
 
-    res = sfile_read(fil, tmpbuf, tmpbufsize);
+    res = sfile_read(fil, tmpbuf, nact);
     
     if(res < 0)
         return res;
@@ -249,23 +284,186 @@ static avssize_t sfile_finished_read(struct sfile *fil, char *buf,
     return sfile_cached_pread(fil, buf, nact, offset);
 }
 
-static avssize_t sfile_pread(struct sfile *fil, char *buf, avsize_t nbyte,
+static void sfile_add_extent(struct sfile *fil, avoff_t start, avoff_t end)
+{
+    struct seekindex *si = &fil->extents;
+    struct sfextent *ext;
+    struct sfextent *next;
+    int n;
+
+    n = av_seekindex_lookup(si, start);
+    ext = n < 0 ? NULL : (struct sfextent *) av_seekindex_get(si, n);
+    if(ext == NULL || ext->end < start) {
+        av_seekindex_add(si, start);
+        n++;
+        ext = (struct sfextent *) av_seekindex_get(si, n);
+        ext->end = end;
+    }
+    else if(end > ext->end)
+        ext->end = end;
+
+    /* merge the extents now touching this one */
+    while((next = (struct sfextent *) av_seekindex_get(si, n + 1)) != NULL &&
+          next->start <= ext->end) {
+        if(next->end > ext->end)
+            ext->end = next->end;
+        av_seekindex_del(si, n + 1);
+    }
+}
+
+static avssize_t sfile_fetch(struct sfile *fil, char *buf, avsize_t nbyte,
                              avoff_t offset)
+{
+    avssize_t res;
+    avsize_t got = 0;
+
+    while(got < nbyte) {
+        res = fil->func->fetch(fil->data, buf + got, nbyte - got,
+                               offset + got);
+        if(res < 0)
+            return res;
+        if(res == 0)
+            break;
+
+        got += res;
+    }
+    if(got == 0) {
+        av_log(AVLOG_ERROR, "sfile: no data at offset %lli", offset);
+        return -EIO;
+    }
+
+    return got;
+}
+
+/* Fetch the part of the uncached range at offset, which is before the
+   (n+1)th extent */
+static int sfile_fetch_hole(struct sfile *fil, avoff_t offset, avoff_t end,
+                            int n, int readahead)
+{
+    avssize_t res;
+    avoff_t start;
+    avoff_t stop;
+    char *buf;
+    struct sfextent *ext;
+
+    start = offset - offset % SFILE_FETCHSIZE;
+    ext = n < 0 ? NULL : (struct sfextent *) av_seekindex_get(&fil->extents, n);
+    if(ext != NULL && ext->end > start)
+        start = ext->end;
+
+    stop = end + SFILE_FETCHSIZE - 1;
+    stop -= stop % SFILE_FETCHSIZE;
+    if(readahead)
+        stop = AV_MAX(stop, start + SFILE_READAHEAD);
+    stop = AV_MIN(stop, fil->size);
+    ext = (struct sfextent *) av_seekindex_get(&fil->extents, n + 1);
+    if(ext != NULL && ext->start < stop)
+        stop = ext->start;
+
+    buf = av_malloc(stop - start);
+    res = sfile_fetch(fil, buf, stop - start, start);
+    if(res > 0)
+        res = sfile_cached_pwrite(fil, buf, res, start);
+    av_free(buf);
+    if(res < 0)
+        return res;
+
+    sfile_add_extent(fil, start, start + res);
+
+    return 0;
+}
+
+static int sfile_fetch_range(struct sfile *fil, avoff_t offset, avoff_t end,
+                             int readahead)
 {
     int res;
+    int n;
+    struct sfextent *ext;
+
+    while(offset < end) {
+        n = av_seekindex_lookup(&fil->extents, offset);
+        ext = n < 0 ? NULL :
+            (struct sfextent *) av_seekindex_get(&fil->extents, n);
+        if(ext != NULL && ext->end > offset) {
+            offset = ext->end;
+            continue;
+        }
 
-    while(fil->state == SF_READ) {
-        if(offset + nbyte <= fil->numbytes)
-            return sfile_cached_pread(fil, buf, nbyte, offset);
-        
-        if(offset == fil->numbytes)
-            return sfile_read(fil, buf, nbyte);
-        
-        res = sfile_dummy_read(fil, offset);
+        res = sfile_fetch_hole(fil, offset, end, n, readahead);
         if(res < 0)
             return res;
     }
 
+    return 0;
+}
+
+static avssize_t sfile_fetch_pread(struct sfile *fil, char *buf,
+                                   avsize_t nbyte, avoff_t offset)
+{
+    int res;
+
+    if(offset >= fil->size || nbyte == 0)
+        return 0;
+
+    nbyte = AV_MIN(nbyte, fil->size - offset);
+    if((fil->flags & SFILE_NOCACHE) != 0)
+        return sfile_fetch(fil, buf, nbyte, offset);
+
+    res = sfile_fetch_range(fil, offset, offset + nbyte,
+                            offset == fil->nextoff);
+    if(res < 0)
+        return res;
+
+    fil->nextoff = offset + nbyte;
+
+    return sfile_cached_pread(fil, buf, nbyte, offset);
+}
+
+/* Get everything, after this the file is like a fully read serial one */
+static int sfile_fetch_finish(struct sfile *fil)
+{
+    int res;
+
+    res = sfile_fetch_range(fil, 0, fil->size, 1);
+    if(res < 0)
+        return res;
+
+    fil->fetch = 0;
+    fil->numbytes = fil->size;
+    fil->state = SF_FINI;
+
+    return 0;
+}
+
+static avssize_t sfile_pread(struct sfile *fil, char *buf, avsize_t nbyte,
+                             avoff_t offset)
+{
+    avssize_t res;
+    int done = 0;
+    char *tmpbuf = NULL;
+
+    if(fil->fetch)
+        return sfile_fetch_pread(fil, buf, nbyte, offset);
+
+    while(!done && fil->state == SF_READ) {
+        done = 1;
+        if(offset + nbyte <= fil->numbytes)
+            res = sfile_cached_pread(fil, buf, nbyte, offset);
+        else if(offset == fil->numbytes)
+            res = sfile_read(fil, buf, nbyte);
+        else {
+            if(tmpbuf == NULL)
+                tmpbuf = av_malloc(SFILE_SKIPSIZE);
+
+            res = sfile_dummy_read(fil, tmpbuf, offset);
+            done = (res < 0);
+        }
+    }
+    av_free(tmpbuf);
+
+    if(done)
+        return res;
+
     return sfile_finished_read(fil, buf, nbyte, offset);
 }
 
@@ -331,6 +529,16 @@ static int sfile_read_until(struct sfile *fil, avoff_t offset, int finish)
     if(res < 0)
         return res;
 
+    if(fil->fetch) {
+        if(!finish)
+            return 0;
+
+        res = sfile_fetch_finish(fil);
+        if(res < 0)
+            sfile_reset(fil);
+        return res;
+    }
+
     if(finish && fil->state != SF_FINI) {
         av_unref_obj(fil->conndata);
         fil->conndata = NULL;
@@ -348,6 +556,9 @@ avoff_t av_sfile_size(struct sfile *fil)
     if(res < 0)
         return res;
 
+    if(fil->fetch)
+        return fil->size;
+
     return fil->numbytes;
 }
 
@@ -0,0 +1,185 @@
+/*
+    AVFS: A Virtual File System Library
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+/* streamcache.c
+
+   Parked decoder states of the compressed file readers.  There is a
+   small fixed number of slots shared by all formats, and decoders can
+   be large, so the memory they use is limited too.  The least
+   recently parked streams are released first.
+*/
+
+#include "streamcache.h"
+#include "exit.h"
+
+#define STREAMCACHE_SLOTS 16
+#define STREAMCACHE_MAXMEM (64 * 1024 * 1024)
+
+struct streamslot {
+    int id;                     /* 0 if the slot is free */
+    avoff_t offset;
+    void *stream;
+    avsize_t memsize;
+    streamcache_release_func release;
+    unsigned int age;
+};
+
+static AV_LOCK_DECL(streamcache_lock);
+static struct streamslot slots[STREAMCACHE_SLOTS];
+static avsize_t streamcache_mem;
+static unsigned int streamcache_clock;
+static int streamcache_nextid;
+static int streamcache_inited;
+
+static void streamslot_take(struct streamslot *sl, struct streamslot *to)
+{
+    *to = *sl;
+    streamcache_mem -= sl->memsize;
+    sl->id = 0;
+    sl->stream = NULL;
+}
+
+static void streamslot_release(struct streamslot *list, int num)
+{
+    int i;
+
+    for(i = 0; i < num; i++)
+        list[i].release(list[i].stream);
+}
+
+static void streamcache_destroy()
+{
+    int i;
+    int num = 0;
+    struct streamslot old[STREAMCACHE_SLOTS];
+
+    AV_LOCK(streamcache_lock);
+    for(i = 0; i < STREAMCACHE_SLOTS; i++) {
+        if(slots[i].id != 0)
+            streamslot_take(&slots[i], &old[num++]);
+    }
+    AV_UNLOCK(streamcache_lock);
+
+    streamslot_release(old, num);
+}
+
+/* Ids are unique among all formats, so that their streams can share
+   the slots */
+int av_streamcache_newid()
+{
+    int id;
+
+    AV_LOCK(streamcache_lock);
+    if(streamcache_nextid == 0)
+        streamcache_nextid = 1;
+    id = streamcache_nextid ++;
+    AV_UNLOCK(streamcache_lock);
+
+    return id;
+}
+
+void av_streamcache_put(int id, avoff_t offset, void *stream,
+                        avsize_t memsize, streamcache_release_func release)
+{
+    int i;
+    int num = 0;
+    struct streamslot old[STREAMCACHE_SLOTS + 1];
+    struct streamslot *sl;
+
+    if(id == 0) {
+        release(stream);
+        return;
+    }
+
+    AV_LOCK(streamcache_lock);
+    if(!streamcache_inited) {
+        av_add_exithandler(streamcache_destroy);
+        streamcache_inited = 1;
+    }
+
+    /* a stream of the same file at the same place is not needed twice */
+    for(i = 0; i < STREAMCACHE_SLOTS; i++) {
+        if(slots[i].id == id && slots[i].offset == offset)
+            streamslot_take(&slots[i], &old[num++]);
+    }
+
+    for(;;) {
+        struct streamslot *oldest = NULL;
+
+        sl = NULL;
+        for(i = 0; i < STREAMCACHE_SLOTS; i++) {
+            if(slots[i].id == 0) {
+                if(sl == NULL)
+                    sl = &slots[i];
+            }
+            else if(oldest == NULL || slots[i].age < oldest->age)
+                oldest = &slots[i];
+        }
+        if(oldest == NULL ||
+           (sl != NULL && streamcache_mem + memsize <= STREAMCACHE_MAXMEM))
+            break;
+
+        streamslot_take(oldest, &old[num++]);
+    }
+
+    sl->id = id;
+    sl->offset = offset;
+    sl->stream = stream;
+    sl->memsize = memsize;
+    sl->release = release;
+    sl->age = ++streamcache_clock;
+    streamcache_mem += memsize;
+    AV_UNLOCK(streamcache_lock);
+
+    streamslot_release(old, num);
+}
+
+/* Take the stream of cache 'id' closest before offset, if it is less
+   than maxdist behind it (maxdist < 0 means any distance) */
+void *av_streamcache_get(int id, avoff_t offset, avoff_t maxdist,
+                         avoff_t *offsetp)
+{
+    int i;
+    struct streamslot *best = NULL;
+    struct streamslot found;
+
+    AV_LOCK(streamcache_lock);
+    for(i = 0; i < STREAMCACHE_SLOTS; i++) {
+        struct streamslot *sl = &slots[i];
+
+        if(sl->id != id || sl->offset > offset)
+            continue;
+        if(maxdist >= 0 && offset - sl->offset >= maxdist)
+            continue;
+        if(best == NULL || sl->offset > best->offset)
+            best = sl;
+    }
+    if(best != NULL)
+        streamslot_take(best, &found);
+    AV_UNLOCK(streamcache_lock);
+
+    if(best == NULL)
+        return NULL;
+
+    *offsetp = found.offset;
+    return found.stream;
+}
+
+void av_streamcache_forget(int id)
+{
+    int i;
+    int num = 0;
+    struct streamslot old[STREAMCACHE_SLOTS];
+
+    AV_LOCK(streamcache_lock);
+    for(i = 0; i < STREAMCACHE_SLOTS; i++) {
+        if(slots[i].id == id)
+            streamslot_take(&slots[i], &old[num++]);
+    }
+    AV_UNLOCK(streamcache_lock);
+
+    streamslot_release(old, num);
+}
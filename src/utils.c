@@ -6,6 +6,7 @@
     See the file COPYING.
 */
 
+#include "config.h"
 #include "internal.h"
 #include "version.h"
 #include "oper.h"
@@ -21,6 +22,7 @@ static struct namespace *avfsstat_ns;
 
 struct av_obj {
     int refctr;
+    avsize_t size;
     void (*destr)(void *);
     avmutex *ref_lock;
     void (*destr_locked)(void *);
@@ -203,6 +205,22 @@ char *av_strndup(const char *s, avsize_t len)
     return ns;
 }
 
+/* FNV-1a hash of a string, for the hash tables of the caches */
+unsigned int av_strhash(const char *s)
+{
+    unsigned int hash = 2166136261U;
+
+    if(s == NULL)
+        return 0;
+
+    for(; *s; s++) {
+        hash ^= (unsigned char) *s;
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
 char *av_stradd(char *str, ...)
 {
     va_list ap;
@@ -237,8 +255,9 @@ void *av_new_obj(avsize_t nbyte, void (*destr)(void *))
 {
     struct av_obj *ao;
 
-    ao = (struct av_obj *) av_calloc(sizeof(*ao) + nbyte);
+    ao = (struct av_obj *) av_calloc_fixed(sizeof(*ao) + nbyte);
     ao->refctr = 1;
+    ao->size = sizeof(*ao) + nbyte;
     ao->destr = destr;
     ao->ref_lock = NULL;
     ao->destr_locked = NULL;
@@ -264,26 +283,71 @@ void av_obj_set_destr_locked(void *obj, void (*destr_locked)(void *))
     }
 }
 
+#ifdef HAVE_ATOMIC_BUILTINS
+/* Objects without their own lock or locked destructor don't need
+   objlock, their counter is changed atomically */
+static int obj_is_atomic(struct av_obj *ao)
+{
+    return ao->ref_lock == NULL && ao->destr_locked == NULL;
+}
+
+static int obj_atomic_ref(struct av_obj *ao)
+{
+    int refctr = __atomic_load_n(&ao->refctr, __ATOMIC_RELAXED);
+
+    while(refctr > 0) {
+        if(__atomic_compare_exchange_n(&ao->refctr, &refctr, refctr + 1, 1,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            return refctr + 1;
+    }
+
+    return refctr;
+}
+
+static int obj_atomic_unref(struct av_obj *ao)
+{
+    int refctr = __atomic_load_n(&ao->refctr, __ATOMIC_RELAXED);
+
+    /* The release/acquire pair makes all changes to the object visible
+       to the thread running the destructor */
+    while(refctr >= 0) {
+        if(__atomic_compare_exchange_n(&ao->refctr, &refctr, refctr - 1, 1,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            return refctr - 1;
+    }
+
+    return refctr;
+}
+#else
+#define obj_is_atomic(ao) 0
+#define obj_atomic_ref(ao) 0
+#define obj_atomic_unref(ao) 0
+#endif
+
 void av_ref_obj(void *obj)
 {
     if(obj != NULL) {
         struct av_obj *ao = ((struct av_obj *) obj) - 1;
         int refctr;
         
-        if(ao->ref_lock != NULL) {
-            AV_LOCK(*ao->ref_lock);
-        } else {
-            AV_LOCK(objlock);
-        }
-
-        if(ao->refctr > 0)
-            ao->refctr ++;
-        refctr = ao->refctr;
-
-        if(ao->ref_lock != NULL) {
-            AV_UNLOCK(*ao->ref_lock);
+        if(obj_is_atomic(ao)) {
+            refctr = obj_atomic_ref(ao);
         } else {
-            AV_UNLOCK(objlock);
+            if(ao->ref_lock != NULL) {
+                AV_LOCK(*ao->ref_lock);
+            } else {
+                AV_LOCK(objlock);
+            }
+
+            if(ao->refctr > 0)
+                ao->refctr ++;
+            refctr = ao->refctr;
+
+            if(ao->ref_lock != NULL) {
+                AV_UNLOCK(*ao->ref_lock);
+            } else {
+                AV_UNLOCK(objlock);
+            }
         }
 
         if(refctr <= 0)
@@ -297,32 +361,36 @@ void av_unref_obj(void *obj)
         struct av_obj *ao = ((struct av_obj *) obj) - 1;
         int refctr;
 
-        if(ao->ref_lock != NULL) {
-            AV_LOCK(*ao->ref_lock);
+        if(obj_is_atomic(ao)) {
+            refctr = obj_atomic_unref(ao);
         } else {
-            AV_LOCK(objlock);
-        }
-
-        if(ao->refctr >= 0)
-            ao->refctr --;
-        refctr = ao->refctr;
+            if(ao->ref_lock != NULL) {
+                AV_LOCK(*ao->ref_lock);
+            } else {
+                AV_LOCK(objlock);
+            }
+
+            if(ao->refctr >= 0)
+                ao->refctr --;
+            refctr = ao->refctr;
         
-        if(refctr == 0) {
-            if(ao->destr_locked != NULL)
-                ao->destr_locked(obj);
-        }
-
-        if(ao->ref_lock != NULL) {
-            AV_UNLOCK(*ao->ref_lock);
-        } else {
-            AV_UNLOCK(objlock);
+            if(refctr == 0) {
+                if(ao->destr_locked != NULL)
+                    ao->destr_locked(obj);
+            }
+
+            if(ao->ref_lock != NULL) {
+                AV_UNLOCK(*ao->ref_lock);
+            } else {
+                AV_UNLOCK(objlock);
+            }
         }
 
         if(refctr == 0) {
             if(ao->destr != NULL)
                 ao->destr(obj);
 
-            av_free(ao);
+            av_free_fixed(ao, ao->size);
             return;
         }
         else if(refctr < 0)
@@ -98,6 +98,46 @@ ssize_t virt_read(int fd, void *buf, size_t nbyte)
     return res;
 }
 
+ssize_t virt_pread(int fd, void *buf, size_t nbyte, off_t offset)
+{
+    ssize_t res;
+    int errno_save = errno;
+
+    if(offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    res = av_fd_pread(fd, buf, nbyte, offset);
+    if(res < 0) {
+        errno = -res;
+        return -1;
+    }
+
+    errno = errno_save;
+    return res;
+}
+
+ssize_t virt_pwrite(int fd, const void *buf, size_t nbyte, off_t offset)
+{
+    ssize_t res;
+    int errno_save = errno;
+
+    if(offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    res = av_fd_pwrite(fd, buf, nbyte, offset);
+    if(res < 0) {
+        errno = -res;
+        return -1;
+    }
+
+    errno = errno_save;
+    return res;
+}
+
 off_t virt_lseek(int fd, off_t offset, int whence)
 {
     off_t res;
@@ -166,14 +206,14 @@ static int open_path(vfile *vf, const char *path, int flags, avmode_t mode)
 static int common_stat(const char *path, struct stat *buf, int flags)
 {
     int res;
-    vfile vf;
+    ventry *ve;
     struct avstat avbuf;
     int errno_save = errno;
 
-    res = open_path(&vf, path, AVO_NOPERM | flags, 0);
+    res = av_get_ventry(path, !(flags & AVO_NOFOLLOW), &ve);
     if(res == 0) {
-        res = av_file_getattr(&vf, &avbuf, AVA_ALL);
-        av_file_close(&vf);
+        res = av_getattr(ve, &avbuf, AVA_ALL, flags);
+        av_free_ventry(ve);
 	if(res == 0)
 	    avstat_to_stat(buf, &avbuf);
     }
@@ -268,6 +308,48 @@ void virt_rewinddir(DIR *dirp)
     errno = errno_save;
 }
 
+/* The location is the position of the next entry in the directory.
+   Seeking to it is cheap in cached listings, local directories are
+   re-read from the start to seek backwards */
+long virt_telldir(DIR *dirp)
+{
+    avoff_t res;
+    AVDIR *dp = (AVDIR *) dirp;
+    int errno_save = errno;
+
+    if(dp == NULL) {
+	errno = EINVAL;
+	return -1;
+    }
+
+    res = av_fd_lseek(dp->fd, 0, AVSEEK_CUR);
+    if(res < 0) {
+        errno = -res;
+        return -1;
+    }
+
+    errno = errno_save;
+    return res;
+}
+
+void virt_seekdir(DIR *dirp, long loc)
+{
+    avoff_t res;
+    AVDIR *dp = (AVDIR *) dirp;
+    int errno_save = errno;
+
+    if(dp == NULL) {
+	errno = EINVAL;
+	return;
+    }
+
+    res = av_fd_lseek(dp->fd, loc, AVSEEK_SET);
+    if(res < 0)
+        errno = -res;
+    else
+        errno = errno_save;
+}
+
 #define AVFS_DIR_RECLEN 256 /* just an arbitary number */
 
 static void avdirent_to_dirent(struct dirent *ent, struct avdirent *avent,
@@ -13,6 +13,9 @@
 #include "lzma.h"
 #include "oper.h"
 #include "exit.h"
+#include "seekindex.h"
+#include "streamcache.h"
+#include "pagecache.h"
 
 #include <stdlib.h>
 #include <fcntl.h>
@@ -22,29 +25,67 @@
 #define OUTBUFSIZE 32768
 #define INITIAL_MEMLIMIT (100<<20)
 
-struct xzstreamcache {
-    int id;
-    lzma_stream *s;
-};
+/* Largest xz index which is read into memory */
+#define XZ_MAXINDEXSIZE (64<<20)
+
+/* Decoded blocks up to this size are kept in the block cache, whose
+   total size is limited as well */
+#define XZ_BLOCKCACHE_MAXBLOCK (4<<20)
+#define XZ_BLOCKCACHE_SIZE     (16<<20)
 
-/* FIXME: the streamcache should be cleaned up after a short timeout
-   because it uses a LOT of memory */
+#define XZ_HEADER_MAGIC "\xfd" "7zXZ"
+#define XZ_HEADER_MAGIC_LEN 6
 
-static struct xzstreamcache xzscache;
-static int xzread_nextid;
-static AV_LOCK_DECL(xzread_lock);
+static AV_LOCK_DECL(xzbcache_lock);
+
+/* One entry of the block index, offsets are relative to the file */
+struct xzblock {
+    avoff_t uoff;            /* Uncompressed offset */
+    avoff_t usize;           /* Uncompressed size */
+    avoff_t coff;            /* Offset of the block header */
+    avoff_t unpadded;        /* Unpadded size of the block */
+    lzma_check check;
+};
+
+#define XZINDEX_UNKNOWN 0
+#define XZINDEX_READY   1
+#define XZINDEX_NONE    2
 
 struct xzcache {
     int id;
     avoff_t size;
+
+    avmutex lock;            /* protects the size and the index */
+    int indexstate;
+    struct seekindex blocks;
 };
 
+struct xzblockcache {
+    int id;
+    int blocknum;
+    char *data;
+    avsize_t size;
+    struct xzblockcache *next;
+    struct xzblockcache *prev;
+};
+
+/* Recently decoded small blocks, protected by xzbcache_lock */
+static struct xzblockcache xzbcache = { 0, 0, NULL, 0, &xzbcache, &xzbcache };
+static avsize_t xzbcache_size;
+
 struct xzfile {
     lzma_stream *s;
     int iseof;
     int iserror;
     int id; /* The id of the last used xzcache */
     
+    /* Decoder of a single block, used if the block index is known */
+    lzma_stream *bs;
+    lzma_block block;
+    int blocknum;
+    avoff_t bpos;            /* Uncompressed offset of the block decoder */
+    avoff_t binpos;          /* Compressed offset of the next input */
+
     vfile *infile;
     char inbuf[INBUFSIZE];
 };
@@ -94,43 +135,26 @@ static int xz_new_stream(lzma_stream **resp)
     return 0;
 }
 
-static void xzfile_scache_delete()
+static void xzparked_release(void *stream)
 {
-    AV_LOCK(xzread_lock);
-    if(xzscache.id != 0) {
-        xz_delete_stream(xzscache.s);
-        xzscache.id = 0;
-    }
-    AV_UNLOCK(xzread_lock);
+    xz_delete_stream((lzma_stream *) stream);
 }
 
-static void xzfile_scache_save(int id, lzma_stream *s)
+/* Give the stream of fil to the streamcache */
+static void xzfile_park(struct xzfile *fil)
 {
-    static int regdestroy = 0;
-    if(!regdestroy) {
-        regdestroy = 1;
-        av_add_exithandler(xzfile_scache_delete);
-    }
-
-    if(id == 0 || s == NULL) {
-        xz_delete_stream(s);
-        return;
-    }
-    
-    if(xzscache.id != 0)
-        xz_delete_stream(xzscache.s);
-
-    xzscache.id = id;
-    xzscache.s = s;
+    if(fil->id == 0 || fil->s == NULL || fil->iseof || fil->iserror)
+        xz_delete_stream(fil->s);
+    else
+        av_streamcache_put(fil->id, xz_total_out(fil->s), fil->s,
+                           lzma_memusage(fil->s), xzparked_release);
+    fil->s = NULL;
 }
 
 static int xzfile_reset(struct xzfile *fil)
 {
     /* FIXME: Is it a good idea to save the previous state or not? */
-    if (fil->iseof || fil->iserror)
-        xz_delete_stream(fil->s);
-    else
-        xzfile_scache_save(fil->id, fil->s);
+    xzfile_park(fil);
 
     fil->iseof = 0;
     fil->iserror = 0;
@@ -173,9 +197,9 @@ static int xzfile_decompress(struct xzfile *fil, struct xzcache *zc)
     res = lzma_code(fil->s, LZMA_RUN);
     if(res == LZMA_STREAM_END) {
         fil->iseof = 1;
-        AV_LOCK(xzread_lock);
+        AV_LOCK(zc->lock);
         zc->size = xz_total_out(fil->s);
-        AV_UNLOCK(xzread_lock);
+        AV_UNLOCK(zc->lock);
         return 0;
     }
     /*TODO handle LZMA_MEMLIMIT_ERROR */
@@ -229,6 +253,530 @@ static int xzfile_skip_to(struct xzfile *fil, struct xzcache *zc,
     return 0;
 }
 
+static int xzindex_decode_stream(vfile *vf, avoff_t *posp, avoff_t padding,
+                                 lzma_index **idxp)
+{
+    int res;
+    avoff_t pos = *posp;
+    uint8_t buf[LZMA_STREAM_HEADER_SIZE];
+    lzma_stream_flags header_flags;
+    lzma_stream_flags footer_flags;
+    lzma_index *idx = NULL;
+    uint64_t memlimit = UINT64_MAX;
+    size_t inpos = 0;
+    uint8_t *ibuf;
+    avoff_t indexstart;
+    avoff_t streamstart;
+
+    res = av_pread_all(vf, (char *) buf, LZMA_STREAM_HEADER_SIZE,
+                       pos - LZMA_STREAM_HEADER_SIZE);
+    if(res < 0)
+        return res;
+
+    if(lzma_stream_footer_decode(&footer_flags, buf) != LZMA_OK)
+        return -EIO;
+
+    indexstart = pos - LZMA_STREAM_HEADER_SIZE -
+        (avoff_t) footer_flags.backward_size;
+    if(indexstart < LZMA_STREAM_HEADER_SIZE ||
+       footer_flags.backward_size > XZ_MAXINDEXSIZE)
+        return -EIO;
+
+    ibuf = av_malloc(footer_flags.backward_size);
+    res = av_pread_all(vf, (char *) ibuf, footer_flags.backward_size,
+                       indexstart);
+    if(res >= 0) {
+        if(lzma_index_buffer_decode(&idx, &memlimit, NULL, ibuf, &inpos,
+                                    footer_flags.backward_size) != LZMA_OK)
+            res = -EIO;
+    }
+    av_free(ibuf);
+    if(res < 0)
+        return res;
+
+    streamstart = pos - (avoff_t) lzma_index_stream_size(idx);
+    if(streamstart < 0 ||
+       lzma_index_stream_flags(idx, &footer_flags) != LZMA_OK ||
+       lzma_index_stream_padding(idx, padding) != LZMA_OK) {
+        lzma_index_end(idx, NULL);
+        return -EIO;
+    }
+
+    res = av_pread_all(vf, (char *) buf, LZMA_STREAM_HEADER_SIZE,
+                       streamstart);
+    if(res < 0 ||
+       lzma_stream_header_decode(&header_flags, buf) != LZMA_OK ||
+       lzma_stream_flags_compare(&header_flags, &footer_flags) != LZMA_OK) {
+        lzma_index_end(idx, NULL);
+        return -EIO;
+    }
+
+    *posp = streamstart;
+    *idxp = idx;
+    return 0;
+}
+
+/* Read the indexes of all streams in the file from the end backwards,
+   the same way 'xz --list' does */
+static int xzindex_read(vfile *vf, lzma_index **idxp)
+{
+    int res;
+    struct avstat stbuf;
+    avoff_t pos;
+    avoff_t padding = 0;
+    lzma_index *combined = NULL;
+    lzma_index *idx;
+    uint8_t buf[XZ_HEADER_MAGIC_LEN];
+
+    res = av_pread_all(vf, (char *) buf, XZ_HEADER_MAGIC_LEN, 0);
+    if(res < 0)
+        return res;
+
+    /* .lzma files have no index */
+    if(memcmp(buf, XZ_HEADER_MAGIC, XZ_HEADER_MAGIC_LEN) != 0)
+        return -EIO;
+
+    res = av_fgetattr(vf, &stbuf, AVA_SIZE);
+    if(res < 0)
+        return res;
+
+    pos = stbuf.size;
+    while(pos > 0) {
+        uint8_t pad[4];
+
+        if(pos < 2 * LZMA_STREAM_HEADER_SIZE) {
+            res = -EIO;
+            break;
+        }
+
+        res = av_pread_all(vf, (char *) pad, 4, pos - 4);
+        if(res < 0)
+            break;
+
+        if(pad[0] == 0 && pad[1] == 0 && pad[2] == 0 && pad[3] == 0) {
+            /* stream padding */
+            pos -= 4;
+            padding += 4;
+            continue;
+        }
+
+        res = xzindex_decode_stream(vf, &pos, padding, &idx);
+        if(res < 0)
+            break;
+
+        padding = 0;
+        if(combined != NULL) {
+            if(lzma_index_cat(idx, combined, NULL) != LZMA_OK) {
+                lzma_index_end(idx, NULL);
+                res = -EIO;
+                break;
+            }
+        }
+        combined = idx;
+    }
+
+    if(res < 0 || combined == NULL) {
+        if(combined != NULL)
+            lzma_index_end(combined, NULL);
+        return -EIO;
+    }
+
+    *idxp = combined;
+    return 0;
+}
+
+static void xzcache_build_index(struct xzcache *zc, vfile *vf)
+{
+    lzma_index *idx;
+    lzma_index_iter iter;
+
+    zc->indexstate = XZINDEX_NONE;
+
+    if(xzindex_read(vf, &idx) < 0) {
+        av_log(AVLOG_DEBUG, "XZ: no usable block index");
+        return;
+    }
+
+    /* A single block gives no advantage over the plain stream, but
+       the size is still good */
+    zc->size = lzma_index_uncompressed_size(idx);
+    if(lzma_index_block_count(idx) > 1) {
+        lzma_index_iter_init(&iter, idx);
+        while(!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_NONEMPTY_BLOCK)) {
+            struct xzblock *xb;
+
+            xb = av_seekindex_add(&zc->blocks,
+                                  iter.block.uncompressed_file_offset);
+            if(xb == NULL)
+                continue;
+
+            xb->usize = iter.block.uncompressed_size;
+            xb->coff = iter.block.compressed_file_offset;
+            xb->unpadded = iter.block.unpadded_size;
+            xb->check = iter.stream.flags->check;
+        }
+
+        zc->indexstate = XZINDEX_READY;
+        av_log(AVLOG_DEBUG, "XZ: block index with %u blocks", zc->blocks.num);
+    }
+
+    lzma_index_end(idx, NULL);
+}
+
+static int xzcache_use_index(struct xzcache *zc, vfile *vf)
+{
+    int state;
+
+    AV_LOCK(zc->lock);
+    if(zc->indexstate == XZINDEX_UNKNOWN)
+        xzcache_build_index(zc, vf);
+    state = zc->indexstate;
+    AV_UNLOCK(zc->lock);
+
+    return state == XZINDEX_READY;
+}
+
+/* Find the block containing offset, or -1 if offset is past the end */
+static int xzcache_find_block(struct xzcache *zc, avoff_t offset)
+{
+    int n = av_seekindex_lookup(&zc->blocks, offset);
+    struct xzblock *xb;
+
+    if(n < 0)
+        return -1;
+
+    xb = av_seekindex_get(&zc->blocks, n);
+    if(offset >= xb->uoff + xb->usize)
+        return -1;
+
+    return n;
+}
+
+static void xzbcache_remove(struct xzblockcache *bc)
+{
+    bc->prev->next = bc->next;
+    bc->next->prev = bc->prev;
+    xzbcache_size -= bc->size;
+}
+
+static void xzbcache_insert(struct xzblockcache *bc)
+{
+    bc->next = xzbcache.next;
+    bc->prev = &xzbcache;
+    xzbcache.next->prev = bc;
+    xzbcache.next = bc;
+    xzbcache_size += bc->size;
+}
+
+static void xzbcache_free(struct xzblockcache *bc)
+{
+    av_free(bc->data);
+    av_free(bc);
+}
+
+/* Copy from a cached block, returns -1 if the block is not cached */
+static avssize_t xzbcache_get(int id, int blocknum, char *buf,
+                              avsize_t nbyte, avsize_t blockoff)
+{
+    struct xzblockcache *bc;
+    avssize_t res = -1;
+
+    AV_LOCK(xzbcache_lock);
+    for(bc = xzbcache.next; bc != &xzbcache; bc = bc->next) {
+        if(bc->id == id && bc->blocknum == blocknum) {
+            res = AV_MIN(nbyte, bc->size - blockoff);
+            memcpy(buf, bc->data + blockoff, res);
+
+            xzbcache_remove(bc);
+            xzbcache_insert(bc);
+            break;
+        }
+    }
+    AV_UNLOCK(xzbcache_lock);
+
+    return res;
+}
+
+static void xzbcache_put(int id, int blocknum, char *data, avsize_t size)
+{
+    struct xzblockcache *bc;
+
+    AV_NEW(bc);
+    bc->id = id;
+    bc->blocknum = blocknum;
+    bc->data = data;
+    bc->size = size;
+
+    AV_LOCK(xzbcache_lock);
+    xzbcache_insert(bc);
+    while(xzbcache_size > XZ_BLOCKCACHE_SIZE && xzbcache.prev != bc) {
+        struct xzblockcache *old = xzbcache.prev;
+
+        xzbcache_remove(old);
+        xzbcache_free(old);
+    }
+    AV_UNLOCK(xzbcache_lock);
+}
+
+static void xzbcache_forget(int id)
+{
+    struct xzblockcache *bc;
+    struct xzblockcache *next;
+
+    AV_LOCK(xzbcache_lock);
+    for(bc = xzbcache.next; bc != &xzbcache; bc = next) {
+        next = bc->next;
+        if(bc->id == id) {
+            xzbcache_remove(bc);
+            xzbcache_free(bc);
+        }
+    }
+    AV_UNLOCK(xzbcache_lock);
+}
+
+/* Start a decoder for the given block of the index */
+static int xzfile_block_init(struct xzfile *fil, struct xzcache *zc,
+                             int blocknum)
+{
+    int res;
+    int i;
+    struct xzblock *xb = av_seekindex_get(&zc->blocks, blocknum);
+    uint8_t header[LZMA_BLOCK_HEADER_SIZE_MAX];
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    lzma_stream tmp = LZMA_STREAM_INIT;
+
+    xz_delete_stream(fil->bs);
+    fil->bs = NULL;
+
+    res = av_pread_all(fil->infile, (char *) header, 1, xb->coff);
+    if(res < 0)
+        return res;
+
+    memset(&fil->block, 0, sizeof(fil->block));
+    fil->block.version = 1;
+    fil->block.check = xb->check;
+    fil->block.filters = filters;
+    fil->block.header_size = lzma_block_header_size_decode(header[0]);
+
+    res = av_pread_all(fil->infile, (char *) header, fil->block.header_size,
+                       xb->coff);
+    if(res < 0)
+        return res;
+
+    if(lzma_block_header_decode(&fil->block, NULL, header) != LZMA_OK) {
+        av_log(AVLOG_ERROR, "XZ: broken block header");
+        return -EIO;
+    }
+
+    res = 0;
+    if(lzma_block_compressed_size(&fil->block, xb->unpadded) != LZMA_OK)
+        res = -EIO;
+    else {
+        AV_NEW(fil->bs);
+        *fil->bs = tmp;
+        if(lzma_block_decoder(fil->bs, &fil->block) != LZMA_OK) {
+            av_free(fil->bs);
+            fil->bs = NULL;
+            res = -EIO;
+        }
+    }
+
+    /* the filter options are only needed to initialize the decoder */
+    for(i = 0; filters[i].id != LZMA_VLI_UNKNOWN; i++)
+        free(filters[i].options);
+    fil->block.filters = NULL;
+
+    if(res < 0) {
+        av_log(AVLOG_ERROR, "XZ: block decoder init error");
+        return res;
+    }
+
+    fil->blocknum = blocknum;
+    fil->bpos = xb->uoff;
+    fil->binpos = xb->coff + fil->block.header_size;
+
+    return 0;
+}
+
+static int xzfile_block_fill(struct xzfile *fil)
+{
+    avssize_t res;
+    lzma_stream *s = fil->bs;
+
+    res = av_pread(fil->infile, fil->inbuf, INBUFSIZE, fil->binpos);
+    if(res < 0)
+        return res;
+    if(res == 0) {
+        av_log(AVLOG_ERROR, "XZ: premature end of file");
+        return -EIO;
+    }
+    fil->binpos += res;
+    s->next_in = (uint8_t *) fil->inbuf;
+    s->avail_in = res;
+
+    return 0;
+}
+
+/* Decode from the current block into buf, stops at the end of the
+   block */
+static avssize_t xzfile_block_decode(struct xzfile *fil, struct xzcache *zc,
+                                     char *buf, avsize_t nbyte)
+{
+    int res;
+    int ended = 0;
+    struct xzblock *xb = av_seekindex_get(&zc->blocks, fil->blocknum);
+    avoff_t blockend = xb->uoff + xb->usize;
+    lzma_stream *s = fil->bs;
+
+    nbyte = AV_MIN((avoff_t) nbyte, blockend - fil->bpos);
+    s->next_out = (uint8_t *) buf;
+    s->avail_out = nbyte;
+
+    while(s->avail_out != 0) {
+        if(s->avail_in == 0) {
+            res = xzfile_block_fill(fil);
+            if(res < 0)
+                return res;
+        }
+
+        res = lzma_code(s, LZMA_RUN);
+        if(res == LZMA_STREAM_END) {
+            ended = 1;
+            break;
+        }
+        if(res != LZMA_OK) {
+            av_log(AVLOG_ERROR, "XZ: decompress error: %i", res);
+            return -EIO;
+        }
+    }
+
+    res = nbyte - s->avail_out;
+    fil->bpos += res;
+    if(res != nbyte) {
+        av_log(AVLOG_ERROR, "XZ: block shorter than indexed");
+        return -EIO;
+    }
+
+    if(fil->bpos == blockend) {
+        int err;
+
+        /* All data is out, let the decoder verify the padding and the
+           check of the block */
+        while(!ended) {
+            if(s->avail_in == 0) {
+                err = xzfile_block_fill(fil);
+                if(err < 0)
+                    return err;
+            }
+            err = lzma_code(s, LZMA_RUN);
+            if(err == LZMA_STREAM_END)
+                ended = 1;
+            else if(err != LZMA_OK) {
+                av_log(AVLOG_ERROR, "XZ: decompress error: %i", err);
+                return -EIO;
+            }
+        }
+
+        /* Block fully decoded, the decoder is not needed any more */
+        xz_delete_stream(fil->bs);
+        fil->bs = NULL;
+    }
+
+    return res;
+}
+
+static int xzfile_block_skip_to(struct xzfile *fil, struct xzcache *zc,
+                                avoff_t offset)
+{
+    avssize_t res;
+    char outbuf[OUTBUFSIZE];
+
+    while(fil->bpos < offset) {
+        res = xzfile_block_decode(fil, zc, outbuf,
+                                  AV_MIN(OUTBUFSIZE, offset - fil->bpos));
+        if(res < 0)
+            return res;
+    }
+
+    return 0;
+}
+
+/* Decode a whole small block into the block cache */
+static avssize_t xzfile_block_cache_read(struct xzfile *fil,
+                                         struct xzcache *zc, int blocknum,
+                                         char *buf, avsize_t nbyte,
+                                         avsize_t blockoff)
+{
+    avssize_t res;
+    struct xzblock *xb = av_seekindex_get(&zc->blocks, blocknum);
+    char *data;
+
+    res = xzfile_block_init(fil, zc, blocknum);
+    if(res < 0)
+        return res;
+
+    data = av_malloc(xb->usize);
+    res = xzfile_block_decode(fil, zc, data, xb->usize);
+    if(res < 0) {
+        av_free(data);
+        return res;
+    }
+
+    res = AV_MIN(nbyte, xb->usize - blockoff);
+    memcpy(buf, data + blockoff, res);
+    xzbcache_put(zc->id, blocknum, data, xb->usize);
+
+    return res;
+}
+
+static avssize_t xzfile_block_pread(struct xzfile *fil, struct xzcache *zc,
+                                    char *buf, avsize_t nbyte, avoff_t offset)
+{
+    avssize_t res;
+    avsize_t nread = 0;
+
+    while(nread < nbyte) {
+        int blocknum;
+        struct xzblock *xb;
+        avoff_t curr = offset + nread;
+
+        blocknum = xzcache_find_block(zc, curr);
+        if(blocknum < 0)
+            break;
+
+        xb = av_seekindex_get(&zc->blocks, blocknum);
+        res = xzbcache_get(zc->id, blocknum, buf + nread, nbyte - nread,
+                           curr - xb->uoff);
+        if(res < 0) {
+            if(xb->usize <= XZ_BLOCKCACHE_MAXBLOCK)
+                res = xzfile_block_cache_read(fil, zc, blocknum, buf + nread,
+                                              nbyte - nread, curr - xb->uoff);
+            else {
+                if(fil->bs == NULL || fil->blocknum != blocknum ||
+                   fil->bpos > curr) {
+                    res = xzfile_block_init(fil, zc, blocknum);
+                    if(res < 0)
+                        return res;
+                }
+                res = xzfile_block_skip_to(fil, zc, curr);
+                if(res < 0)
+                    return res;
+
+                res = xzfile_block_decode(fil, zc, buf + nread,
+                                          nbyte - nread);
+            }
+        }
+        if(res < 0)
+            return res;
+        if(res == 0)
+            break;
+
+        nread += res;
+    }
+
+    return nread;
+}
+
 static avssize_t av_xzfile_do_pread(struct xzfile *fil, struct xzcache *zc,
                                    char *buf, avsize_t nbyte, avoff_t offset)
 {
@@ -237,15 +785,30 @@ static avssize_t av_xzfile_do_pread(struct xzfile *fil, struct xzcache *zc,
 
     fil->id = zc->id;
 
+    if(xzcache_use_index(zc, fil->infile))
+        return xzfile_block_pread(fil, zc, buf, nbyte, offset);
+
     curroff = xz_total_out(fil->s);
     if(offset != curroff) {
-        AV_LOCK(xzread_lock);
-        if ( curroff > offset ) {
+        lzma_stream *parked;
+        avoff_t parkedoff;
+
+        /* A parked stream closer to offset, also if behind curroff */
+        parked = av_streamcache_get(zc->id, offset,
+                                    curroff > offset ? -1 : offset - curroff,
+                                    &parkedoff);
+        if(parked != NULL) {
+            xzfile_park(fil);
+            fil->s = parked;
+            fil->s->avail_in = 0;
+            fil->iseof = 0;
+            res = 0;
+        }
+        else if ( curroff > offset ) {
             res = xzfile_reset( fil );
         } else {
             res = 0;
         }
-        AV_UNLOCK(xzread_lock);
         if(res < 0)
             return res;
 
@@ -259,8 +822,8 @@ static avssize_t av_xzfile_do_pread(struct xzfile *fil, struct xzcache *zc,
     return res;
 }
 
-avssize_t av_xzfile_pread(struct xzfile *fil, struct xzcache *zc, char *buf,
-                         avsize_t nbyte, avoff_t offset)
+static avssize_t xzfile_pread(struct xzfile *fil, struct xzcache *zc, char *buf,
+                              avsize_t nbyte, avoff_t offset)
 {
     avssize_t res;
 
@@ -274,14 +837,28 @@ avssize_t av_xzfile_pread(struct xzfile *fil, struct xzcache *zc, char *buf,
     return res;
 }
 
+static avssize_t xzfile_page_read(void *fil, void *zc, char *buf,
+                                  avsize_t nbyte, avoff_t offset)
+{
+    return xzfile_pread((struct xzfile *) fil, (struct xzcache *) zc,
+                        buf, nbyte, offset);
+}
+
+avssize_t av_xzfile_pread(struct xzfile *fil, struct xzcache *zc, char *buf,
+                          avsize_t nbyte, avoff_t offset)
+{
+    return av_pagecache_pread(zc->id, xzfile_page_read, fil, zc, buf, nbyte,
+                              offset);
+}
+
 int av_xzfile_size(struct xzfile *fil, struct xzcache *zc, avoff_t *sizep)
 {
     int res;
     avoff_t size;
 
-    AV_LOCK(xzread_lock);
+    AV_LOCK(zc->lock);
     size = zc->size;
-    AV_UNLOCK(xzread_lock);
+    AV_UNLOCK(zc->lock);
 
     if(size != -1 || fil == NULL) {
         *sizep = size;
@@ -290,9 +867,17 @@ int av_xzfile_size(struct xzfile *fil, struct xzcache *zc, avoff_t *sizep)
 
     fil->id = zc->id;
 
-    AV_LOCK(xzread_lock);
+    /* The index knows the size without decompressing anything */
+    xzcache_use_index(zc, fil->infile);
+    AV_LOCK(zc->lock);
+    size = zc->size;
+    AV_UNLOCK(zc->lock);
+    if(size != -1) {
+        *sizep = size;
+        return 0;
+    }
+
     res = xzfile_reset( fil );
-    AV_UNLOCK(xzread_lock);
     if(res < 0)
         return res;
 
@@ -300,9 +885,9 @@ int av_xzfile_size(struct xzfile *fil, struct xzcache *zc, avoff_t *sizep)
     if(res < 0)
         return res;
     
-    AV_LOCK(xzread_lock);
+    AV_LOCK(zc->lock);
     size = zc->size;
-    AV_UNLOCK(xzread_lock);
+    AV_UNLOCK(zc->lock);
     
     if(size == -1) {
         av_log(AVLOG_ERROR, "XZ: Internal error: could not find size");
@@ -315,9 +900,9 @@ int av_xzfile_size(struct xzfile *fil, struct xzcache *zc, avoff_t *sizep)
 
 static void xzfile_destroy(struct xzfile *fil)
 {
-    AV_LOCK(xzread_lock);
-    xzfile_scache_save(fil->id, fil->s);
-    AV_UNLOCK(xzread_lock);
+    xzfile_park(fil);
+
+    xz_delete_stream(fil->bs);
 }
 
 struct xzfile *av_xzfile_new(vfile *vf)
@@ -330,6 +915,8 @@ struct xzfile *av_xzfile_new(vfile *vf)
     fil->iserror = 0;
     fil->infile = vf;
     fil->id = 0;
+    fil->bs = NULL;
+    fil->blocknum = -1;
 
     res = xz_new_stream(&fil->s);
     if(res < 0)
@@ -340,6 +927,11 @@ struct xzfile *av_xzfile_new(vfile *vf)
 
 static void xzcache_destroy(struct xzcache *zc)
 {
+    av_streamcache_forget(zc->id);
+    av_pagecache_forget(zc->id);
+    xzbcache_forget(zc->id);
+    av_seekindex_free(&zc->blocks);
+    AV_FREELOCK(zc->lock);
 }
 
 struct xzcache *av_xzcache_new()
@@ -348,13 +940,10 @@ struct xzcache *av_xzcache_new()
 
     AV_NEW_OBJ(zc, xzcache_destroy);
     zc->size = -1;
+    AV_INITLOCK(zc->lock);
+    zc->indexstate = XZINDEX_UNKNOWN;
+    av_seekindex_init(&zc->blocks, sizeof(struct xzblock));
+    zc->id = av_streamcache_newid();
 
-    AV_LOCK(xzread_lock);
-    if(xzread_nextid == 0)
-        xzread_nextid = 1;
-
-    zc->id = xzread_nextid ++;
-    AV_UNLOCK(xzread_lock);
-    
     return zc;
 }
@@ -10,9 +10,15 @@
 #include "zfile.h"
 #include "zlib.h"
 #include "oper.h"
+#include "seekindex.h"
+#include "streamcache.h"
+#include "pagecache.h"
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #define INDEXDISTANCE 1048576
 
@@ -30,22 +36,19 @@
 #define QBYTE(ptr) ((avuint) (BI(ptr,0) | (BI(ptr,1)<<8) | \
                    (BI(ptr,2)<<16) | (BI(ptr,3)<<24)))
 
-struct streamcache {
-    int id;
+/* A stream parked in the streamcache */
+struct zparked {
     z_stream s;
     int calccrc;
-    int iseof;
 };
 
-static struct streamcache scache;
-static int zread_nextid;
-static AV_LOCK_DECL(zread_lock);
+/* The inflate state and the window */
+#define ZPARKED_MEMSIZE (sizeof(struct zparked) + (1 << MAX_WBITS) + 8192)
 
 struct zindex {
     avoff_t offset;          /* The number of output bytes */
     avoff_t indexoffset;     /* Offset in the indexfile */
     avsize_t indexsize;      /* Size of state record */
-    struct zindex *next;
 };
 
 struct zcache {
@@ -54,9 +57,50 @@ struct zcache {
     avoff_t nextindex;
     avoff_t size;
     int id;
-    struct zindex *indexes;
-    avmutex lock;
+    struct seekindex indexes;
+    avmutex lock;            /* serializes seeking */
+    avmutex datalock;        /* protects the index, size and crc_ok */
     int crc_ok;
+    int persistent;          /* indexfile is a persistent index store */
+    int indexfd;             /* the store, kept open while in use */
+    char *storehdr;          /* header and key of the store */
+    avsize_t storehdrlen;
+};
+
+/* fcntl locks belong to the process, and closing any descriptor of the
+   file drops them.  This serializes the locked sections of all stores
+   within the process, and the closing of store descriptors. */
+static AV_LOCK_DECL(zindex_lock);
+
+/* Layout of the persistent index store.  The saved inflate state is
+   an image of the internal zlib structures, so the store is only
+   valid for the same build, which is what the abi field checks. */
+
+#define ZINDEX_MAGIC "AVFS-zindex-1\n"
+#define ZINDEX_ABI ((avuquad) sizeof(z_stream) | \
+                    ((avuquad) sizeof(long) << 16) |          \
+                    ((avuquad) INDEXDISTANCE << 24))
+
+struct zindex_header {
+    char magic[16];
+    avuquad abi;
+    avuquad dev;
+    avuquad ino;
+    avquad size;
+    avquad mtime_sec;
+    avquad mtime_nsec;
+    avuquad keylen;
+    /* followed by the key */
+};
+
+#define ZREC_STATE 1          /* offset: output offset, len: state size */
+#define ZREC_SIZE  2          /* offset: total size, len: crc_ok */
+
+struct zindex_record {
+    avuquad type;
+    avquad offset;
+    avuquad len;
+    /* followed by len bytes of state for ZREC_STATE */
 };
 
 struct zfile {
@@ -177,38 +221,41 @@ static int zfile_uncompress_state(char *cstate, int cstatelen, char **resp)
 }
 #endif
 
-static void zfile_scache_cleanup(void)
+static void zfile_end_stream(z_stream *s)
 {
-    inflateEnd(&scache.s);
+    int res;
+
+    res = inflateEnd(s);
+    if(res != Z_OK) {
+        av_log(AVLOG_ERROR, "ZFILE: inflateEnd: %s (%i)",
+               s->msg == NULL ? "" : s->msg, res);
+    }
 }
 
-static void zfile_scache_save(int id, z_stream *s, int calccrc, int iseof)
+static void zparked_release(void *stream)
 {
-    int res;
+    struct zparked *zp = (struct zparked *) stream;
 
-    if(id == 0 || iseof) {
-        res = inflateEnd(s);
-        if(res != Z_OK) {
-            av_log(AVLOG_ERROR, "ZFILE: inflateEnd: %s (%i)",
-                   s->msg == NULL ? "" : s->msg, res);
-        }
-        return;
-    }
+    zfile_end_stream(&zp->s);
+    av_free(zp);
+}
 
-    if(scache.id != 0) {
-        res = inflateEnd(&scache.s);
-        if(res != Z_OK) {
-            av_log(AVLOG_ERROR, "ZFILE: inflateEnd: %s (%i)",
-                   scache.s.msg == NULL ? "" : scache.s.msg, res);
-        }
+/* Give the stream of fil to the streamcache, the stream must be
+   reinitialized after this */
+static void zfile_park(struct zfile *fil)
+{
+    struct zparked *zp;
+
+    if(fil->id == 0 || fil->iseof || fil->iserror) {
+        zfile_end_stream(&fil->s);
+        return;
     }
-    if(scache.id == 0)
-        atexit(zfile_scache_cleanup);
 
-    scache.id = id;
-    scache.s = *s;
-    scache.calccrc = calccrc;
-    scache.iseof = iseof;
+    AV_NEW(zp);
+    zp->s = fil->s;
+    zp->calccrc = fil->calccrc;
+    av_streamcache_put(fil->id, fil->s.total_out, zp, ZPARKED_MEMSIZE,
+                       zparked_release);
 }
 
 static int zfile_reset(struct zfile *fil)
@@ -216,7 +263,7 @@ static int zfile_reset(struct zfile *fil)
     int res;
 
     /* FIXME: Is it a good idea to save the previous state or not? */
-    zfile_scache_save(fil->id, &fil->s, fil->calccrc, fil->iseof);
+    zfile_park(fil);
     memset(&fil->s, 0, sizeof(z_stream));
     res = inflateInit2(&fil->s, -MAX_WBITS);
     if(res != Z_OK) {
@@ -240,16 +287,119 @@ static int zfile_reset(struct zfile *fil)
     return 0;
 }
 
+static int zindex_lockfile(int fd, int type)
+{
+    struct flock fl;
+
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = 0;
+    fl.l_len = 0;
+
+    while(fcntl(fd, F_SETLKW, &fl) == -1) {
+        if(errno != EINTR)
+            return -errno;
+    }
+
+    return 0;
+}
+
+static int zindex_check_header(int fd, const char *hdr, avsize_t hdrlen)
+{
+    char *filehdr;
+    int ok;
+
+    filehdr = av_malloc(hdrlen);
+    ok = (pread(fd, filehdr, hdrlen, 0) == (ssize_t) hdrlen &&
+          memcmp(filehdr, hdr, hdrlen) == 0);
+    av_free(filehdr);
+
+    return ok;
+}
+
+/* Append one record to the persistent store.  The store may be
+   shared with other threads and processes, so the end of file is only
+   determined while holding both zindex_lock and the file lock.  A
+   stale store is replaced by a new file, so the header of the open one
+   shouldn't change, but records are only appended after checking it.  Returns the offset of the
+   record data, or -ESTALE if the record was dropped. */
+static avoff_t zindex_append(struct zcache *zc, int type, avoff_t offset,
+                             const char *data, avsize_t len)
+{
+    int fd = zc->indexfd;
+    avoff_t res;
+    struct stat stbuf;
+    struct zindex_record rec;
+    char *buf;
+
+    rec.type = type;
+    rec.offset = offset;
+    rec.len = (type == ZREC_STATE) ? len : (avuquad) zc->crc_ok;
+
+    buf = av_malloc(sizeof(rec) + len);
+    memcpy(buf, &rec, sizeof(rec));
+    if(len != 0)
+        memcpy(buf + sizeof(rec), data, len);
+
+    AV_LOCK(zindex_lock);
+    res = zindex_lockfile(fd, F_WRLCK);
+    if(res == 0) {
+        if(!zindex_check_header(fd, zc->storehdr, zc->storehdrlen)) {
+            av_log(AVLOG_WARNING, "ZFILE: indexfile %s changed, not updated",
+                   zc->indexfile);
+            res = -ESTALE;
+        }
+        else if(fstat(fd, &stbuf) == -1 ||
+           pwrite(fd, buf, sizeof(rec) + len, stbuf.st_size) !=
+           (ssize_t) (sizeof(rec) + len)) {
+            av_log(AVLOG_ERROR, "ZFILE: Error writing indexfile %s: %s",
+                   zc->indexfile, strerror(errno));
+            res = -EIO;
+        }
+        else
+            res = stbuf.st_size + sizeof(rec);
+        zindex_lockfile(fd, F_UNLCK);
+    }
+    AV_UNLOCK(zindex_lock);
+    av_free(buf);
+
+    return res;
+}
+
+static void zcache_store_size(struct zcache *zc)
+{
+    if(zc->persistent)
+        zindex_append(zc, ZREC_SIZE, zc->size, NULL, 0);
+}
+
 #ifndef USE_SYSTEM_ZLIB
 static int zfile_save_state(struct zcache *zc, char *state, int statesize,
                             avoff_t offset)
 {
     int fd;
     int res;
-    struct zindex **zp;
     struct zindex *zi;
+    avoff_t indexoffset;
 
-    for(zp = &zc->indexes; *zp != NULL; zp = &(*zp)->next);
+    if(zc->persistent) {
+        indexoffset = zindex_append(zc, ZREC_STATE, offset, state, statesize);
+        if(indexoffset == -ESTALE) {
+            /* Go on without this checkpoint */
+            zc->nextindex += INDEXDISTANCE;
+            return 0;
+        }
+        if(indexoffset < 0)
+            return indexoffset;
+
+        zi = av_seekindex_add(&zc->indexes, offset);
+        if(zi != NULL) {
+            zi->indexoffset = indexoffset;
+            zi->indexsize = statesize;
+        }
+
+        zc->nextindex += INDEXDISTANCE;
+        return 0;
+    }
 
     fd = open(zc->indexfile, O_WRONLY | O_CREAT, 0600);
     if(fd == -1) {
@@ -268,13 +418,11 @@ static int zfile_save_state(struct zcache *zc, char *state, int statesize,
         return -EIO;
     }
 
-    AV_NEW(zi);
-    zi->offset = offset;
-    zi->indexoffset = zc->filesize;
-    zi->indexsize = statesize;
-    zi->next = NULL;
-    
-    *zp = zi;
+    zi = av_seekindex_add(&zc->indexes, offset);
+    if(zi != NULL) {
+        zi->indexoffset = zc->filesize;
+        zi->indexsize = statesize;
+    }
 
     zc->nextindex += INDEXDISTANCE;
     zc->filesize += statesize;
@@ -315,21 +463,23 @@ static int zfile_seek_index(struct zfile *fil, struct zcache *zc,
     char *state;
 
     /* FIXME: Is it a good idea to save the previous state or not? */
-    zfile_scache_save(fil->id, &fil->s, fil->calccrc, fil->iseof);
+    zfile_park(fil);
     memset(&fil->s, 0, sizeof(z_stream));
 
-    fd = open(zc->indexfile, O_RDONLY, 0);
-    if(fd == -1) {
-        av_log(AVLOG_ERROR, "ZFILE: Error opening indexfile %s: %s",
-               zc->indexfile, strerror(errno));
-        return -EIO;
-    }
-    
-    lseek(fd, zi->indexoffset, SEEK_SET);
-
     cstate = av_malloc(zi->indexsize);
-    res = read(fd, cstate, zi->indexsize);
-    close(fd);
+    if(zc->persistent)
+        res = pread(zc->indexfd, cstate, zi->indexsize, zi->indexoffset);
+    else {
+        fd = open(zc->indexfile, O_RDONLY, 0);
+        if(fd == -1) {
+            av_log(AVLOG_ERROR, "ZFILE: Error opening indexfile %s: %s",
+                   zc->indexfile, strerror(errno));
+            av_free(cstate);
+            return -EIO;
+        }
+        res = pread(fd, cstate, zi->indexsize, zi->indexoffset);
+        close(fd);
+    }
     if(res != zi->indexsize) {
         av_free(cstate);
         av_log(AVLOG_ERROR, "ZFILE: Error in indexfile %s", zc->indexfile);
@@ -355,17 +505,7 @@ static int zfile_seek_index(struct zfile *fil, struct zcache *zc,
 
 static struct zindex *zcache_find_index(struct zcache *zc, avoff_t offset)
 {
-    struct zindex *prevzi;
-    struct zindex *zi;
-    
-    prevzi = NULL;
-    for(zi = zc->indexes; zi != NULL; zi = zi->next) {
-        if(zi->offset > offset)
-            break;
-        prevzi = zi;
-    }
-
-    return prevzi;
+    return (struct zindex *) av_seekindex_find(&zc->indexes, offset);
 }
 #endif
 
@@ -543,10 +683,10 @@ static int zfile_inflate(struct zfile *fil, struct zcache *zc)
     start = fil->s.next_out;
     res = inflate(&fil->s, Z_NO_FLUSH);
     if(fil->calccrc) {
-        AV_LOCK(zread_lock);
+        AV_LOCK(zc->datalock);
         if(zc->crc_ok)
             fil->calccrc = 0;
-        AV_UNLOCK(zread_lock);
+        AV_UNLOCK(zc->datalock);
 
         if(fil->calccrc)
             fil->s.adler = crc32(fil->s.adler, start, fil->s.next_out - start);
@@ -591,11 +731,16 @@ static int zfile_inflate(struct zfile *fil, struct zcache *zc)
             }
         }
 
-        AV_LOCK(zread_lock);
+        AV_LOCK(zc->datalock);
         if(fil->calccrc)
             zc->crc_ok = crc_ok;
-        zc->size = fil->s.total_out;
-        AV_UNLOCK(zread_lock);
+        if(!cont && zc->size != (avoff_t) fil->s.total_out) {
+            zc->size = fil->s.total_out;
+            zcache_store_size(zc);
+        }
+        else
+            zc->size = fil->s.total_out;
+        AV_UNLOCK(zc->datalock);
 
         if (!cont) {
             return 0;
@@ -607,7 +752,7 @@ static int zfile_inflate(struct zfile *fil, struct zcache *zc)
         return -EIO;
     }
     
-    AV_LOCK(zread_lock);
+    AV_LOCK(zc->datalock);
 #ifdef USE_SYSTEM_ZLIB
     res = 0;
 #else
@@ -616,7 +761,7 @@ static int zfile_inflate(struct zfile *fil, struct zcache *zc)
     else
         res = 0;
 #endif
-    AV_UNLOCK(zread_lock);
+    AV_UNLOCK(zc->datalock);
     if(res < 0)
         return res;
 
@@ -662,9 +807,10 @@ static int zfile_skip_to(struct zfile *fil, struct zcache *zc, avoff_t offset)
 static int zfile_seek(struct zfile *fil, struct zcache *zc, avoff_t offset)
 {
     struct zindex *zi;
+    struct zparked *zp;
     avoff_t curroff = fil->s.total_out;
     avoff_t zcdist;
-    avoff_t scdist;
+    avoff_t parkedoff;
     avoff_t dist;
 
     if(offset >= curroff)
@@ -678,21 +824,19 @@ static int zfile_seek(struct zfile *fil, struct zcache *zc, avoff_t offset)
     else
         zcdist = offset;
 
-    if(scache.id == zc->id && offset >= scache.s.total_out) {
-        scdist = offset - scache.s.total_out;
-        if((dist == -1 || scdist < dist) && scdist < zcdist) {
-            z_stream tmp = fil->s;
-            int tmpcc = fil->calccrc;
-            int tmpiseof = fil->iseof;
-            fil->s = scache.s;
-            fil->s.avail_in = 0;
-            fil->calccrc = scache.calccrc;
-            fil->iseof = scache.iseof;
-            scache.s = tmp;
-            scache.calccrc = tmpcc;
-            scache.iseof = tmpiseof;
-            return 0;
-        }
+    /* Use a parked stream if it is closer than both the current
+       position and the index */
+    zp = av_streamcache_get(zc->id, offset,
+                            dist == -1 || zcdist < dist ? zcdist : dist,
+                            &parkedoff);
+    if(zp != NULL) {
+        zfile_park(fil);
+        fil->s = zp->s;
+        fil->s.avail_in = 0;
+        fil->calccrc = zp->calccrc;
+        fil->iseof = 0;
+        av_free(zp);
+        return 0;
     }
 
     if(dist == -1 || zcdist < dist) {
@@ -711,7 +855,7 @@ static int zfile_goto(struct zfile *fil, struct zcache *zc, avoff_t offset)
     int res;
 
     AV_LOCK(zc->lock);
-    AV_LOCK(zread_lock);
+    AV_LOCK(zc->datalock);
 #ifdef USE_SYSTEM_ZLIB
     if ( offset < fil->s.total_out ) {
         res = zfile_reset(fil);
@@ -719,7 +863,7 @@ static int zfile_goto(struct zfile *fil, struct zcache *zc, avoff_t offset)
 #else
     res = zfile_seek(fil, zc, offset);
 #endif
-    AV_UNLOCK(zread_lock);
+    AV_UNLOCK(zc->datalock);
     if(res == 0)
         res = zfile_skip_to(fil, zc, offset);
     AV_UNLOCK(zc->lock);
@@ -745,8 +889,8 @@ static avssize_t av_zfile_do_pread(struct zfile *fil, struct zcache *zc,
     return res;
 }
 
-avssize_t av_zfile_pread(struct zfile *fil, struct zcache *zc, char *buf,
-                         avsize_t nbyte, avoff_t offset)
+static avssize_t zfile_pread(struct zfile *fil, struct zcache *zc, char *buf,
+                             avsize_t nbyte, avoff_t offset)
 {
     avssize_t res;
 
@@ -760,14 +904,28 @@ avssize_t av_zfile_pread(struct zfile *fil, struct zcache *zc, char *buf,
     return res;
 }
 
+static avssize_t zfile_page_read(void *fil, void *zc, char *buf,
+                                 avsize_t nbyte, avoff_t offset)
+{
+    return zfile_pread((struct zfile *) fil, (struct zcache *) zc, buf, nbyte,
+                       offset);
+}
+
+avssize_t av_zfile_pread(struct zfile *fil, struct zcache *zc, char *buf,
+                         avsize_t nbyte, avoff_t offset)
+{
+    return av_pagecache_pread(zc->id, zfile_page_read, fil, zc, buf, nbyte,
+                              offset);
+}
+
 int av_zfile_size(struct zfile *fil, struct zcache *zc, avoff_t *sizep)
 {
     int res;
     avoff_t size;
 
-    AV_LOCK(zread_lock);
+    AV_LOCK(zc->datalock);
     size = zc->size;
-    AV_UNLOCK(zread_lock);
+    AV_UNLOCK(zc->datalock);
 
     if(size != -1 || fil == NULL) {
         *sizep = size;
@@ -780,9 +938,9 @@ int av_zfile_size(struct zfile *fil, struct zcache *zc, avoff_t *sizep)
     if(res < 0)
         return res;
     
-    AV_LOCK(zread_lock);
+    AV_LOCK(zc->datalock);
     size = zc->size;
-    AV_UNLOCK(zread_lock);
+    AV_UNLOCK(zc->datalock);
     
     if(size == -1) {
         av_log(AVLOG_ERROR, "ZFILE: Internal error: could not find size");
@@ -796,9 +954,7 @@ int av_zfile_size(struct zfile *fil, struct zcache *zc, avoff_t *sizep)
 
 static void zfile_destroy(struct zfile *fil)
 {
-    AV_LOCK(zread_lock);
-    zfile_scache_save(fil->id, &fil->s, fil->calccrc, fil->iseof);
-    AV_UNLOCK(zread_lock);
+    zfile_park(fil);
 }
 
 struct zfile *av_zfile_new(vfile *vf, avoff_t dataoff, avuint crc, enum av_zfile_data_type data_type)
@@ -839,38 +995,49 @@ struct zfile *av_zfile_new(vfile *vf, avoff_t dataoff, avuint crc, enum av_zfile
 
 static void zcache_destroy(struct zcache *zc)
 {
-    struct zindex *zi;
-    struct zindex *nextzi;
-
+    av_streamcache_forget(zc->id);
+    av_pagecache_forget(zc->id);
     AV_FREELOCK(zc->lock);
-    av_del_tmpfile(zc->indexfile);
-    
-    for(zi = zc->indexes; zi != NULL; zi = nextzi) {
-        nextzi = zi->next;
-        av_free(zi);
+    AV_FREELOCK(zc->datalock);
+    if(zc->persistent) {
+        AV_LOCK(zindex_lock);
+        close(zc->indexfd);
+        AV_UNLOCK(zindex_lock);
+        av_free(zc->storehdr);
+        av_free(zc->indexfile);
     }
+    else
+        av_del_tmpfile(zc->indexfile);
+    
+    av_seekindex_free(&zc->indexes);
 }
 
-struct zcache *av_zcache_new()
+static struct zcache *zcache_alloc()
 {
     struct zcache *zc;
 
     AV_NEW_OBJ(zc, zcache_destroy);
     zc->indexfile = NULL;
     zc->nextindex = INDEXDISTANCE;
-    zc->indexes = NULL;
+    av_seekindex_init(&zc->indexes, sizeof(struct zindex));
     zc->filesize = 0;
     zc->size = -1;
     zc->crc_ok = 0;
+    zc->persistent = 0;
+    zc->indexfd = -1;
+    zc->storehdr = NULL;
+    zc->storehdrlen = 0;
     AV_INITLOCK(zc->lock);
+    AV_INITLOCK(zc->datalock);
+    zc->id = av_streamcache_newid();
 
-    AV_LOCK(zread_lock);
-    if(zread_nextid == 0)
-        zread_nextid = 1;
+    return zc;
+}
+
+struct zcache *av_zcache_new()
+{
+    struct zcache *zc = zcache_alloc();
 
-    zc->id = zread_nextid ++;
-    AV_UNLOCK(zread_lock);
-    
     av_get_tmpfile(&zc->indexfile);
     
     return zc;
@@ -878,5 +1045,216 @@ struct zcache *av_zcache_new()
 
 avoff_t av_zcache_size(struct zcache *zc)
 {
+    /* The persistent store does not use the temporary directory */
+    if(zc->persistent)
+        return 0;
+
     return zc->filesize;
 }
+
+#ifndef USE_SYSTEM_ZLIB
+static char *zindex_path(const char *dir, const char *key)
+{
+    avuquad hash = 14695981039346656037ULL;
+    const unsigned char *s;
+    char buf[32];
+
+    /* FNV-1a, the key itself is checked against the stored one */
+    for(s = (const unsigned char *) key; *s; s++) {
+        hash ^= *s;
+        hash *= 1099511628211ULL;
+    }
+    sprintf(buf, "/%016llx.zidx", hash);
+
+    return av_stradd(NULL, dir, buf, NULL);
+}
+
+/* The header of the store followed by the key */
+static char *zindex_new_header(const char *key, const struct avstat *sig,
+                               avsize_t *lenp)
+{
+    struct zindex_header hdr;
+    avsize_t keylen = strlen(key);
+    char *buf;
+
+    memset(&hdr, 0, sizeof(hdr));
+    strncpy(hdr.magic, ZINDEX_MAGIC, sizeof(hdr.magic));
+    hdr.abi = ZINDEX_ABI;
+    hdr.dev = sig->dev;
+    hdr.ino = sig->ino;
+    hdr.size = sig->size;
+    hdr.mtime_sec = sig->mtime.sec;
+    hdr.mtime_nsec = sig->mtime.nsec;
+    hdr.keylen = keylen;
+
+    buf = av_malloc(sizeof(hdr) + keylen);
+    memcpy(buf, &hdr, sizeof(hdr));
+    memcpy(buf + sizeof(hdr), key, keylen);
+
+    *lenp = sizeof(hdr) + keylen;
+    return buf;
+}
+
+static void zcache_insert_loaded(struct zcache *zc, avoff_t offset,
+                                 avoff_t indexoffset, avsize_t indexsize)
+{
+    struct zindex *zi;
+
+    /* Several processes may append to the same store, so records can
+       be out of order or duplicated */
+    zi = av_seekindex_add(&zc->indexes, offset);
+    if(zi == NULL)
+        return;
+
+    zi->indexoffset = indexoffset;
+    zi->indexsize = indexsize;
+
+    if(offset + INDEXDISTANCE > zc->nextindex)
+        zc->nextindex = offset + INDEXDISTANCE;
+}
+
+static int zindex_load(struct zcache *zc, int fd, avoff_t pos)
+{
+    struct stat stbuf;
+    struct zindex_record rec;
+
+    if(fstat(fd, &stbuf) == -1)
+        return -errno;
+
+    while(pos + (avoff_t) sizeof(rec) <= stbuf.st_size) {
+        if(pread(fd, &rec, sizeof(rec), pos) != sizeof(rec))
+            break;
+
+        if(rec.type == ZREC_STATE) {
+            if(rec.offset < 0 ||
+               pos + (avoff_t) sizeof(rec) + (avoff_t) rec.len > stbuf.st_size)
+                break;
+            zcache_insert_loaded(zc, rec.offset, pos + sizeof(rec), rec.len);
+            pos += sizeof(rec) + rec.len;
+        }
+        else if(rec.type == ZREC_SIZE) {
+            zc->size = rec.offset;
+            zc->crc_ok = (rec.len != 0);
+            pos += sizeof(rec);
+        }
+        else
+            break;
+    }
+
+    /* Cut off a record left incomplete by an interrupted writer */
+    if(pos < stbuf.st_size && ftruncate(fd, pos) == -1)
+        return -errno;
+
+    return 0;
+}
+
+/* Write a new store and move it in place of the old one, instead of
+   truncating it: other processes may still use the old store, and
+   keep appending to it without disturbing the new one. */
+static int zindex_create(const char *path, const char *hdr, avsize_t hdrlen)
+{
+    int fd;
+    char *tmppath;
+
+    tmppath = av_stradd(NULL, path, ".XXXXXX", NULL);
+    fd = mkstemp(tmppath);
+    if(fd == -1) {
+        av_free(tmppath);
+        return -EIO;
+    }
+
+    if(pwrite(fd, hdr, hdrlen, 0) != (ssize_t) hdrlen ||
+       rename(tmppath, path) == -1) {
+        unlink(tmppath);
+        close(fd);
+        av_free(tmppath);
+        return -EIO;
+    }
+    av_free(tmppath);
+
+    return fd;
+}
+
+static int zcache_open_store(struct zcache *zc, const char *dir,
+                             const char *key, const struct avstat *sig)
+{
+    int res;
+    int fd;
+    char *path;
+    char *hdr;
+    avsize_t hdrlen;
+
+    if(mkdir(dir, 0700) == -1 && errno != EEXIST) {
+        av_log(AVLOG_WARNING, "ZFILE: Cannot create index directory %s: %s",
+               dir, strerror(errno));
+        return -EIO;
+    }
+
+    path = zindex_path(dir, key);
+    hdr = zindex_new_header(key, sig, &hdrlen);
+
+    res = 0;
+    AV_LOCK(zindex_lock);
+    fd = open(path, O_RDWR, 0);
+    if(fd != -1) {
+        res = zindex_lockfile(fd, F_WRLCK);
+        if(res == 0) {
+            if(zindex_check_header(fd, hdr, hdrlen))
+                res = zindex_load(zc, fd, hdrlen);
+            else
+                res = -ESTALE;
+            zindex_lockfile(fd, F_UNLCK);
+        }
+        if(res < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    else if(errno != ENOENT)
+        res = -EIO;
+
+    if(fd == -1 && (res == 0 || res == -ESTALE)) {
+        fd = zindex_create(path, hdr, hdrlen);
+        res = fd < 0 ? fd : 0;
+    }
+    AV_UNLOCK(zindex_lock);
+
+    if(res < 0) {
+        av_log(AVLOG_WARNING, "ZFILE: Cannot use index store %s", path);
+        av_free(hdr);
+        av_free(path);
+        return res;
+    }
+
+    av_log(AVLOG_DEBUG, "ZFILE: using index store %s for %s", path, key);
+    zc->indexfile = path;
+    zc->indexfd = fd;
+    zc->storehdr = hdr;
+    zc->storehdrlen = hdrlen;
+    zc->persistent = 1;
+
+    return 0;
+}
+#endif
+
+/* Create a zcache which keeps its checkpoints in a persistent store
+   under 'dir', so the index survives restarts and can be shared with
+   other processes.  The store is identified by 'key' and only reused
+   if the signature (dev, ino, size, mtime) of the compressed file
+   matches.  Falls back to a temporary index if the store can't be
+   used. */
+struct zcache *av_zcache_new_persistent(const char *dir, const char *key,
+                                        const struct avstat *sig)
+{
+    struct zcache *zc = zcache_alloc();
+
+#ifndef USE_SYSTEM_ZLIB
+    if(dir != NULL && key != NULL &&
+       zcache_open_store(zc, dir, key, sig) == 0)
+        return zc;
+#endif
+
+    av_get_tmpfile(&zc->indexfile);
+
+    return zc;
+}
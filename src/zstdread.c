@@ -13,6 +13,9 @@
 #include "zstd.h"
 #include "oper.h"
 #include "exit.h"
+#include "seekindex.h"
+#include "streamcache.h"
+#include "pagecache.h"
 
 #include <stdlib.h>
 #include <inttypes.h>
@@ -24,18 +27,47 @@
 #define INBUFSIZE 16384
 #define OUTBUFSIZE 32768
 
-static int zstdread_nextid;
-static AV_LOCK_DECL(zstdread_lock);
+#define ZSTD_FRAME_MAGIC      0xFD2FB528U
+#define ZSTD_SKIPPABLE_MAGIC  0x184D2A50U
+#define ZSTD_SKIPPABLE_MASK   0xFFFFFFF0U
+#define ZSTD_SEEKTABLE_MAGIC  0x184D2A5EU
+#define ZSTD_SEEKABLE_MAGIC   0x8F92EAB1U
+#define ZSTD_SEEKTABLE_FOOTER 9
+
+
+struct zstdframe {
+    avoff_t uoff;  /* offset of frame in uncompressed data */
+    avoff_t coff;  /* offset of frame in compressed file */
+};
+
+enum {
+    ZSTDINDEX_UNKNOWN,
+    ZSTDINDEX_READY,
+    ZSTDINDEX_NONE,
+};
 
 struct zstdcache {
     int id;
     avoff_t size;
+
+    /* Frame index, built on first read */
+    avmutex lock;            /* protects the size and the index */
+    int indexstate;
+    struct seekindex frames;
+};
+
+/* A stream parked in the streamcache */
+struct zstdparked {
+    ZSTD_DStream *s;
+    avoff_t total_in;
+    int atframeend;
 };
 
 struct zstdfile {
     ZSTD_DStream *s;
     int iseof;
     int iserror;
+    int atframeend;
     int id; /* The id of the last used zstdcache */
     
     vfile *infile;
@@ -82,12 +114,68 @@ static int zstd_new_stream(ZSTD_DStream **resp)
     return 0;
 }
 
+static void zstdparked_release(void *stream)
+{
+    struct zstdparked *zp = (struct zstdparked *) stream;
+
+    zstd_delete_stream(zp->s);
+    av_free(zp);
+}
+
+/* Give the stream of fil to the streamcache.  The input buffer is
+   dropped, the stream continues at the first unused input byte. */
+static void zstdfile_park(struct zstdfile *fil)
+{
+    struct zstdparked *zp;
+
+    if(fil->id == 0 || fil->s == NULL || fil->iseof || fil->iserror) {
+        zstd_delete_stream(fil->s);
+        fil->s = NULL;
+        return;
+    }
+
+    AV_NEW(zp);
+    zp->s = fil->s;
+    zp->total_in = fil->total_in + fil->inBuffer.pos;
+    zp->atframeend = fil->atframeend;
+    av_streamcache_put(fil->id, fil->total_out, zp,
+                       sizeof(*zp) + ZSTD_sizeof_DStream(fil->s),
+                       zstdparked_release);
+    fil->s = NULL;
+}
+
+/* Continue with a parked stream, if there is one before offset and
+   less than maxdist behind it */
+static int zstdfile_unpark(struct zstdfile *fil, struct zstdcache *zc,
+                           avoff_t offset, avoff_t maxdist)
+{
+    struct zstdparked *zp;
+    avoff_t parkedoff;
+
+    zp = av_streamcache_get(zc->id, offset, maxdist, &parkedoff);
+    if(zp == NULL)
+        return 0;
+
+    zstdfile_park(fil);
+    fil->s = zp->s;
+    fil->iseof = 0;
+    fil->iserror = 0;
+    fil->atframeend = zp->atframeend;
+    fil->total_in = zp->total_in;
+    fil->total_out = parkedoff;
+    memset( &fil->inBuffer, 0, sizeof( fil->inBuffer ) );
+    av_free(zp);
+
+    return 1;
+}
+
 static int zstdfile_reset(struct zstdfile *fil)
 {
-    zstd_delete_stream(fil->s);
+    zstdfile_park(fil);
 
     fil->iseof = 0;
     fil->iserror = 0;
+    fil->atframeend = 0;
     fil->total_in = fil->total_out = 0;
     memset( &fil->inBuffer, 0, sizeof( fil->inBuffer ) );
     return zstd_new_stream(&fil->s);
@@ -137,6 +225,14 @@ static int zstdfile_decompress(struct zstdfile *fil, struct zstdcache *zc)
             if(res < 0)
                 return res;
             if(fil->inBuffer.size == 0) {
+                if(fil->atframeend) {
+                    /* no more frames follow */
+                    fil->iseof = 1;
+                    AV_LOCK(zc->lock);
+                    zc->size = fil->total_out;
+                    AV_UNLOCK(zc->lock);
+                    break;
+                }
                 /* still no byte available */
                 av_log(AVLOG_ERROR, "ZSTD: decompress error");
                 return -EIO;
@@ -156,14 +252,9 @@ static int zstdfile_decompress(struct zstdfile *fil, struct zstdcache *zc)
 
         fil->total_out += fil->outBuffer.pos - old_out_pos;
 
-        if (r == 0) {
-            //TODO docs are not clear if this really indicates end of file.
-            fil->iseof = 1;
-            AV_LOCK(zstdread_lock);
-            zc->size = fil->total_out;
-            AV_UNLOCK(zstdread_lock);
-            break;
-        }
+        /* A zero return only ends the current frame, the file may
+           contain more frames */
+        fil->atframeend = (r == 0);
 
         if (fil->outBuffer.pos == fil->outBuffer.size) {
             // everything we are requested for is available
@@ -230,6 +321,274 @@ static int zstdfile_skip_to(struct zstdfile *fil, struct zstdcache *zc,
     return 0;
 }
 
+static uint32_t zstd_le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint64_t zstd_le(const uint8_t *p, int len)
+{
+    uint64_t val = 0;
+    int i;
+
+    for(i = len - 1; i >= 0; i--)
+        val = (val << 8) | p[i];
+
+    return val;
+}
+
+static void zstdindex_add(struct seekindex *frames, avoff_t uoff,
+                          avoff_t coff)
+{
+    struct zstdframe *fr;
+
+    /* Empty frames share the offset of the next one, keep the first */
+    fr = av_seekindex_add(frames, uoff);
+    if(fr != NULL)
+        fr->coff = coff;
+}
+
+/* Use the seek table of the seekable zstd format, if the file has one */
+static int zstdindex_seektable(vfile *vf, avoff_t filesize,
+                               struct seekindex *frames, avoff_t *sizep)
+{
+    int res;
+    uint8_t footer[ZSTD_SEEKTABLE_FOOTER];
+    uint8_t *table;
+    uint32_t nframes;
+    int entrysize;
+    avoff_t tablesize;
+    avoff_t uoff = 0;
+    avoff_t coff = 0;
+    uint32_t i;
+
+    if(filesize < ZSTD_SEEKTABLE_FOOTER + 8)
+        return -EIO;
+
+    res = av_pread_all(vf, (char *) footer, ZSTD_SEEKTABLE_FOOTER,
+                       filesize - ZSTD_SEEKTABLE_FOOTER);
+    if(res < 0)
+        return res;
+
+    if(zstd_le32(footer + 5) != ZSTD_SEEKABLE_MAGIC)
+        return -EIO;
+
+    nframes = zstd_le32(footer);
+    entrysize = (footer[4] & 0x80) ? 12 : 8;
+    tablesize = (avoff_t) nframes * entrysize + ZSTD_SEEKTABLE_FOOTER;
+    if(tablesize + 8 > filesize || tablesize > (64 << 20))
+        return -EIO;
+
+    table = av_malloc(tablesize + 8);
+    res = av_pread_all(vf, (char *) table, tablesize + 8,
+                       filesize - tablesize - 8);
+    if(res >= 0 && (zstd_le32(table) != ZSTD_SEEKTABLE_MAGIC ||
+                    zstd_le32(table + 4) != tablesize))
+        res = -EIO;
+
+    for(i = 0; res >= 0 && i < nframes; i++) {
+        uint8_t *entry = table + 8 + i * entrysize;
+
+        zstdindex_add(frames, uoff, coff);
+        coff += zstd_le32(entry);
+        uoff += zstd_le32(entry + 4);
+    }
+    av_free(table);
+
+    if(res >= 0 && coff != filesize - tablesize - 8)
+        res = -EIO;
+    if(res < 0)
+        return res;
+
+    *sizep = uoff;
+    return 0;
+}
+
+/* Walk the frame and block headers to find the compressed size of a
+   frame.  The uncompressed size is only known if the frame header
+   contains it. */
+static int zstdindex_frame(vfile *vf, avoff_t coff, avoff_t *csizep,
+                           avoff_t *usizep)
+{
+    int res;
+    uint8_t hdr[18];
+    int desc;
+    int fcssize;
+    int didsize;
+    int hdrsize;
+    avoff_t pos;
+
+    res = av_pread_all(vf, (char *) hdr, 8, coff);
+    if(res < 0)
+        return res;
+
+    if((zstd_le32(hdr) & ZSTD_SKIPPABLE_MASK) == ZSTD_SKIPPABLE_MAGIC) {
+        *csizep = 8 + (avoff_t) zstd_le32(hdr + 4);
+        *usizep = 0;
+        return 0;
+    }
+    if(zstd_le32(hdr) != ZSTD_FRAME_MAGIC)
+        return -EIO;
+
+    desc = hdr[4];
+    switch(desc >> 6) {
+    case 0: fcssize = (desc & 0x20) ? 1 : 0; break;
+    case 1: fcssize = 2; break;
+    case 2: fcssize = 4; break;
+    default: fcssize = 8; break;
+    }
+    didsize = (desc & 3) == 3 ? 4 : (desc & 3);
+    hdrsize = 5 + ((desc & 0x20) ? 0 : 1) + didsize;
+
+    if(fcssize == 0)
+        return -EIO;
+
+    res = av_pread_all(vf, (char *) hdr, hdrsize + fcssize, coff);
+    if(res < 0)
+        return res;
+
+    *usizep = zstd_le(hdr + hdrsize, fcssize);
+    if(fcssize == 2)
+        *usizep += 256;
+
+    pos = coff + hdrsize + fcssize;
+    for(;;) {
+        uint8_t bhdr[3];
+        uint32_t bh;
+
+        res = av_pread_all(vf, (char *) bhdr, 3, pos);
+        if(res < 0)
+            return res;
+
+        bh = zstd_le(bhdr, 3);
+        pos += 3;
+        switch((bh >> 1) & 3) {
+        case 1: pos += 1; break;          /* RLE block */
+        case 3: return -EIO;              /* reserved */
+        default: pos += bh >> 3; break;
+        }
+        if(bh & 1)
+            break;
+    }
+    if(desc & 0x04)
+        pos += 4;                         /* content checksum */
+
+    *csizep = pos - coff;
+    return 0;
+}
+
+static int zstdindex_scan(vfile *vf, avoff_t filesize,
+                          struct seekindex *frames, avoff_t *sizep)
+{
+    int res;
+    avoff_t coff = 0;
+    avoff_t uoff = 0;
+
+    while(coff < filesize) {
+        avoff_t csize;
+        avoff_t usize;
+
+        res = zstdindex_frame(vf, coff, &csize, &usize);
+        if(res < 0)
+            return res;
+
+        if(usize != 0)
+            zstdindex_add(frames, uoff, coff);
+
+        coff += csize;
+        uoff += usize;
+    }
+    if(coff != filesize)
+        return -EIO;
+
+    *sizep = uoff;
+    return 0;
+}
+
+static void zstdcache_build_index(struct zstdcache *zc, vfile *vf)
+{
+    int res;
+    struct avstat stbuf;
+    struct seekindex frames;
+    avoff_t size;
+
+    av_seekindex_init(&frames, sizeof(struct zstdframe));
+    zc->indexstate = ZSTDINDEX_NONE;
+
+    res = av_fgetattr(vf, &stbuf, AVA_SIZE);
+    if(res < 0)
+        return;
+
+    res = zstdindex_seektable(vf, stbuf.size, &frames, &size);
+    if(res < 0) {
+        av_seekindex_free(&frames);
+        av_seekindex_init(&frames, sizeof(struct zstdframe));
+        res = zstdindex_scan(vf, stbuf.size, &frames, &size);
+    }
+
+    /* A single frame gives no advantage over the plain stream, but
+       the size is still good */
+    if(res == 0)
+        zc->size = size;
+    if(res < 0 || frames.num < 2) {
+        av_log(AVLOG_DEBUG, "ZSTD: no usable frame index");
+        av_seekindex_free(&frames);
+        return;
+    }
+
+    zc->frames = frames;
+
+    zc->indexstate = ZSTDINDEX_READY;
+    av_log(AVLOG_DEBUG, "ZSTD: frame index with %u frames", frames.num);
+}
+
+static int zstdcache_use_index(struct zstdcache *zc, vfile *vf)
+{
+    int state;
+
+    AV_LOCK(zc->lock);
+    if(zc->indexstate == ZSTDINDEX_UNKNOWN)
+        zstdcache_build_index(zc, vf);
+    state = zc->indexstate;
+    AV_UNLOCK(zc->lock);
+
+    return state == ZSTDINDEX_READY;
+}
+
+/* Find the last frame starting at or before offset */
+static int zstdcache_find_frame(struct zstdcache *zc, avoff_t offset)
+{
+    int n = av_seekindex_lookup(&zc->frames, offset);
+
+    return n < 0 ? 0 : n;
+}
+
+/* Restart decompression at the beginning of the frame containing
+   offset, unless the current position is already inside that frame
+   before offset */
+static int zstdfile_seek_frame(struct zstdfile *fil, struct zstdcache *zc,
+                               avoff_t offset)
+{
+    int res;
+    struct zstdframe *fr = av_seekindex_get(&zc->frames,
+                                          zstdcache_find_frame(zc, offset));
+
+    if(fil->total_out >= fr->uoff && fil->total_out <= offset)
+        return 0;
+
+    if(zstdfile_unpark(fil, zc, offset, offset - fr->uoff))
+        return 0;
+
+    res = zstdfile_reset(fil);
+    if(res < 0)
+        return res;
+
+    fil->total_in = fr->coff;
+    fil->total_out = fr->uoff;
+
+    return 0;
+}
+
 static avssize_t av_zstdfile_do_pread(struct zstdfile *fil, struct zstdcache *zc,
                                       char *buf, avsize_t nbyte, avoff_t offset)
 {
@@ -239,14 +598,24 @@ static avssize_t av_zstdfile_do_pread(struct zstdfile *fil, struct zstdcache *zc
     fil->id = zc->id;
 
     curroff = fil->total_out;
-    if(offset != curroff) {
-        AV_LOCK(zstdread_lock);
-        if ( curroff > offset ) {
+    if(offset != curroff && zstdcache_use_index(zc, fil->infile)) {
+        res = zstdfile_seek_frame(fil, zc, offset);
+        if(res < 0)
+            return res;
+
+        res = zstdfile_skip_to(fil, zc, offset);
+        if(res < 0)
+            return res;
+    }
+    else if(offset != curroff) {
+        if(zstdfile_unpark(fil, zc, offset,
+                           curroff > offset ? -1 : offset - curroff)) {
+            res = 0;
+        } else if ( curroff > offset ) {
             res = zstdfile_reset( fil );
         } else {
             res = 0;
         }
-        AV_UNLOCK(zstdread_lock);
         if(res < 0)
             return res;
 
@@ -260,8 +629,8 @@ static avssize_t av_zstdfile_do_pread(struct zstdfile *fil, struct zstdcache *zc
     return res;
 }
 
-avssize_t av_zstdfile_pread(struct zstdfile *fil, struct zstdcache *zc, char *buf,
-                            avsize_t nbyte, avoff_t offset)
+static avssize_t zstdfile_pread(struct zstdfile *fil, struct zstdcache *zc,
+                                char *buf, avsize_t nbyte, avoff_t offset)
 {
     avssize_t res;
 
@@ -275,14 +644,28 @@ avssize_t av_zstdfile_pread(struct zstdfile *fil, struct zstdcache *zc, char *bu
     return res;
 }
 
+static avssize_t zstdfile_page_read(void *fil, void *zc, char *buf,
+                                    avsize_t nbyte, avoff_t offset)
+{
+    return zstdfile_pread((struct zstdfile *) fil, (struct zstdcache *) zc,
+                          buf, nbyte, offset);
+}
+
+avssize_t av_zstdfile_pread(struct zstdfile *fil, struct zstdcache *zc, char *buf,
+                            avsize_t nbyte, avoff_t offset)
+{
+    return av_pagecache_pread(zc->id, zstdfile_page_read, fil, zc, buf, nbyte,
+                              offset);
+}
+
 int av_zstdfile_size(struct zstdfile *fil, struct zstdcache *zc, avoff_t *sizep)
 {
     int res;
     avoff_t size;
 
-    AV_LOCK(zstdread_lock);
+    AV_LOCK(zc->lock);
     size = zc->size;
-    AV_UNLOCK(zstdread_lock);
+    AV_UNLOCK(zc->lock);
 
     if(size != -1 || fil == NULL) {
         *sizep = size;
@@ -291,9 +674,17 @@ int av_zstdfile_size(struct zstdfile *fil, struct zstdcache *zc, avoff_t *sizep)
 
     fil->id = zc->id;
 
-    AV_LOCK(zstdread_lock);
+    /* The index knows the size without decompressing anything */
+    zstdcache_use_index(zc, fil->infile);
+    AV_LOCK(zc->lock);
+    size = zc->size;
+    AV_UNLOCK(zc->lock);
+    if(size != -1) {
+        *sizep = size;
+        return 0;
+    }
+
     res = zstdfile_reset( fil );
-    AV_UNLOCK(zstdread_lock);
     if(res < 0)
         return res;
 
@@ -301,9 +692,9 @@ int av_zstdfile_size(struct zstdfile *fil, struct zstdcache *zc, avoff_t *sizep)
     if(res < 0)
         return res;
     
-    AV_LOCK(zstdread_lock);
+    AV_LOCK(zc->lock);
     size = zc->size;
-    AV_UNLOCK(zstdread_lock);
+    AV_UNLOCK(zc->lock);
     
     if(size == -1) {
         av_log(AVLOG_ERROR, "ZSTD: Internal error: could not find size");
@@ -316,9 +707,7 @@ int av_zstdfile_size(struct zstdfile *fil, struct zstdcache *zc, avoff_t *sizep)
 
 static void zstdfile_destroy(struct zstdfile *fil)
 {
-    AV_LOCK(zstdread_lock);
-    zstd_delete_stream(fil->s);
-    AV_UNLOCK(zstdread_lock);
+    zstdfile_park(fil);
 }
 
 struct zstdfile *av_zstdfile_new(vfile *vf)
@@ -329,6 +718,7 @@ struct zstdfile *av_zstdfile_new(vfile *vf)
     AV_NEW_OBJ(fil, zstdfile_destroy);
     fil->iseof = 0;
     fil->iserror = 0;
+    fil->atframeend = 0;
     fil->infile = vf;
     fil->id = 0;
     fil->total_in = fil->total_out = 0;
@@ -343,6 +733,10 @@ struct zstdfile *av_zstdfile_new(vfile *vf)
 
 static void zstdcache_destroy(struct zstdcache *zc)
 {
+    av_streamcache_forget(zc->id);
+    av_pagecache_forget(zc->id);
+    av_seekindex_free(&zc->frames);
+    AV_FREELOCK(zc->lock);
 }
 
 struct zstdcache *av_zstdcache_new()
@@ -351,13 +745,10 @@ struct zstdcache *av_zstdcache_new()
 
     AV_NEW_OBJ(zc, zstdcache_destroy);
     zc->size = -1;
+    AV_INITLOCK(zc->lock);
+    zc->indexstate = ZSTDINDEX_UNKNOWN;
+    av_seekindex_init(&zc->frames, sizeof(struct zstdframe));
+    zc->id = av_streamcache_newid();
 
-    AV_LOCK(zstdread_lock);
-    if(zstdread_nextid == 0)
-        zstdread_nextid = 1;
-
-    zc->id = zstdread_nextid ++;
-    AV_UNLOCK(zstdread_lock);
-    
     return zc;
 }
@@ -0,0 +1,362 @@
+/* Reads files through /#ftp from a local FTP server: several readers
+   of one file at once, which should share a single transfer, and a
+   reader which pauses, during which the transfer should go on. */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <virtual.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#define FILESIZE (6 * 1048576 + 777)
+#define NUMREADERS 4
+#define NUMFILES 2
+
+static const char *filenames[NUMFILES] = { "shared.bin", "paused.bin" };
+static char *filedata;
+static int port;
+
+static pthread_mutex_t statlock = PTHREAD_MUTEX_INITIALIZER;
+static int retrs[NUMFILES];
+static int sent[NUMFILES];
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+    ssize_t res;
+
+    while(len > 0) {
+        res = write(fd, buf, len);
+        if(res <= 0)
+            return -1;
+        buf += res;
+        len -= res;
+    }
+    return 0;
+}
+
+static int reply(int fd, const char *msg)
+{
+    return write_all(fd, msg, strlen(msg));
+}
+
+static int read_line(int fd, char *buf, size_t size)
+{
+    size_t len = 0;
+
+    while(len < size - 1) {
+        if(read(fd, buf + len, 1) != 1)
+            return -1;
+        if(buf[len] == '\n') {
+            if(len > 0 && buf[len - 1] == '\r')
+                len--;
+            buf[len] = '\0';
+            return 0;
+        }
+        len++;
+    }
+    return -1;
+}
+
+static int listen_local(int *portp)
+{
+    int sock;
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(sock == -1 ||
+       bind(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+       listen(sock, 16) == -1 ||
+       getsockname(sock, (struct sockaddr *) &addr, &addrlen) == -1)
+        return -1;
+
+    *portp = ntohs(addr.sin_port);
+    return sock;
+}
+
+/* Send a file on the data connection.  The small send buffer makes the
+   transfer finish only if the client keeps reading. */
+static void send_file(int ctl, int datasock, int n)
+{
+    int fd;
+    int sndbuf = 65536;
+
+    fd = accept(datasock, NULL, NULL);
+    if(fd == -1) {
+        reply(ctl, "425 No data connection\r\n");
+        return;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+    pthread_mutex_lock(&statlock);
+    retrs[n]++;
+    pthread_mutex_unlock(&statlock);
+
+    reply(ctl, "150 Opening data connection\r\n");
+    if(write_all(fd, filedata, FILESIZE) == 0) {
+        pthread_mutex_lock(&statlock);
+        sent[n] = 1;
+        pthread_mutex_unlock(&statlock);
+    }
+    close(fd);
+    reply(ctl, "226 Transfer complete\r\n");
+}
+
+static void send_list(int ctl, int datasock)
+{
+    int fd;
+    int i;
+    char line[256];
+
+    fd = accept(datasock, NULL, NULL);
+    if(fd == -1) {
+        reply(ctl, "425 No data connection\r\n");
+        return;
+    }
+    reply(ctl, "150 Here comes the listing\r\n");
+    for(i = 0; i < NUMFILES; i++) {
+        sprintf(line, "-rw-r--r--   1 ftp ftp %i Jan 01  2020 %s\r\n",
+                FILESIZE, filenames[i]);
+        write_all(fd, line, strlen(line));
+    }
+    close(fd);
+    reply(ctl, "226 Directory send OK\r\n");
+}
+
+static void *serve_conn(void *arg)
+{
+    int ctl = (int) (long) arg;
+    int datasock = -1;
+    int dataport;
+    int i;
+    char line[1024];
+
+    reply(ctl, "220 Test server\r\n");
+    while(read_line(ctl, line, sizeof(line)) == 0) {
+        if(strncmp(line, "USER ", 5) == 0)
+            reply(ctl, "331 Password please\r\n");
+        else if(strncmp(line, "PASS ", 5) == 0)
+            reply(ctl, "230 Logged in\r\n");
+        else if(strcmp(line, "PWD") == 0)
+            reply(ctl, "257 \"/\"\r\n");
+        else if(strcmp(line, "SYST") == 0)
+            reply(ctl, "215 UNIX Type: L8\r\n");
+        else if(strncmp(line, "TYPE ", 5) == 0 ||
+                strcmp(line, "NOOP") == 0)
+            reply(ctl, "200 OK\r\n");
+        else if(strncmp(line, "CWD ", 4) == 0)
+            reply(ctl, "250 OK\r\n");
+        else if(strcmp(line, "PASV") == 0) {
+            if(datasock != -1)
+                close(datasock);
+            datasock = listen_local(&dataport);
+            sprintf(line, "227 Entering Passive Mode (127,0,0,1,%i,%i)\r\n",
+                    dataport >> 8, dataport & 0xff);
+            reply(ctl, line);
+        }
+        else if(strncmp(line, "LIST", 4) == 0)
+            send_list(ctl, datasock);
+        else if(strncmp(line, "RETR ", 5) == 0) {
+            for(i = 0; i < NUMFILES; i++) {
+                if(strcmp(line + 5, filenames[i]) == 0)
+                    break;
+            }
+            if(i == NUMFILES)
+                reply(ctl, "550 No such file\r\n");
+            else
+                send_file(ctl, datasock, i);
+        }
+        else if(strcmp(line, "QUIT") == 0) {
+            reply(ctl, "221 Bye\r\n");
+            break;
+        }
+        else
+            reply(ctl, "502 Not implemented\r\n");
+    }
+    if(datasock != -1)
+        close(datasock);
+    close(ctl);
+
+    return NULL;
+}
+
+static void *serve(void *arg)
+{
+    int lsock = (int) (long) arg;
+    int fd;
+    pthread_t t;
+
+    while((fd = accept(lsock, NULL, NULL)) != -1) {
+        pthread_create(&t, NULL, serve_conn, (void *) (long) fd);
+        pthread_detach(t);
+    }
+
+    return NULL;
+}
+
+static int check_read(int fd, off_t offset, size_t size)
+{
+    char *buf = malloc(size);
+    ssize_t res;
+    ssize_t exp = size;
+
+    if(offset + exp > FILESIZE)
+        exp = FILESIZE - offset;
+
+    res = virt_pread(fd, buf, size, offset);
+    if(res != exp || memcmp(buf, filedata + offset, exp) != 0) {
+        printf("FAILED: bad data at %lli\n", (long long) offset);
+        free(buf);
+        return -1;
+    }
+    free(buf);
+
+    return 0;
+}
+
+/* Read the whole file sequentially, then some parts of it again */
+static void *reader(void *arg)
+{
+    int n = (int) (long) arg;
+    int fd;
+    off_t off;
+    size_t chunk = 4096 << n;
+    char path[256];
+
+    sprintf(path, "/#ftp:127.0.0.1:%i/%s", port, filenames[0]);
+    fd = virt_open(path, O_RDONLY, 0);
+    if(fd < 0) {
+        printf("FAILED: open %s: %s\n", path, strerror(errno));
+        return (void *) -1L;
+    }
+
+    for(off = 0; off < FILESIZE; off += chunk) {
+        if(check_read(fd, off, chunk) == -1)
+            goto fail;
+    }
+    if(check_read(fd, FILESIZE, 100) == -1 ||
+       check_read(fd, 0, 100000) == -1 ||
+       check_read(fd, FILESIZE / 2 + n, 5000) == -1)
+        goto fail;
+
+    virt_close(fd);
+    return NULL;
+
+  fail:
+    virt_close(fd);
+    return (void *) -1L;
+}
+
+static int test_shared(void)
+{
+    pthread_t t[NUMREADERS];
+    void *res;
+    int i;
+    int failed = 0;
+
+    for(i = 0; i < NUMREADERS; i++)
+        pthread_create(&t[i], NULL, reader, (void *) (long) i);
+    for(i = 0; i < NUMREADERS; i++) {
+        pthread_join(t[i], &res);
+        if(res != NULL)
+            failed = 1;
+    }
+    if(failed)
+        return -1;
+
+    if(retrs[0] != 1) {
+        printf("FAILED: %i transfers for %i readers\n", retrs[0],
+               NUMREADERS);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int test_paused(void)
+{
+    int fd;
+    int i;
+    int done = 0;
+    char path[256];
+    off_t off;
+
+    sprintf(path, "/#ftp:127.0.0.1:%i/%s", port, filenames[1]);
+    fd = virt_open(path, O_RDONLY, 0);
+    if(fd < 0) {
+        printf("FAILED: open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if(check_read(fd, 0, 4096) == -1) {
+        virt_close(fd);
+        return -1;
+    }
+
+    /* The file is within the read-ahead window, so it is downloaded
+       while the reader does nothing */
+    for(i = 0; i < 100 && !done; i++) {
+        usleep(100000);
+        pthread_mutex_lock(&statlock);
+        done = sent[1];
+        pthread_mutex_unlock(&statlock);
+    }
+    if(!done) {
+        printf("FAILED: transfer stalled while the reader paused\n");
+        virt_close(fd);
+        return -1;
+    }
+
+    for(off = 4096; off < FILESIZE; off += 65536) {
+        if(check_read(fd, off, 65536) == -1) {
+            virt_close(fd);
+            return -1;
+        }
+    }
+    virt_close(fd);
+
+    if(retrs[1] != 1) {
+        printf("FAILED: %i transfers of a paused file\n", retrs[1]);
+        return -1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int lsock;
+    int i;
+    unsigned int x = 7;
+    pthread_t t;
+
+    filedata = malloc(FILESIZE);
+    for(i = 0; i < FILESIZE; i++) {
+        x = x * 1103515245 + 12345;
+        filedata[i] = x >> 16;
+    }
+
+    lsock = listen_local(&port);
+    if(lsock == -1) {
+        printf("FAILED: cannot start server\n");
+        return EXIT_FAILURE;
+    }
+    pthread_create(&t, NULL, serve, (void *) (long) lsock);
+    pthread_detach(t);
+
+    if(test_shared() == -1 || test_paused() == -1)
+        return EXIT_FAILURE;
+
+    printf("OK\n");
+
+    return 0;
+}
@@ -0,0 +1,277 @@
+/* Reads a file from a local HTTP server at scattered offsets, once from
+   a server which handles range requests, and once from one which
+   ignores them.  Checks the data read, and the requests made. */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <virtual.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#define FILESIZE (4 * 1048576 + 1234)
+#define BLOCKSIZE 65536
+#define NUMBLOCKS ((FILESIZE + BLOCKSIZE - 1) / BLOCKSIZE)
+#define READSIZE 4096
+#define MAXREQ 256
+
+struct request {
+    long long start;            /* -1 for a request without Range */
+    long long end;
+};
+
+static char *filedata;
+static int use_ranges;
+static struct request requests[MAXREQ];
+static int numreq;
+static pthread_mutex_t reqlock = PTHREAD_MUTEX_INITIALIZER;
+
+static const long long offsets[] = {
+    100, 3 * BLOCKSIZE - 100, 1048576 + 5, 2500000, FILESIZE - 1000,
+    700000, 101, 40 * BLOCKSIZE
+};
+#define NUMOFFSETS (int) (sizeof(offsets) / sizeof(offsets[0]))
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+    ssize_t res;
+
+    while(len > 0) {
+        res = write(fd, buf, len);
+        if(res <= 0)
+            return -1;
+        buf += res;
+        len -= res;
+    }
+    return 0;
+}
+
+/* Read a request header, and return the requested range in *startp and
+   *endp, or -1 if there was no Range header */
+static int read_request(int fd, long long *startp, long long *endp)
+{
+    char buf[4096];
+    size_t len = 0;
+    ssize_t res;
+    char *s;
+
+    while(len < 4 || memcmp(buf + len - 4, "\r\n\r\n", 4) != 0) {
+        if(len == sizeof(buf) - 1)
+            return -1;
+        res = read(fd, buf + len, 1);
+        if(res <= 0)
+            return -1;
+        len++;
+    }
+    buf[len] = '\0';
+
+    *startp = -1;
+    *endp = -1;
+    s = strstr(buf, "\r\nRange: bytes=");
+    if(s != NULL)
+        sscanf(s + 15, "%lld-%lld", startp, endp);
+
+    return 0;
+}
+
+static void *serve_conn(void *arg)
+{
+    int fd = (int) (long) arg;
+    long long start, end;
+    char hdr[256];
+
+    while(read_request(fd, &start, &end) == 0) {
+        pthread_mutex_lock(&reqlock);
+        if(numreq < MAXREQ) {
+            requests[numreq].start = start;
+            requests[numreq].end = end;
+        }
+        numreq++;
+        pthread_mutex_unlock(&reqlock);
+
+        if(!use_ranges || start < 0) {
+            start = 0;
+            end = FILESIZE - 1;
+            sprintf(hdr, "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n",
+                    FILESIZE);
+        }
+        else {
+            if(end >= FILESIZE)
+                end = FILESIZE - 1;
+            sprintf(hdr, "HTTP/1.1 206 Partial Content\r\n"
+                    "Content-Range: bytes %lld-%lld/%d\r\n"
+                    "Content-Length: %lld\r\n\r\n",
+                    start, end, FILESIZE, end - start + 1);
+        }
+        if(write_all(fd, hdr, strlen(hdr)) == -1 ||
+           write_all(fd, filedata + start, end - start + 1) == -1)
+            break;
+    }
+    close(fd);
+
+    return NULL;
+}
+
+static void *serve(void *arg)
+{
+    int lsock = (int) (long) arg;
+    int fd;
+    pthread_t t;
+
+    while((fd = accept(lsock, NULL, NULL)) != -1) {
+        pthread_create(&t, NULL, serve_conn, (void *) (long) fd);
+        pthread_detach(t);
+    }
+
+    return NULL;
+}
+
+static int start_server(void)
+{
+    int lsock;
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    pthread_t t;
+
+    lsock = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(lsock == -1 ||
+       bind(lsock, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+       listen(lsock, 16) == -1 ||
+       getsockname(lsock, (struct sockaddr *) &addr, &addrlen) == -1)
+        return -1;
+
+    pthread_create(&t, NULL, serve, (void *) (long) lsock);
+    pthread_detach(t);
+
+    return ntohs(addr.sin_port);
+}
+
+static int read_scattered(const char *path)
+{
+    int fd;
+    int i;
+    ssize_t res;
+    char buf[READSIZE];
+
+    fd = virt_open(path, O_RDONLY, 0);
+    if(fd < 0) {
+        printf("FAILED: open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    for(i = 0; i < NUMOFFSETS; i++) {
+        long long exp = FILESIZE - offsets[i];
+        if(exp > READSIZE)
+            exp = READSIZE;
+
+        res = virt_pread(fd, buf, READSIZE, offsets[i]);
+        if(res != exp || memcmp(buf, filedata + offsets[i], exp) != 0) {
+            printf("FAILED: bad data at %lld\n", offsets[i]);
+            virt_close(fd);
+            return -1;
+        }
+    }
+    virt_close(fd);
+
+    return 0;
+}
+
+/* The first request asks for the first byte, the others for the
+   aligned blocks which were read, each one once */
+static int check_range_requests(void)
+{
+    char touched[NUMBLOCKS];
+    char fetched[NUMBLOCKS];
+    int i;
+    long long b;
+
+    memset(touched, 0, sizeof(touched));
+    memset(fetched, 0, sizeof(fetched));
+    for(i = 0; i < NUMOFFSETS; i++) {
+        for(b = offsets[i] / BLOCKSIZE;
+            b * BLOCKSIZE < offsets[i] + READSIZE && b < NUMBLOCKS; b++)
+            touched[b] = 1;
+    }
+
+    if(numreq < 1 || numreq > MAXREQ ||
+       requests[0].start != 0 || requests[0].end != 0) {
+        printf("FAILED: no probe for range support\n");
+        return -1;
+    }
+
+    for(i = 1; i < numreq; i++) {
+        long long start = requests[i].start;
+        long long end = requests[i].end;
+
+        if(start < 0 || start % BLOCKSIZE != 0 ||
+           ((end + 1) % BLOCKSIZE != 0 && end != FILESIZE - 1)) {
+            printf("FAILED: unexpected range %lld-%lld\n", start, end);
+            return -1;
+        }
+        for(b = start / BLOCKSIZE; b <= end / BLOCKSIZE; b++) {
+            if(!touched[b] || fetched[b]) {
+                printf("FAILED: block %lld fetched needlessly\n", b);
+                return -1;
+            }
+            fetched[b] = 1;
+        }
+    }
+
+    if(memcmp(touched, fetched, NUMBLOCKS) != 0) {
+        printf("FAILED: a block read was not fetched\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int port;
+    int i;
+    unsigned int x = 1;
+    char path[256];
+
+    unsetenv("http_proxy");
+
+    filedata = malloc(FILESIZE);
+    for(i = 0; i < FILESIZE; i++) {
+        x = x * 1103515245 + 12345;
+        filedata[i] = x >> 16;
+    }
+
+    port = start_server();
+    if(port < 0) {
+        printf("FAILED: cannot start server\n");
+        return EXIT_FAILURE;
+    }
+
+    use_ranges = 1;
+    sprintf(path, "/#http:127.0.0.1:%i|ranges", port);
+    if(read_scattered(path) == -1 || check_range_requests() == -1)
+        return EXIT_FAILURE;
+
+    /* The file is downloaded once, with the response to the probe */
+    use_ranges = 0;
+    numreq = 0;
+    sprintf(path, "/#http:127.0.0.1:%i|noranges", port);
+    if(read_scattered(path) == -1)
+        return EXIT_FAILURE;
+    if(numreq != 1 || requests[0].start != 0) {
+        printf("FAILED: %i requests to a server without ranges\n", numreq);
+        return EXIT_FAILURE;
+    }
+
+    printf("OK\n");
+
+    return 0;
+}
@@ -0,0 +1,120 @@
+/* simple benchmark for concurrent positional reads through virt_pread.
+ * Every thread opens the given file on its own handle and reads it
+ * completely, the aggregate throughput is printed for 1, 2, 4, ...
+ * threads up to the given maximum.
+ *
+ * usage: preadbench [file] [maxthreads]
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <virtual.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+
+#define BENCH_BUFSIZE ( 128 * 1024 )
+
+struct bench_thread {
+    pthread_t thread;
+    const char *path;
+    off_t bytes;
+    int failed;
+};
+
+static void *bench_reader( void *arg )
+{
+    struct bench_thread *bt = arg;
+    char *buf;
+    off_t offset = 0;
+    ssize_t len;
+    int fd;
+
+    buf = malloc( BENCH_BUFSIZE );
+    fd = virt_open( bt->path, O_RDONLY, 0 );
+    if ( fd < 0 || buf == NULL ) {
+        bt->failed = 1;
+        free( buf );
+        return NULL;
+    }
+
+    for (;;) {
+        len = virt_pread( fd, buf, BENCH_BUFSIZE, offset );
+        if ( len < 0 ) {
+            bt->failed = 1;
+            break;
+        }
+        if ( len == 0 ) break;
+
+        offset += len;
+    }
+
+    bt->bytes = offset;
+
+    virt_close( fd );
+    free( buf );
+    return NULL;
+}
+
+static double now( void )
+{
+    struct timeval tv;
+
+    gettimeofday( &tv, NULL );
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+int main( int argc, char **argv )
+{
+    const char *path = "numchar.gz#";
+    int maxthreads = 8;
+    int nthreads, i;
+    struct stat stat_buf;
+
+    if ( argc > 1 ) path = argv[1];
+    if ( argc > 2 ) maxthreads = atoi( argv[2] );
+    if ( maxthreads < 1 ) maxthreads = 1;
+
+    if ( virt_stat( path, &stat_buf ) != 0 ) {
+        printf( "FAILED: could not stat %s: %s\n", path, strerror( errno ) );
+        return EXIT_FAILURE;
+    }
+
+    printf( "file: %s, size: %lu\n", path, (unsigned long) stat_buf.st_size );
+
+    for ( nthreads = 1; nthreads <= maxthreads; nthreads *= 2 ) {
+        struct bench_thread *bt;
+        off_t total = 0;
+        double start, elapsed;
+
+        bt = calloc( nthreads, sizeof( *bt ) );
+
+        start = now();
+        for ( i = 0; i < nthreads; i++ ) {
+            bt[i].path = path;
+            pthread_create( &bt[i].thread, NULL, bench_reader, &bt[i] );
+        }
+        for ( i = 0; i < nthreads; i++ ) {
+            pthread_join( bt[i].thread, NULL );
+            if ( bt[i].failed ) {
+                printf( "FAILED: read error in thread %d\n", i );
+                return EXIT_FAILURE;
+            }
+            total += bt[i].bytes;
+        }
+        elapsed = now() - start;
+
+        printf( "threads: %2d  bytes: %12lu  time: %8.3f s  throughput: %8.1f MiB/s\n",
+                nthreads, (unsigned long) total, elapsed,
+                elapsed > 0 ? total / elapsed / ( 1024 * 1024 ) : 0.0 );
+
+        free( bt );
+    }
+
+    return 0;
+}
@@ -0,0 +1,105 @@
+/* microbenchmark for av_ref_obj/av_unref_obj.  Every thread takes and
+ * drops references to a shared object, the number of ref/unref pairs
+ * per second is printed for 1, 2, 4, ... threads up to the given
+ * maximum.  A thread count with a private object per thread is run as
+ * well to show the uncontended cost.
+ *
+ * usage: refbench [maxthreads] [iterations]
+ */
+
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "avfs.h"
+
+struct bench_thread {
+    pthread_t thread;
+    void *obj;
+    long iterations;
+};
+
+struct bench_obj {
+    int dummy;
+};
+
+static void *bench_refs( void *arg )
+{
+    struct bench_thread *bt = arg;
+    long i;
+
+    for ( i = 0; i < bt->iterations; i++ ) {
+        av_ref_obj( bt->obj );
+        av_unref_obj( bt->obj );
+    }
+
+    return NULL;
+}
+
+static double now( void )
+{
+    struct timeval tv;
+
+    gettimeofday( &tv, NULL );
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void run( int nthreads, long iterations, int shared )
+{
+    struct bench_thread *bt;
+    struct bench_obj *sharedobj;
+    double start, elapsed;
+    int i;
+
+    AV_NEW_OBJ( sharedobj, NULL );
+    bt = calloc( nthreads, sizeof( *bt ) );
+
+    for ( i = 0; i < nthreads; i++ ) {
+        bt[i].iterations = iterations;
+        if ( shared ) {
+            bt[i].obj = sharedobj;
+        } else {
+            struct bench_obj *obj;
+
+            AV_NEW_OBJ( obj, NULL );
+            bt[i].obj = obj;
+        }
+    }
+
+    start = now();
+    for ( i = 0; i < nthreads; i++ ) {
+        pthread_create( &bt[i].thread, NULL, bench_refs, &bt[i] );
+    }
+    for ( i = 0; i < nthreads; i++ ) {
+        pthread_join( bt[i].thread, NULL );
+    }
+    elapsed = now() - start;
+
+    printf( "threads: %2d  %-8s  time: %8.3f s  %8.2f M ref/unref per s\n",
+            nthreads, shared ? "shared" : "private", elapsed,
+            elapsed > 0 ? nthreads * iterations / elapsed / 1000000.0 : 0.0 );
+
+    for ( i = 0; i < nthreads; i++ ) {
+        if ( !shared ) av_unref_obj( bt[i].obj );
+    }
+    av_unref_obj( sharedobj );
+    free( bt );
+}
+
+int main( int argc, char **argv )
+{
+    int maxthreads = 8;
+    long iterations = 1000000;
+    int nthreads;
+
+    if ( argc > 1 ) maxthreads = atoi( argv[1] );
+    if ( argc > 2 ) iterations = atol( argv[2] );
+    if ( maxthreads < 1 ) maxthreads = 1;
+
+    for ( nthreads = 1; nthreads <= maxthreads; nthreads *= 2 ) {
+        run( nthreads, iterations, 1 );
+        run( nthreads, iterations, 0 );
+    }
+
+    return 0;
+}